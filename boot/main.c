@@ -30,22 +30,30 @@
  **********************************************************************/
 
 #define SECTSIZE	512
+#define MAXSECTS	255	// sector count register is 8 bits
 #define ELFHDR		((struct Elf *) 0x10000) // scratch space
 
-void readsect(void*, uint32_t);
+void readsects(void*, uint32_t, uint32_t);
 void readseg(uint32_t, uint32_t, uint32_t);
+void bootfail(void) __attribute__((noreturn));
+
+// The last sector read from disk and where it went.
+// Only .text is loaded, so these have no initializer.
+static uint32_t last_sect, last_pa;
 
 void
 bootmain(void)
 {
 	struct Proghdr *ph, *eph;
 
+	last_sect = 0;
+
 	// read 1st page off disk
 	readseg((uint32_t) ELFHDR, SECTSIZE*8, 0);
 
 	// is this a valid ELF?
 	if (ELFHDR->e_magic != ELF_MAGIC)
-		goto bad;
+		bootfail();
 
 	// load each program segment (ignores ph flags)
 	ph = (struct Proghdr *) ((uint8_t *) ELFHDR + ELFHDR->e_phoff);
@@ -58,8 +66,12 @@ bootmain(void)
 	// call the entry point from the ELF header
 	// note: does not return!
 	((void (*)(void)) (ELFHDR->e_entry))();
+	bootfail();
+}
 
-bad:
+void
+bootfail(void)
+{
 	outw(0x8A00, 0x8A00);
 	outw(0x8A00, 0x8E00);
 	while (1)
@@ -81,45 +93,67 @@ readseg(uint32_t pa, uint32_t count, uint32_t offset)
 	// translate from bytes to sectors, and kernel starts at sector 1
 	offset = (offset / SECTSIZE) + 1;
 
-	// If this is too slow, we could read lots of sectors at a time.
-	// We'd write more to memory than asked, but it doesn't matter --
-	// we load in increasing order.
+	// Read lots of sectors at a time. We write more to memory than
+	// asked, but it doesn't matter -- we load in increasing order.
 	while (pa < end_pa) {
 		// Since we haven't enabled paging yet and we're using
 		// an identity segment mapping (see boot.S), we can
 		// use physical addresses directly.  This won't be the
 		// case once JOS enables the MMU.
-		readsect((uint8_t*) pa, offset);
-		pa += SECTSIZE;
-		offset++;
+		uint32_t n = (end_pa - pa + SECTSIZE - 1) / SECTSIZE;
+
+		if (offset == last_sect && pa == last_pa) {
+			// Already in place: the sector shared by the end of
+			// the previous segment and the start of this one
+			n = 1;
+		} else {
+			if (n > MAXSECTS)
+				n = MAXSECTS;
+			readsects((uint8_t*) pa, offset, n);
+		}
+		pa += n * SECTSIZE;
+		offset += n;
+		last_sect = offset - 1;
+		last_pa = pa - SECTSIZE;
 	}
 }
 
-void
+// Wait for disk ready (BSY clear) and return the status
+uint8_t
 waitdisk(void)
 {
-	// wait for disk reaady
-	while ((inb(0x1F7) & 0xC0) != 0x40)
+	uint8_t r;
+
+	while ((r = inb(0x1F7)) & 0x80)
 		/* do nothing */;
+	return r;
 }
 
+// Read 'count' (<= MAXSECTS) sectors starting at 'offset' with one command
 void
-readsect(void *dst, uint32_t offset)
+readsects(void *dst, uint32_t offset, uint32_t count)
 {
+	uint8_t r;
+
 	// wait for disk to be ready
 	waitdisk();
 
-	outb(0x1F2, 1);		// count = 1
+	outb(0x1F2, count);
 	outb(0x1F3, offset);
 	outb(0x1F4, offset >> 8);
 	outb(0x1F5, offset >> 16);
 	outb(0x1F6, (offset >> 24) | 0xE0);
 	outb(0x1F7, 0x20);	// cmd 0x20 - read sectors
 
-	// wait for disk to be ready
-	waitdisk();
+	while (count--) {
+		// wait for the next sector to be ready (DRQ), give up on ERR
+		while (!((r = waitdisk()) & 0x08))
+			if (r & 0x01)
+				bootfail();
 
-	// read a sector
-	insl(0x1F0, dst, SECTSIZE/4);
+		// read a sector
+		insl(0x1F0, dst, SECTSIZE/4);
+		dst += SECTSIZE;
+	}
 }
 
@@ -10,6 +10,13 @@
 #endif
 
 
+/* d_type */
+#define DT_DIR      4
+#define DT_REG      8
+
+/* getdents() packs records back to back, d_reclen gets from one to the next
+ * and only the bytes of d_name up to its null are there.
+ */
 struct dirent
 {
 	uint8_t d_type;				/* The type of the file */
@@ -18,5 +25,110 @@ struct dirent
 	char d_name[DFS_PATH_MAX];		/* The null-terminated file name */
 };
 
-int getdents(unsigned int fd, struct dirent *dirp, unsigned int count);
+/* readdirplus() record, what stat() would say comes along with the name */
+struct dirent_plus
+{
+	uint8_t d_type;				/* The type of the file */
+	uint8_t d_namlen;			/* The length of the not including the terminating null file name */
+	uint16_t d_reclen;			/* length of this record */
+	uint32_t d_size;			/* File size */
+	uint16_t d_date;			/* Modified date and time, FAT format */
+	uint16_t d_time;
+	uint8_t d_attr;				/* FAT attribute bits (AM_RDO, AM_DIR, ...) */
+	char d_name[DFS_PATH_MAX];		/* The null-terminated file name */
+};
+
+/* readv()/writev() fragment */
+#define IOV_MAX     64
+
+struct iovec
+{
+	void *iov_base;				/* Start of the fragment */
+	size_t iov_len;				/* Its length in bytes */
+};
+
+/* Submission/completion ring shared by a task and the kernel, see io_setup()
+ * and io_submit().  The task fills sqes[sq_tail % IORING_SQ_ENTRIES] and
+ * moves sq_tail, the kernel takes entries at sq_head and posts the results
+ * at cq_tail, the task reaps them from cq_head.  Results come back in
+ * submission order, matched by user_data.
+ */
+#define IORING_SQ_ENTRIES   32
+#define IORING_CQ_ENTRIES   64
+
+#define IORING_OP_NOP       0
+#define IORING_OP_OPEN      1       /* addr: path, len: open flags, res: fd */
+#define IORING_OP_CLOSE     2
+#define IORING_OP_READ      3       /* addr: buffer, off -1: at the file position */
+#define IORING_OP_WRITE     4
+#define IORING_OP_FSYNC     5
+
+struct io_sqe
+{
+	uint8_t opcode;				/* IORING_OP_* */
+	uint8_t rsv[3];
+	int32_t fd;
+	void *addr;
+	uint32_t len;
+	off_t off;
+	uint32_t user_data;			/* Copied to the completion */
+};
+
+struct io_cqe
+{
+	uint32_t user_data;
+	int32_t res;				/* What the system call would return */
+};
+
+struct io_ring
+{
+	volatile uint32_t sq_head;	/* Written by the kernel */
+	volatile uint32_t sq_tail;	/* Written by the task */
+	volatile uint32_t cq_head;	/* Written by the task */
+	volatile uint32_t cq_tail;	/* Written by the kernel */
+	struct io_sqe sqes[IORING_SQ_ENTRIES];
+	struct io_cqe cqes[IORING_CQ_ENTRIES];
+};
+
+/* Space of a mounted file system, see statfs() and getfsstat() */
+struct statfs
+{
+	char f_fstypename[16];		/* File system type, "elmfat", "tmpfs" */
+	char f_mntonname[32];		/* Mount point */
+	uint32_t f_bsize;			/* Allocation unit (FAT: cluster) in bytes */
+	uint32_t f_blocks;			/* Data blocks in the file system */
+	uint32_t f_bfree;			/* Free blocks */
+};
+
+/* Mount flags, see mount() */
+#define MNT_SYNC    0x0001  /* Write-through: durability over throughput */
+
+/* Per-device I/O statistics, see iostat() */
+#define DISK_STAT_READ      0
+#define DISK_STAT_WRITE     1
+#define DISK_LAT_BUCKETS    32      /* bucket i counts latencies in [2^i, 2^(i+1)) cycles */
+
+struct disk_stat
+{
+	char name[8];				/* Device name */
+	uint32_t ios[2];			/* Completed requests, per direction */
+	uint32_t sectors[2];		/* Sectors transferred */
+	uint32_t merges[2];			/* Adjacent sectors coalesced into one device command */
+	uint32_t cmds[2];			/* Commands issued to the device */
+	uint32_t inflight;			/* Requests being serviced right now */
+	uint32_t overlapped;		/* Requests started while another device was busy */
+	uint64_t busy_cycles;		/* TSC cycles with at least one request in flight */
+	uint64_t wait_cycles;		/* Sum of request latencies, busy_cycles weighted by depth */
+	uint32_t discards;			/* Trim requests passed to the device */
+	uint32_t discard_sectors;	/* Sectors released by them */
+	uint32_t lat_hist[2][DISK_LAT_BUCKETS];
+};
+
+int iostat(int dev, struct disk_stat *st);
+int mount(const char *source, const char *target, const char *fstype, int flags);
+int umount(const char *target);
+int statfs(const char *path, struct statfs *buf);
+int getfsstat(struct statfs *buf, int count);
+int io_setup(struct io_ring **ring);
+int io_submit(unsigned int to_submit);
 #endif
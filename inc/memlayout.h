@@ -141,6 +141,9 @@
 // Physical address of startup code for non-boot CPUs (APs)
 #define MPENTRY_PADDR	0x7000
 
+// The boot loader leaves its starting TSC here (in page 0, never allocated)
+#define BOOT_TSC_PADDR	0x500
+
 #ifndef __ASSEMBLER__
 
 typedef uint32_t pte_t;
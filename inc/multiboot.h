@@ -0,0 +1,54 @@
+#ifndef JOS_INC_MULTIBOOT_H
+#define JOS_INC_MULTIBOOT_H
+
+/* Multiboot (version 0.6.96) definitions, just enough to be loaded by
+ * GRUB or `qemu -kernel` and to read the memory map it hands us.
+ *  Reference: https://www.gnu.org/software/grub/manual/multiboot/multiboot.html
+ */
+
+#define MULTIBOOT_HEADER_MAGIC      0x1BADB002
+#define MULTIBOOT_BOOTLOADER_MAGIC  0x2BADB002  // in %eax on entry
+
+// Header flags
+#define MULTIBOOT_PAGE_ALIGN        0x00000001  // modules on page boundaries
+#define MULTIBOOT_MEMORY_INFO       0x00000002  // we want mem_* and mmap_*
+
+// Info flags, which fields of struct multiboot_info are valid
+#define MULTIBOOT_INFO_MEMORY       0x00000001
+#define MULTIBOOT_INFO_MEM_MAP      0x00000040
+
+// Memory map entry types
+#define MULTIBOOT_MEMORY_AVAILABLE  1
+
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+
+struct multiboot_info {
+	uint32_t flags;
+	uint32_t mem_lower;         // KB from 0
+	uint32_t mem_upper;         // KB from 1MB
+	uint32_t boot_device;
+	uint32_t cmdline;
+	uint32_t mods_count;
+	uint32_t mods_addr;
+	uint32_t syms[4];
+	uint32_t mmap_length;
+	uint32_t mmap_addr;
+} __attribute__((packed));
+
+// 'size' does not count itself, the next entry is at (char *)&size + size + 4
+struct multiboot_mmap_entry {
+	uint32_t size;
+	uint64_t addr;
+	uint64_t len;
+	uint32_t type;
+} __attribute__((packed));
+
+// Saved by entry.S, magic is 0 when our own boot loader started us
+extern uint32_t multiboot_magic;
+extern physaddr_t multiboot_info_pa;
+
+#endif /* !__ASSEMBLER__ */
+
+#endif /* !JOS_INC_MULTIBOOT_H */
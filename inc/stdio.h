@@ -28,6 +28,7 @@
 #define STATUS_ENOTDIR		20		/* Not a directory */
 #define STATUS_EISDIR		21		/* Is a directory */
 #define STATUS_EINVAL		22		/* Invalid argument */
+#define STATUS_EMFILE		24		/* Too many open files */
 #define STATUS_ENOSPC		28		/* No space left on device */
 #define STATUS_EROFS		30		/* Read-only file system */
 #define STATUS_ENOSYS		38		/* Function not implemented */
@@ -48,6 +49,10 @@
 #define SEEK_CUR         1
 #define SEEK_END         2
 
+/* ioctl() commands */
+#define FIO_FASTSEEK     1      /* arg int *: 1 builds the cluster link map, 0 drops it.
+                                 * Returns the number of fragments of the file. */
+
 /* File flags */
 #define F_OPEN			0x01000000
 #define F_DIRECTORY		0x02000000
@@ -105,9 +110,20 @@ int open(const char *file, int flags, int mode);
 int close(int d);
 int read(int fd, void *buf, size_t len);
 int write(int fd, const void *buf, size_t len);
+int pread(int fd, void *buf, size_t len, off_t offset);
+int pwrite(int fd, const void *buf, size_t len, off_t offset);
+int readv(int fd, const struct iovec *iov, int iovcnt);
+int writev(int fd, const struct iovec *iov, int iovcnt);
+int copy_file_range(int fd_in, int fd_out, size_t len);
 
 off_t lseek(int fd, off_t offset, int whence);
+int fallocate(int fd, off_t len);
 
 int unlink(const char *pathname);
+int mkdir(const char *pathname);
+
+int fsync(int fd);
+int sync(void);
+int ioctl(int fd, int cmd, void *arg);
 
 #endif /* !JOS_INC_STDIO_H */
@@ -1,6 +1,7 @@
 #ifndef USR_SYSCALL_H
 #define USR_SYSCALL_H
 #include <inc/types.h>
+#include <inc/fs.h>
 #include <kernel/fs/fat/ff.h>
 
 /* system call numbers */
@@ -27,6 +28,25 @@ enum {
     SYS_readdir,
     SYS_closedir,
     SYS_stat,
+    SYS_fsync,
+    SYS_sync,
+    SYS_iostat,
+    SYS_ioctl,
+    SYS_mkdir,
+    SYS_mount,
+    SYS_umount,
+    SYS_getdents,
+    SYS_readdirplus,
+    SYS_pread,
+    SYS_pwrite,
+    SYS_readv,
+    SYS_writev,
+    SYS_io_setup,
+    SYS_io_submit,
+    SYS_fallocate,
+    SYS_statfs,
+    SYS_getfsstat,
+    SYS_copy_file_range,
     NSYSCALLS
 };
 
@@ -42,17 +62,38 @@ void kill_self();
 void sleep(uint32_t ticks);
 void puts(const char *s, size_t len);
 int getc(void);
+int getdents(DIR *dir, struct dirent *dirp, unsigned int count);
+int readdirplus(DIR *dir, struct dirent_plus *dirp, unsigned int count);
 
 /*********** Lab7 ************/
 int sys_open(const char *file, int flags, int mode);
 int sys_close(int d);
 int sys_read(int fd, void *buf, size_t len);
 int sys_write(int fd, const void *buf, size_t len);
+int sys_pread(int fd, void *buf, size_t len, off_t offset);
+int sys_pwrite(int fd, const void *buf, size_t len, off_t offset);
+int sys_readv(int fd, const struct iovec *iov, int iovcnt);
+int sys_writev(int fd, const struct iovec *iov, int iovcnt);
+int sys_copy_file_range(int fd_in, int fd_out, size_t len);
+int sys_io_setup(struct io_ring **ring);
+int sys_io_submit(unsigned int to_submit);
 off_t sys_lseek(int fd, off_t offset, int whence);
+int sys_fallocate(int fd, off_t len);
 int sys_unlink(const char *pathname);
 int sys_opendir(DIR *dir, const char *pathname);
 //int sys_readdir(int fd,  char *buf ,int *type, unsigned long *size);
 int sys_readdir(DIR *dir, FILINFO *fno);
 int sys_closedir(DIR *dir);
 int sys_stat(const char *pathname, FILINFO *fno);
+int sys_fsync(int fd);
+int sys_sync(void);
+int sys_iostat(int dev, struct disk_stat *st);
+int sys_ioctl(int fd, int cmd, void *arg);
+int sys_mkdir(const char *pathname);
+int sys_mount(const char *source, const char *target, const char *fstype, int flags);
+int sys_umount(const char *target);
+int sys_statfs(const char *path, struct statfs *buf);
+int sys_getfsstat(struct statfs *buf, int count);
+int sys_getdents(DIR *dir, struct dirent *dirp, unsigned int count);
+int sys_readdirplus(DIR *dir, struct dirent_plus *dirp, unsigned int count);
 #endif
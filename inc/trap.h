@@ -38,6 +38,7 @@
 #define IRQ_SPURIOUS     7
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_NVME        24		// MSI-X, see kernel/drv/nvme.c
 
 #ifndef __ASSEMBLER__
 
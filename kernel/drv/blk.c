@@ -0,0 +1,69 @@
+/* Block device registry, maps FatFs physical drive numbers to disks */
+
+#include "blk.h"
+#include "disk.h"
+#include "nvme.h"
+#include "ramdisk.h"
+#include <inc/stdio.h>
+#include <inc/string.h>
+
+static struct blkdev *blk_devs[BLK_MAX];
+static int nblk;
+
+int
+blk_register(struct blkdev *bd)
+{
+	if (nblk == BLK_MAX) {
+		printk("blk: no slot for %s\n", bd->name);
+		return -1;
+	}
+	blk_devs[nblk] = bd;
+	strcpy(bd->stat.name, bd->name);
+	printk(" blk%d: %s, %d sectors%s\n", nblk, bd->name, bd->sectors,
+			bd->boot ? " (boot)" : "");
+	return nblk++;
+}
+
+int
+blk_count(void)
+{
+	return nblk;
+}
+
+struct blkdev *
+blk_get(int pdrv)
+{
+	if (pdrv < 0 || pdrv >= nblk)
+		return NULL;
+	return blk_devs[pdrv];
+}
+
+struct blkdev *
+blk_find(const char *name)
+{
+	int i;
+	for (i = 0; i < nblk; i++)
+		if (!strcmp(blk_devs[i]->name, name))
+			return blk_devs[i];
+	return NULL;
+}
+
+/* Paths without a drive number go to FatFs volume 0, so the root disk is
+ * registered first: the NVMe namespace when there is one, else the primary
+ * slave (hdb).  The boot disk (hda) and the RAM disk go last.
+ */
+void
+blk_init(void)
+{
+	static const char order[] = { 1, 2, 3, 0 };   // ide_devices[] by channel/drive
+	struct blkdev *bd;
+	int i;
+
+	if ((bd = nvme_blk_probe()) != NULL)
+		blk_register(bd);
+	for (i = 0; i < sizeof(order); i++)
+		if ((bd = ide_blk_probe(order[i] >> 1, order[i] & 1)) != NULL)
+			blk_register(bd);
+	if ((bd = ramdisk_blk_probe()) != NULL)
+		blk_register(bd);
+}
@@ -0,0 +1,41 @@
+#ifndef BLK_H
+#define BLK_H
+
+#include <inc/types.h>
+#include <inc/fs.h>
+
+/* Block device registry.
+ *  Every disk the kernel can put a file system on registers a struct blkdev
+ *  here.  The registry index is the FatFs physical drive number (pdrv), and
+ *  without _MULTI_PARTITION also the volume number used in "N:/path".
+ */
+
+#define BLK_MAX     6       // hda-hdd, nvme0 and ram0, must equal _VOLUMES in ffconf.h
+#define BLK_SECTOR_SIZE 512
+
+struct blkdev {
+	char     name[8];
+	uint32_t sectors;       // capacity
+	uint32_t max_sects;     // largest single device command
+	int      unit;          // driver private, e.g. index in ide_devices[]
+	int      boot;          // holds the boot block and kernel, never formatted
+	int      write_through; // see MNT_SYNC
+
+	// Return 0 on success. fua: complete only once data is on stable media
+	int (*read)  (struct blkdev *bd, uint32_t lba, uint32_t count, void *buf);
+	int (*write) (struct blkdev *bd, uint32_t lba, uint32_t count, const void *buf, int fua);
+	int (*flush) (struct blkdev *bd);
+	// Sectors no longer in use by the file system, NULL if unsupported
+	int (*trim)  (struct blkdev *bd, uint32_t lba, uint32_t count);
+
+	struct disk_stat stat;  // maintained by diskio
+	uint64_t busy_since;
+};
+
+void blk_init(void);
+int  blk_register(struct blkdev *bd);
+int  blk_count(void);
+struct blkdev *blk_get(int pdrv);
+struct blkdev *blk_find(const char *name);
+
+#endif
@@ -3,18 +3,16 @@
  */
 
 #include "disk.h"
+#include "blk.h"
 #include <inc/x86.h>
 #include <inc/mmu.h>
+#include <inc/string.h>
+#include <kernel/mem.h>
 
 #define SECTOR_SIZE 512
 #define FALSE 0
 #define TRUE 1
 
-unsigned char ide_buf[2048] = {0};
-unsigned static char ide_irq_invoked = 0;
-
-unsigned static char ide_status = 0;
-
 void ide_initialize(unsigned int BAR0, unsigned int BAR1, unsigned int BAR2, unsigned int BAR3, unsigned int BAR4);
 unsigned char ide_read(unsigned char channel, unsigned char reg);
 void ide_write(unsigned char channel, unsigned char reg, unsigned char data);
@@ -25,15 +23,71 @@ unsigned char ide_ata_access(unsigned char direction, unsigned char drive, unsig
 		unsigned char numsects, unsigned short selector, unsigned int edi);
 
 
-unsigned char get_status() {
-    return ide_status;
+/* Error code of the last command on the channel of drive */
+unsigned char get_status(unsigned char drive) {
+    if (drive > 3 || ide_devices[drive].Reserved == 0)
+        return 0x1;
+    return channels[ide_devices[drive].Channel].status;
+}
+
+/* Take the channel of drive for one command */
+static struct IDEChannelRegisters *ide_channel_get(unsigned char drive)
+{
+	unsigned char channel = ide_devices[drive].Channel;
+	struct IDEChannelRegisters *ch = &channels[channel];
+
+	spin_lock(&ch->lock);
+	ch->inflight++;
+	ch->cmds++;
+	if (channels[!channel].inflight)
+		ch->overlapped++;
+	return ch;
+}
+
+static int ide_channel_put(struct IDEChannelRegisters *ch, unsigned char status)
+{
+	ch->status = status;
+	ch->inflight--;
+	spin_unlock(&ch->lock);
+	return -status;
+}
+
+/* Bus Master IDE registers found by pci_init(), 0 without a PCI IDE function */
+static unsigned int ide_bm_base;
+
+/* The PCI function only adds the bus master, the channels stay at the
+ * legacy ports.
+ */
+int ide_pci_attach(struct pci_func *pcif)
+{
+	pci_func_enable(pcif);
+	ide_bm_base = pcif->reg_base[4];
+	return 1;
+}
+
+/* One page per channel for DMA: the PRD table, then the TRIM range list.
+ * A page never crosses the 64KB boundary a PRD must not cross.
+ */
+static void ide_dma_init(unsigned char channel)
+{
+	struct PageInfo *pp = page_alloc(ALLOC_ZERO);
+
+	if (!pp)
+		return;
+	pp->pp_ref++;
+	channels[channel].prd = page2kva(pp);
+	channels[channel].dsm = (unsigned long long *)((char *)channels[channel].prd + SECTOR_SIZE);
 }
 
 int disk_init()
 {
 	static unsigned char init = FALSE;
 	if(!init){
-		ide_initialize(0x1F0, 0x3F6, 0x170, 0x376, 0x000);
+		ide_initialize(0x1F0, 0x3F6, 0x170, 0x376, ide_bm_base);
+		if (ide_bm_base) {
+			ide_dma_init(ATA_PRIMARY);
+			ide_dma_init(ATA_SECONDARY);
+		}
 		init = TRUE;
 	}
 	return 0;
@@ -83,58 +137,53 @@ void disk_test()
 
 int ide_read_sectors(unsigned char drive, unsigned char numsects, unsigned int lba,
 		unsigned int edi) {
-	int retVal = 0;
+	struct IDEChannelRegisters *ch;
+	unsigned char err = 0;
 	// 1: Check if the drive presents:
 	// ==================================
-	if (drive > 3 || ide_devices[drive].Reserved == 0) ide_status = 0x1;      // Drive Not Found!
+	if (drive > 3 || ide_devices[drive].Reserved == 0)
+		return -0x1;      // Drive Not Found!
 
 	// 2: Check if inputs are valid:
 	// ==================================
-	else if (((lba + numsects) > ide_devices[drive].Size) && (ide_devices[drive].Type == IDE_ATA))
-		ide_status = 0x2;                     // Seeking to invalid position.
+	if (((lba + numsects) > ide_devices[drive].Size) && (ide_devices[drive].Type == IDE_ATA))
+		return -0x2;                     // Seeking to invalid position.
 
 	// 3: Read in PIO Mode through Polling & IRQs:
 	// ============================================
-	else {
-		unsigned char err;
-		if (ide_devices[drive].Type == IDE_ATA)
-		{
-			err = ide_ata_access(ATA_READ, drive, lba, numsects, GD_KD, edi);
-			//printk("read code=%d\n", err);
-		}
-		else if (ide_devices[drive].Type == IDE_ATAPI)
-			panic("ATAPI not supported!");
-		// for (i = 0; i < numsects; i++)
-		//    err = ide_atapi_read(drive, lba + i, 1, es, edi + (i*2048));
-		ide_status = ide_print_error(drive, err);
+	ch = ide_channel_get(drive);
+	if (ide_devices[drive].Type == IDE_ATA)
+	{
+		err = ide_ata_access(ATA_READ, drive, lba, numsects, GD_KD, edi);
+		//printk("read code=%d\n", err);
 	}
-	// printk("ide_status = %x ,min:%x\n",ide_status,-0x2);
-	return -ide_status;
+	else if (ide_devices[drive].Type == IDE_ATAPI)
+		panic("ATAPI not supported!");
+	// for (i = 0; i < numsects; i++)
+	//    err = ide_atapi_read(drive, lba + i, 1, es, edi + (i*2048));
+	return ide_channel_put(ch, ide_print_error(drive, err));
 }
 
 int ide_write_sectors(unsigned char drive, unsigned char numsects, unsigned int lba,
 		unsigned int edi) {
-	int retVal = 0;
+	struct IDEChannelRegisters *ch;
+	unsigned char err = 0;
 	// 1: Check if the drive presents:
 	// ==================================
 	if (drive > 3 || ide_devices[drive].Reserved == 0)
-		ide_status = 0x1;      // Drive Not Found!
+		return -0x1;      // Drive Not Found!
 	// 2: Check if inputs are valid:
 	// ==================================
-	else if (((lba + numsects) > ide_devices[drive].Size) && (ide_devices[drive].Type == IDE_ATA))
-		ide_status = 0x2;                     // Seeking to invalid position.
-	// 3: Read in PIO Mode through Polling & IRQs:
+	if (((lba + numsects) > ide_devices[drive].Size) && (ide_devices[drive].Type == IDE_ATA))
+		return -0x2;                     // Seeking to invalid position.
+	// 3: Write in PIO Mode through Polling & IRQs:
 	// ============================================
-	else {
-		unsigned char err;
-		if (ide_devices[drive].Type == IDE_ATA)
-			err = ide_ata_access(ATA_WRITE, drive, lba, numsects, GD_KD, edi);
-		else if (ide_devices[drive].Type == IDE_ATAPI)
-			err = 4; // Write-Protected.
-		ide_status = ide_print_error(drive, err);
-	}
-
-	return -ide_status;
+	ch = ide_channel_get(drive);
+	if (ide_devices[drive].Type == IDE_ATA)
+		err = ide_ata_access(ATA_WRITE, drive, lba, numsects, GD_KD, edi);
+	else if (ide_devices[drive].Type == IDE_ATAPI)
+		err = 4; // Write-Protected.
+	return ide_channel_put(ch, ide_print_error(drive, err));
 }
 
 static void __delay(int ms)
@@ -154,6 +203,8 @@ void ide_initialize(unsigned int BAR0, unsigned int BAR1, unsigned int BAR2, uns
 	channels[ATA_SECONDARY].ctrl  = (BAR3 & 0xFFFFFFFC) + 0x376 * (!BAR3);
 	channels[ATA_PRIMARY  ].bmide = (BAR4 & 0xFFFFFFFC) + 0; // Bus Master IDE
 	channels[ATA_SECONDARY].bmide = (BAR4 & 0xFFFFFFFC) + 8; // Bus Master IDE
+	spin_initlock(&channels[ATA_PRIMARY].lock);
+	spin_initlock(&channels[ATA_SECONDARY].lock);
 	// 2- Disable IRQs:
 	ide_write(ATA_PRIMARY  , ATA_REG_CONTROL, 2);
 	ide_write(ATA_SECONDARY, ATA_REG_CONTROL, 2);
@@ -200,34 +251,36 @@ void ide_initialize(unsigned int BAR0, unsigned int BAR1, unsigned int BAR2, uns
 			}
 
 			// (V) Read Identification Space of the Device:
-			ide_read_buffer(i, ATA_REG_DATA, (unsigned int) ide_buf, 128);
+			ide_read_buffer(i, ATA_REG_DATA, (unsigned int) channels[i].buf, 128);
 
 			// (VI) Read Device Parameters:
 			ide_devices[count].Reserved     = 1;
 			ide_devices[count].Type         = type;
 			ide_devices[count].Channel      = i;
 			ide_devices[count].Drive        = j;
-			ide_devices[count].Signature    = *((unsigned short *)(ide_buf + ATA_IDENT_DEVICETYPE));
-			ide_devices[count].Capabilities = *((unsigned short *)(ide_buf + ATA_IDENT_CAPABILITIES));
-			ide_devices[count].CommandSets  = *((unsigned int *)(ide_buf + ATA_IDENT_COMMANDSETS));
+			ide_devices[count].Signature    = *((unsigned short *)(channels[i].buf + ATA_IDENT_DEVICETYPE));
+			ide_devices[count].Capabilities = *((unsigned short *)(channels[i].buf + ATA_IDENT_CAPABILITIES));
+			ide_devices[count].CommandSets  = *((unsigned int *)(channels[i].buf + ATA_IDENT_COMMANDSETS));
+			ide_devices[count].Trim         = (type == IDE_ATA) &&
+				(*((unsigned short *)(channels[i].buf + ATA_IDENT_DSM)) & 0x1);
 
 			// (VII) Get Size:
 			if (ide_devices[count].CommandSets & (1 << 26))
 			{
 				// Device uses 48-Bit Addressing:
 				//printk("Device %d use 48-Bit Addressing\n", count);
-				ide_devices[count].Size   = *((unsigned int *)(ide_buf + ATA_IDENT_MAX_LBA_EXT));
+				ide_devices[count].Size   = *((unsigned int *)(channels[i].buf + ATA_IDENT_MAX_LBA_EXT));
 			}
 			else{
 				// Device uses CHS or 28-bit Addressing:
 				//printk("Device %d use CHS Addressing\n", count);
-				ide_devices[count].Size   = *((unsigned int *)(ide_buf + ATA_IDENT_MAX_LBA));
+				ide_devices[count].Size   = *((unsigned int *)(channels[i].buf + ATA_IDENT_MAX_LBA));
 			}
 
 			// (VIII) String indicates model of device (like Western Digital HDD and SONY DVD-RW...):
 			for(k = 0; k < 40; k += 2) {
-				ide_devices[count].Model[k] = ide_buf[ATA_IDENT_MODEL + k + 1];
-				ide_devices[count].Model[k + 1] = ide_buf[ATA_IDENT_MODEL + k];}
+				ide_devices[count].Model[k] = channels[i].buf[ATA_IDENT_MODEL + k + 1];
+				ide_devices[count].Model[k + 1] = channels[i].buf[ATA_IDENT_MODEL + k];}
 			ide_devices[count].Model[40] = 0; // Terminate String.
 
 			count++;
@@ -236,10 +289,11 @@ void ide_initialize(unsigned int BAR0, unsigned int BAR1, unsigned int BAR2, uns
 	// 4- Print Summary:
 	for (i = 0; i < 4; i++)
 		if (ide_devices[i].Reserved == 1) {
-			printk(" Slot %d found %s Drive %dMB - %s\n", i,
+			printk(" Slot %d found %s Drive %dMB - %s%s\n", i,
 					(const char *[]){"ATA", "ATAPI"}[ide_devices[i].Type],         /* Type */
 					ide_devices[i].Size / 2048 ,               /* Size */
-					ide_devices[i].Model);
+					ide_devices[i].Model,
+					ide_devices[i].Trim ? " (TRIM)" : "");
 		}
 }
 
@@ -262,7 +316,7 @@ unsigned char ide_ata_access(unsigned char direction, unsigned char drive, unsig
 	unsigned short cyl, i;
 	unsigned char head, sect, err;
 
-	ide_write(channel, ATA_REG_CONTROL, channels[channel].nIEN = (ide_irq_invoked = 0x0) + 0x02);
+	ide_write(channel, ATA_REG_CONTROL, channels[channel].nIEN = (channels[channel].irq_invoked = 0x0) + 0x02);
 
 	// (I) Select one from LBA28, LBA48 or CHS;
 	if (lba >= 0x10000000) { // Sure Drive should support LBA in this case, or you are
@@ -352,24 +406,212 @@ unsigned char ide_ata_access(unsigned char direction, unsigned char drive, unsig
 			for (i = 0; i < numsects; i++) {
 				if (err = ide_polling(channel, 1))
 					return err; // Polling, set error and exit if there is.
-				asm("rep insw" : : "c"(words), "d"(bus), "D"(edi)); // Receive Data.
+				insw(bus, (void *)edi, words); // Receive Data.
+				edi += words * 2;
 			} 
 		}
 		else 
 		{
 			// PIO Write.
 			for (i = 0; i < numsects; i++) {
-				ide_polling(channel, 0); // Polling.
-				asm("rep outsw"::"c"(words), "d"(bus), "S"(edi)); // Send Data
+				if ((err = ide_polling(channel, 1)) != 0)
+					return err; // Polling, set error and exit if there is.
+				outsw(bus, (void *)edi, words); // Send Data
+				edi += words * 2;
 			}
-			ide_write(channel, ATA_REG_COMMAND, (char []) {   ATA_CMD_CACHE_FLUSH,
-					ATA_CMD_CACHE_FLUSH,
-					ATA_CMD_CACHE_FLUSH_EXT}[lba_mode]);
-			ide_polling(channel, 0); // Polling.
+			// No CACHE FLUSH here, durability is requested explicitly
+			// through ide_flush_cache() (fsync, sync, CTRL_SYNC).
+			// Still wait for the drive to take the last sector, so the
+			// channel isn't released while it is busy and a failed
+			// write is reported here.
+			ide_polling(channel, 0);
+			err = ide_read(channel, ATA_REG_STATUS);
+			if (err & ATA_SR_ERR)
+				return 2; // Error.
+			if (err & ATA_SR_DF)
+				return 1; // Device Fault.
 		}
 
 	return 0; // Easy, isn't it?
 }
+/* Flush the drive's volatile write cache, it returns once the data
+ * written so far is on stable media.
+ */
+int ide_flush_cache(unsigned char drive)
+{
+	struct IDEChannelRegisters *ch;
+	unsigned char channel, err;
+
+	if (drive > 3 || ide_devices[drive].Reserved == 0)
+		return -0x1;      // Drive Not Found!
+	if (ide_devices[drive].Type != IDE_ATA)
+		return 0;         // Nothing cached on ATAPI
+
+	channel = ide_devices[drive].Channel;
+	ch = ide_channel_get(drive);
+	while (ide_read(channel, ATA_REG_STATUS) & ATA_SR_BSY)
+		; // Wait if busy.
+	ide_write(channel, ATA_REG_HDDEVSEL, 0xE0 | (ide_devices[drive].Drive << 4));
+	ide_write(channel, ATA_REG_COMMAND,
+			(ide_devices[drive].CommandSets & (1 << 26)) ? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
+	err = ide_polling(channel, 0);
+	if (ide_read(channel, ATA_REG_STATUS) & (ATA_SR_ERR | ATA_SR_DF))
+		err = 2;
+	return ide_channel_put(ch, ide_print_error(drive, err));
+}
+
+/* Send the range list in ch->dsm with DATA SET MANAGEMENT.  The list is a
+ * data-out transfer of the command, and the command exists only as DMA, so
+ * this is the one place we drive the bus master.  The channel is held.
+ */
+static unsigned char ide_dsm_dma(unsigned char drive)
+{
+	unsigned int  channel = ide_devices[drive].Channel;
+	struct IDEChannelRegisters *ch = &channels[channel];
+	unsigned char bmstat, err;
+
+	ide_write(channel, ATA_REG_CONTROL, ch->nIEN = (ch->irq_invoked = 0x0) + 0x02);
+
+	// (I) One PRD for the 512 byte block, memory to drive:
+	ch->prd[0] = PADDR(ch->dsm);
+	ch->prd[1] = IDE_PRD_EOT | SECTOR_SIZE;
+	ide_write(channel, ATA_REG_BMCOMMAND, 0);
+	outl(ch->bmide + IDE_BM_PRDT, PADDR(ch->prd));
+	ide_write(channel, ATA_REG_BMSTATUS, IDE_BM_SR_ERR | IDE_BM_SR_INTR); // Write 1 to clear
+
+	// (II) 48-bit command, each register takes its high byte first:
+	while (ide_read(channel, ATA_REG_STATUS) & ATA_SR_BSY)
+		; // Wait if busy.
+	ide_write(channel, ATA_REG_HDDEVSEL, 0xE0 | (ide_devices[drive].Drive << 4));
+	ide_write(channel, ATA_REG_FEATURES, 0);
+	ide_write(channel, ATA_REG_FEATURES, ATA_DSM_TRIM);
+	ide_write(channel, ATA_REG_SECCOUNT1, 0);
+	ide_write(channel, ATA_REG_SECCOUNT0, 1); // Blocks of range entries
+	ide_write(channel, ATA_REG_LBA3, 0);
+	ide_write(channel, ATA_REG_LBA4, 0);
+	ide_write(channel, ATA_REG_LBA5, 0);
+	ide_write(channel, ATA_REG_LBA0, 0);
+	ide_write(channel, ATA_REG_LBA1, 0);
+	ide_write(channel, ATA_REG_LBA2, 0);
+	ide_write(channel, ATA_REG_COMMAND, ATA_CMD_DSM);
+
+	// (III) Start the transfer, the drive drops BSY when the command is done:
+	ide_write(channel, ATA_REG_BMCOMMAND, IDE_BM_CMD_START);
+	err = ide_polling(channel, 0);
+	bmstat = ide_read(channel, ATA_REG_BMSTATUS);
+	ide_write(channel, ATA_REG_BMCOMMAND, 0);
+	ide_write(channel, ATA_REG_BMSTATUS, IDE_BM_SR_ERR | IDE_BM_SR_INTR);
+
+	if (ide_read(channel, ATA_REG_STATUS) & (ATA_SR_ERR | ATA_SR_DF))
+		return 2;
+	if (bmstat & IDE_BM_SR_ERR)
+		return 1;
+	return err;
+}
+
+/* Tell the drive [lba, lba+count) holds no data anymore */
+int ide_trim_sectors(unsigned char drive, unsigned int lba, unsigned int count)
+{
+	struct IDEChannelRegisters *ch;
+	unsigned int i, n;
+	unsigned char err = 0;
+
+	if (drive > 3 || ide_devices[drive].Reserved == 0)
+		return -0x1;      // Drive Not Found!
+	if (!ide_devices[drive].Trim || !channels[ide_devices[drive].Channel].prd)
+		return -0x1;      // No TRIM, or no bus master to send it
+	if (lba + count > ide_devices[drive].Size)
+		return -0x2;      // Seeking to invalid position.
+
+	ch = ide_channel_get(drive);
+	while (count > 0 && !err) {
+		// Entry: LBA in bits 47:0, sector count in bits 63:48, 0 entries are ignored
+		memset(ch->dsm, 0, SECTOR_SIZE);
+		for (i = 0; i < IDE_DSM_RANGES && count > 0; i++) {
+			n = MIN(count, IDE_DSM_RANGE_MAX);
+			ch->dsm[i] = lba | ((unsigned long long)n << 48);
+			lba += n;
+			count -= n;
+		}
+		err = ide_dsm_dma(drive);
+	}
+	return ide_channel_put(ch, ide_print_error(drive, err));
+}
+
+/* Block device glue, one struct blkdev per ATA drive */
+static struct blkdev ide_blk[4];
+
+static int ide_blk_read(struct blkdev *bd, uint32_t lba, uint32_t count, void *buf)
+{
+	uint8_t *ptr = buf;
+	uint32_t n;
+	int err = 0;
+
+	// One PIO command for up to IDE_MAX_SECTS contiguous sectors
+	for ( ; count > 0 && !err; count -= n) {
+		n = MIN(count, IDE_MAX_SECTS);
+		err = ide_read_sectors(bd->unit, n, lba, (unsigned int)ptr);
+		lba += n;
+		ptr += n * SECTOR_SIZE;
+	}
+	return err;
+}
+
+/* PIO has no FUA write, a cache flush after the data does the same */
+static int ide_blk_write(struct blkdev *bd, uint32_t lba, uint32_t count, const void *buf, int fua)
+{
+	const uint8_t *ptr = buf;
+	uint32_t n;
+	int err = 0;
+
+	for ( ; count > 0 && !err; count -= n) {
+		n = MIN(count, IDE_MAX_SECTS);
+		err = ide_write_sectors(bd->unit, n, lba, (unsigned int)ptr);
+		lba += n;
+		ptr += n * SECTOR_SIZE;
+	}
+	if (!err && fua)
+		err = ide_flush_cache(bd->unit);
+	return err;
+}
+
+static int ide_blk_flush(struct blkdev *bd)
+{
+	return ide_flush_cache(bd->unit);
+}
+
+static int ide_blk_trim(struct blkdev *bd, uint32_t lba, uint32_t count)
+{
+	return ide_trim_sectors(bd->unit, lba, count);
+}
+
+/* Return the block device of the ATA drive at channel/drive, NULL if there is none */
+struct blkdev *ide_blk_probe(unsigned char channel, unsigned char drive)
+{
+	struct blkdev *bd;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		if (ide_devices[i].Reserved && ide_devices[i].Type == IDE_ATA &&
+		    ide_devices[i].Channel == channel && ide_devices[i].Drive == drive)
+			break;
+	if (i == 4)
+		return NULL;
+
+	bd = &ide_blk[i];
+	strcpy(bd->name, "hda");
+	bd->name[2] += channel * 2 + drive;
+	bd->sectors = ide_devices[i].Size;
+	bd->max_sects = IDE_MAX_SECTS;
+	bd->unit = i;
+	bd->boot = (channel == ATA_PRIMARY && drive == ATA_MASTER);
+	bd->read = ide_blk_read;
+	bd->write = ide_blk_write;
+	bd->flush = ide_blk_flush;
+	bd->trim = (ide_devices[i].Trim && channels[channel].prd) ? ide_blk_trim : NULL;
+	return bd;
+}
+
 unsigned char ide_print_error(unsigned int drive, unsigned char err) {
 	if (err == 0)
 		return err;
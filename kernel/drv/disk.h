@@ -2,6 +2,8 @@
 #define DISK_H
 
 #include <inc/assert.h>
+#include <kernel/spinlock.h>
+#include <kernel/drv/pci.h>
 
 //Status code
 #define    ATA_SR_BSY     0x80 // Busy
@@ -34,6 +36,8 @@
 #define      ATA_CMD_WRITE_DMA_EXT    0x35
 #define      ATA_CMD_CACHE_FLUSH      0xE7
 #define      ATA_CMD_CACHE_FLUSH_EXT  0xEA
+#define      ATA_CMD_DSM              0x06  // DATA SET MANAGEMENT, DMA only
+#define       ATA_DSM_TRIM            0x01  // Features bit
 #define      ATA_CMD_PACKET           0xA0
 #define       ATA_CMD_IDENTIFY_PACKET 0xA1
 #define       ATA_CMD_IDENTIFY        0xEC
@@ -53,6 +57,7 @@
 #define    ATA_IDENT_MAX_LBA   120
 #define   ATA_IDENT_COMMANDSETS   164
 #define    ATA_IDENT_MAX_LBA_EXT   200
+#define    ATA_IDENT_DSM   338 // Word 169, bit 0: TRIM supported
 
 // ATA-ATAPI Task-File:
 #define      ATA_REG_DATA      0x00
@@ -72,6 +77,20 @@
 #define      ATA_REG_CONTROL      0x0C
 #define      ATA_REG_ALTSTATUS   0x0C
 #define      ATA_REG_DEVADDRESS   0x0D
+#define      ATA_REG_BMCOMMAND    0x0E
+#define      ATA_REG_BMSTATUS     0x10
+
+// Bus Master IDE:
+#define      IDE_BM_PRDT          0x04 // PRD table address, 32 bit
+#define      IDE_BM_CMD_START     0x01
+#define      IDE_BM_CMD_READ      0x08 // Drive to memory
+#define      IDE_BM_SR_ACTIVE     0x01
+#define      IDE_BM_SR_ERR        0x02
+#define      IDE_BM_SR_INTR       0x04
+#define      IDE_PRD_EOT          0x80000000
+
+#define IDE_DSM_RANGES     64      // LBA range entries per 512 byte block
+#define IDE_DSM_RANGE_MAX  0xFFFF  // sectors per entry
 
 // Channels:
 #define      ATA_PRIMARY      0x00
@@ -96,22 +115,42 @@ struct ide_device {
 	unsigned short Capabilities;// Features.
 	unsigned int   CommandSets; // Command Sets Supported.
 	unsigned int   Size;        // Size in Sectors.
+	unsigned char  Trim;        // DATA SET MANAGEMENT TRIM supported.
 	unsigned char  Model[41];   // Model in string.
 } ide_devices[4];
 
+/* Everything a command touches lives in its channel, so commands on the
+ * primary and secondary channels can run on different CPUs at once.
+ */
 struct IDEChannelRegisters {
 	unsigned short base;  // I/O Base.
 	unsigned short ctrl;  // Control Base
 	unsigned short bmide; // Bus Master IDE
 	unsigned char  nIEN;  // nIEN (No Interrupt);
+	unsigned char  irq_invoked; // IRQ seen since the last command
+	unsigned char  status;      // Error code of the last command
+	struct spinlock lock;       // One command at a time per channel
+	volatile unsigned int inflight;  // Commands running (0 or 1)
+	unsigned int   cmds;        // Commands issued
+	unsigned int   overlapped;  // Commands issued while the other channel was busy
+	unsigned char  buf[512];    // IDENTIFY data
+	unsigned int   *prd;        // Bus master PRD table, NULL without bus master
+	unsigned long long *dsm;    // TRIM range list, same page as prd
 } channels[2];
 
+#define IDE_MAX_SECTS 128   // sectors per PIO command issued by diskio
+
 int disk_init();
 void disk_test();
 int ide_read_sectors(unsigned char drive, unsigned char numsects, unsigned int lba,
 		unsigned int edi);
 int ide_write_sectors(unsigned char drive, unsigned char numsects, unsigned int lba,
 		unsigned int edi);  
+int ide_flush_cache(unsigned char drive);
+int ide_trim_sectors(unsigned char drive, unsigned int lba, unsigned int count);
+int ide_pci_attach(struct pci_func *pcif);
+unsigned char get_status(unsigned char drive);
+struct blkdev *ide_blk_probe(unsigned char channel, unsigned char drive);
 unsigned char ide_polling(unsigned char channel, unsigned int advanced_check);
 #endif                   
 
@@ -0,0 +1,557 @@
+/* This is a simple NVMe driver for NCTU OSDI course.
+ *  Reference: NVM Express Base Specification 1.2, http://wiki.osdev.org/NVMe
+ *
+ *  Every CPU owns one I/O submission/completion queue pair, so the I/O path
+ *  does not take any lock shared between CPUs.  Only one command is in flight
+ *  per queue at a time: the kernel is not preemptible, so the submitting CPU
+ *  simply waits (polling, or halting until its MSI-X vector fires) for the
+ *  completion before returning to the caller.
+ */
+
+#include "nvme.h"
+#include "blk.h"
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/trap.h>
+#include <kernel/mem.h>
+#include <kernel/cpu.h>
+#include <kernel/spinlock.h>
+
+struct nvme_queue {
+	uint16_t qid;
+	uint16_t depth;
+	uint16_t sq_tail;
+	uint16_t cq_head;
+	uint16_t cid;
+	uint8_t  cq_phase;
+	uint8_t  irq;                   // completion signalled by MSI-X
+	uint8_t  cpu;                   // cpus[] index the vector is routed to
+	int      shared;                // more than one CPU submits here
+	struct spinlock lock;           // only taken when shared
+
+	volatile struct nvme_cmd *sq;
+	volatile struct nvme_cpl *cq;
+	volatile uint32_t *sq_db;
+	volatile uint32_t *cq_db;
+	uint64_t *prp_list;             // PRP list page for multi-page transfers
+	uint8_t  *bounce;               // for buffers that are not dword aligned
+};
+
+static struct nvme_ctrl {
+	struct pci_func pcif;
+	volatile uint8_t *regs;
+	volatile uint32_t *msix_table;
+	int      msix_cap;
+	int      msix_vectors;
+
+	int      present;
+	int      ready;
+	uint32_t dstrd;                 // doorbell stride in bytes
+	uint32_t max_sects;             // per command
+	uint32_t nsid;
+	uint64_t nsze;                  // namespace size in sectors
+	int      dsm;                   // Dataset Management supported
+
+	struct nvme_queue adminq;
+	struct nvme_queue ioq[NCPU];
+	int      nr_ioq;
+	uint32_t intr_count[NCPU];
+} nvme;
+
+static inline uint32_t
+nvme_rd(uint32_t reg)
+{
+	return *(volatile uint32_t *)(nvme.regs + reg);
+}
+
+static inline void
+nvme_wr(uint32_t reg, uint32_t val)
+{
+	*(volatile uint32_t *)(nvme.regs + reg) = val;
+}
+
+static inline void
+nvme_wr64(uint32_t reg, uint64_t val)
+{
+	nvme_wr(reg, (uint32_t)val);
+	nvme_wr(reg + 4, (uint32_t)(val >> 32));
+}
+
+/* Translate a buffer address to physical memory for the PRP entries.
+ * Kernel addresses are direct mapped; anything else (user buffers, the
+ * per-CPU kernel stacks) goes through the current page table.
+ */
+static physaddr_t
+nvme_va2pa(uintptr_t va)
+{
+	pte_t *pte;
+
+	if (va >= KERNBASE)
+		return va - KERNBASE;
+	pte = pgdir_walk(KADDR(rcr3()), (void *)va, 0);
+	if (!pte || !(*pte & PTE_P))
+		panic("nvme: buffer %08x not mapped", va);
+	return PTE_ADDR(*pte) | PGOFF(va);
+}
+
+static void *
+nvme_alloc_page(void)
+{
+	struct PageInfo *pp = page_alloc(ALLOC_ZERO);
+	if (!pp)
+		return NULL;
+	pp->pp_ref++;
+	return page2kva(pp);
+}
+
+static int
+nvme_queue_alloc(struct nvme_queue *q, uint16_t qid, uint16_t depth)
+{
+	memset(q, 0, sizeof(*q));
+	q->qid = qid;
+	q->depth = depth;
+	q->cq_phase = 1;
+	spin_initlock(&q->lock);
+
+	q->sq = nvme_alloc_page();
+	q->cq = nvme_alloc_page();
+	q->prp_list = nvme_alloc_page();
+	q->bounce = nvme_alloc_page();
+	if (!q->sq || !q->cq || !q->prp_list || !q->bounce)
+		return -1;
+
+	q->sq_db = (volatile uint32_t *)(nvme.regs + NVME_REG_DBS + (2 * qid) * nvme.dstrd);
+	q->cq_db = (volatile uint32_t *)(nvme.regs + NVME_REG_DBS + (2 * qid + 1) * nvme.dstrd);
+	return 0;
+}
+
+/* Submit one command and wait for its completion.
+ * Returns the NVMe status field (0 on success).
+ */
+static int
+nvme_submit_sync(struct nvme_queue *q, struct nvme_cmd *cmd, uint32_t *result)
+{
+	volatile struct nvme_cpl *cpl;
+	uint16_t status;
+	uint32_t eflags = read_eflags();
+	int sleep;
+
+	// Halting only works when the completion interrupt comes to this CPU
+	sleep = q->irq && !q->shared && q->cpu == cpunum();
+
+	cmd->cdw0 = (cmd->cdw0 & 0xFFFF) | ((uint32_t)q->cid++ << 16);
+	memcpy((void *)&q->sq[q->sq_tail], cmd, sizeof(*cmd));
+	if (++q->sq_tail == q->depth)
+		q->sq_tail = 0;
+	*q->sq_db = q->sq_tail;
+
+	for (;;) {
+		// Check with interrupts off, so the completion can't slip in before hlt
+		__asm __volatile("cli" ::: "memory");
+		cpl = &q->cq[q->cq_head];
+		if ((cpl->status & 1) == q->cq_phase)
+			break;
+		if (sleep)
+			// sti only takes effect after hlt, so a pending interrupt wakes us up
+			__asm __volatile("sti; hlt" ::: "memory");
+		else
+			__asm __volatile("pause");
+	}
+
+	status = cpl->status >> 1;
+	if (result)
+		*result = cpl->dw0;
+
+	if (++q->cq_head == q->depth) {
+		q->cq_head = 0;
+		q->cq_phase ^= 1;
+	}
+	*q->cq_db = q->cq_head;
+	write_eflags(eflags);
+
+	return status;
+}
+
+static int
+nvme_admin(uint8_t opcode, uint32_t nsid, void *buf, uint32_t cdw10, uint32_t cdw11, uint32_t *result)
+{
+	struct nvme_cmd cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cdw0 = opcode;
+	cmd.nsid = nsid;
+	if (buf)
+		cmd.prp1 = nvme_va2pa((uintptr_t)buf);
+	cmd.cdw10 = cdw10;
+	cmd.cdw11 = cdw11;
+	return nvme_submit_sync(&nvme.adminq, &cmd, result);
+}
+
+/* Fill prp1/prp2 for [va, va+len). Callers keep len <= NVME_MAX_SECTS sectors. */
+static void
+nvme_build_prp(struct nvme_queue *q, struct nvme_cmd *cmd, uintptr_t va, uint32_t len)
+{
+	uint32_t first = MIN(len, PGSIZE - PGOFF(va));
+	int n = 0;
+
+	cmd->prp1 = nvme_va2pa(va);
+	cmd->prp2 = 0;
+	len -= first;
+	va += first;
+	if (len == 0)
+		return;
+	if (len <= PGSIZE) {
+		cmd->prp2 = nvme_va2pa(va);
+		return;
+	}
+
+	while (len) {
+		q->prp_list[n++] = nvme_va2pa(va);
+		va += PGSIZE;
+		len -= MIN(len, PGSIZE);
+	}
+	cmd->prp2 = PADDR(q->prp_list);
+}
+
+/* Pick the submitting CPU's queue */
+static struct nvme_queue *
+nvme_get_queue(void)
+{
+	struct nvme_queue *q = &nvme.ioq[cpunum() % nvme.nr_ioq];
+	if (q->shared)
+		spin_lock(&q->lock);
+	return q;
+}
+
+static void
+nvme_put_queue(struct nvme_queue *q)
+{
+	if (q->shared)
+		spin_unlock(&q->lock);
+}
+
+static int
+nvme_rw(uint8_t opcode, uint32_t lba, uint32_t count, uint8_t *buf, int fua)
+{
+	struct nvme_queue *q;
+	struct nvme_cmd cmd;
+	int err = 0;
+
+	if (!nvme.ready)
+		return -1;
+	if ((uint64_t)lba + count > nvme.nsze)
+		return -1;
+
+	q = nvme_get_queue();
+	while (count > 0 && !err) {
+		uint32_t nsects = MIN(count, nvme.max_sects);
+		uint8_t *xfer = buf;
+
+		// PRP entries must be dword aligned, bounce odd user buffers
+		if ((uintptr_t)buf & 3) {
+			nsects = MIN(nsects, PGSIZE / NVME_SECTOR_SIZE);
+			xfer = q->bounce;
+			if (opcode == NVME_CMD_WRITE)
+				memcpy(xfer, buf, nsects * NVME_SECTOR_SIZE);
+		}
+
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.cdw0 = opcode;
+		cmd.nsid = nvme.nsid;
+		nvme_build_prp(q, &cmd, (uintptr_t)xfer, nsects * NVME_SECTOR_SIZE);
+		cmd.cdw10 = lba;
+		cmd.cdw11 = 0;
+		cmd.cdw12 = (nsects - 1) | (fua ? NVME_RW_FUA : 0);
+
+		if (nvme_submit_sync(q, &cmd, NULL))
+			err = -1;
+		else if (xfer != buf && opcode == NVME_CMD_READ)
+			memcpy(buf, xfer, nsects * NVME_SECTOR_SIZE);
+
+		lba += nsects;
+		buf += nsects * NVME_SECTOR_SIZE;
+		count -= nsects;
+	}
+	nvme_put_queue(q);
+	return err;
+}
+
+int
+nvme_read_sectors(uint32_t lba, uint32_t count, void *buf)
+{
+	return nvme_rw(NVME_CMD_READ, lba, count, buf, 0);
+}
+
+/* fua: the command completes only once the data is on stable media */
+int
+nvme_write_sectors(uint32_t lba, uint32_t count, const void *buf, int fua)
+{
+	return nvme_rw(NVME_CMD_WRITE, lba, count, (uint8_t *)buf, fua);
+}
+
+/* Commit the volatile write cache of the namespace */
+int
+nvme_flush(void)
+{
+	struct nvme_queue *q;
+	struct nvme_cmd cmd;
+	int err;
+
+	if (!nvme.ready)
+		return -1;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cdw0 = NVME_CMD_FLUSH;
+	cmd.nsid = nvme.nsid;
+	q = nvme_get_queue();
+	err = nvme_submit_sync(q, &cmd, NULL) ? -1 : 0;
+	nvme_put_queue(q);
+	return err;
+}
+
+/* Tell the namespace [lba, lba+count) is unused, its blocks can be unmapped */
+int
+nvme_deallocate(uint32_t lba, uint32_t count)
+{
+	struct nvme_queue *q;
+	struct nvme_dsm_range *range;
+	struct nvme_cmd cmd;
+	int err;
+
+	if (!nvme.ready || !nvme.dsm)
+		return -1;
+	if ((uint64_t)lba + count > nvme.nsze)
+		return -1;
+
+	q = nvme_get_queue();
+	// The range list goes through the queue's bounce page
+	range = (struct nvme_dsm_range *)q->bounce;
+	memset(range, 0, sizeof(*range));
+	range->nlb = count;
+	range->slba = lba;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cdw0 = NVME_CMD_DSM;
+	cmd.nsid = nvme.nsid;
+	cmd.prp1 = PADDR(range);
+	cmd.cdw10 = 0;                  // one range
+	cmd.cdw11 = NVME_DSM_AD;
+	err = nvme_submit_sync(q, &cmd, NULL) ? -1 : 0;
+	nvme_put_queue(q);
+	return err;
+}
+
+int
+nvme_present(void)
+{
+	return nvme.ready;
+}
+
+uint32_t
+nvme_sector_count(void)
+{
+	return nvme.nsze > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)nvme.nsze;
+}
+
+/* Block device glue */
+static int
+nvme_blk_read(struct blkdev *bd, uint32_t lba, uint32_t count, void *buf)
+{
+	return nvme_read_sectors(lba, count, buf);
+}
+
+static int
+nvme_blk_write(struct blkdev *bd, uint32_t lba, uint32_t count, const void *buf, int fua)
+{
+	return nvme_write_sectors(lba, count, buf, fua);
+}
+
+static int
+nvme_blk_flush(struct blkdev *bd)
+{
+	return nvme_flush();
+}
+
+static int
+nvme_blk_trim(struct blkdev *bd, uint32_t lba, uint32_t count)
+{
+	return nvme_deallocate(lba, count);
+}
+
+/* Bring the controller up, return its block device or NULL */
+struct blkdev *
+nvme_blk_probe(void)
+{
+	static struct blkdev bd = {
+		.name = "nvme0",
+		.read = nvme_blk_read,
+		.write = nvme_blk_write,
+		.flush = nvme_blk_flush,
+	};
+
+	if (nvme_init() < 0)
+		return NULL;
+	bd.sectors = nvme_sector_count();
+	bd.max_sects = nvme.max_sects;
+	bd.trim = nvme.dsm ? nvme_blk_trim : NULL;
+	return &bd;
+}
+
+/* The interrupt only has to wake the halted submitter, which reaps the
+ * completion queue itself.
+ */
+static void
+nvme_intr(struct Trapframe *tf)
+{
+	nvme.intr_count[cpunum()]++;
+	lapic_eoi();
+}
+
+/* Route vector 'idx' of the MSI-X table to the local APIC of 'apicid' */
+static void
+nvme_msix_route(int idx, uint8_t apicid, int masked)
+{
+	volatile uint32_t *ent = nvme.msix_table + idx * 4;
+	ent[0] = 0xFEE00000 | ((uint32_t)apicid << 12);
+	ent[1] = 0;
+	ent[2] = IRQ_OFFSET + IRQ_NVME;
+	ent[3] = masked ? 1 : 0;
+}
+
+/* PCI attach: map the register BAR (and the MSI-X table if it lives
+ * elsewhere). Must run before the first task page directory is built,
+ * since setupkvm() copies the MMIO region from kern_pgdir.
+ */
+int
+nvme_attach(struct pci_func *pcif)
+{
+	if (nvme.present)
+		return 0; // only drive the first controller
+
+	pci_func_enable(pcif);
+	pci_conf_write(pcif, PCI_COMMAND_REG,
+			pci_conf_read(pcif, PCI_COMMAND_REG) | PCI_COMMAND_INTX_DISABLE);
+	nvme.pcif = *pcif;
+	nvme.regs = mmio_map_region(pcif->reg_base[0], pcif->reg_size[0]);
+
+	nvme.msix_cap = pci_find_cap(pcif, PCI_CAP_MSIX);
+	if (nvme.msix_cap) {
+		uint32_t ctrl = pci_conf_read(pcif, nvme.msix_cap);
+		uint32_t tbl = pci_conf_read(pcif, nvme.msix_cap + 4);
+		uint32_t bir = tbl & 0x7, off = tbl & ~0x7;
+
+		nvme.msix_vectors = ((ctrl >> 16) & 0x7FF) + 1;
+		if (bir == 0)
+			nvme.msix_table = (volatile uint32_t *)(nvme.regs + off);
+		else
+			nvme.msix_table = (volatile uint32_t *)((uint8_t *)mmio_map_region(pcif->reg_base[bir], pcif->reg_size[bir]) + off);
+	}
+
+	nvme.present = 1;
+	printk(" NVMe controller %04x:%04x at %08x\n",
+			PCI_VENDOR(pcif->dev_id), PCI_PRODUCT(pcif->dev_id), pcif->reg_base[0]);
+	return 1;
+}
+
+int
+nvme_init(void)
+{
+	static uint8_t *ident;
+	uint32_t cap_lo, cap_hi, result, lbads;
+	uint16_t mqes;
+	int i, nq, use_msix;
+
+	if (!nvme.present)
+		return -1;
+	if (nvme.ready)
+		return 0;
+
+	cap_lo = nvme_rd(NVME_REG_CAP);
+	cap_hi = nvme_rd(NVME_REG_CAP + 4);
+	mqes = (cap_lo & 0xFFFF) + 1;
+	nvme.dstrd = 4 << (cap_hi & 0xF);
+
+	// (I) Reset the controller and set up the admin queue pair
+	nvme_wr(NVME_REG_CC, nvme_rd(NVME_REG_CC) & ~NVME_CC_EN);
+	while (nvme_rd(NVME_REG_CSTS) & NVME_CSTS_RDY)
+		;
+
+	if (nvme_queue_alloc(&nvme.adminq, 0, MIN(NVME_ADMIN_DEPTH, mqes)) < 0)
+		return -1;
+	nvme_wr(NVME_REG_AQA, ((nvme.adminq.depth - 1) << 16) | (nvme.adminq.depth - 1));
+	nvme_wr64(NVME_REG_ASQ, PADDR((void *)nvme.adminq.sq));
+	nvme_wr64(NVME_REG_ACQ, PADDR((void *)nvme.adminq.cq));
+	nvme_wr(NVME_REG_CC, NVME_CC_EN | NVME_CC_CSS_NVM | NVME_CC_MPS_4K |
+			NVME_CC_IOSQES | NVME_CC_IOCQES);
+	while (!(nvme_rd(NVME_REG_CSTS) & NVME_CSTS_RDY))
+		if (nvme_rd(NVME_REG_CSTS) & NVME_CSTS_CFS)
+			return -1;
+
+	// (II) Identify controller and namespace 1
+	if (!ident && !(ident = nvme_alloc_page()))
+		return -1;
+	if (nvme_admin(NVME_ADMIN_IDENTIFY, 0, ident, 1, 0, NULL))
+		return -1;
+	nvme.max_sects = NVME_MAX_SECTS;
+	if (ident[NVME_ID_CTRL_MDTS])
+		nvme.max_sects = MIN(nvme.max_sects,
+				(uint32_t)((PGSIZE / NVME_SECTOR_SIZE) << ident[NVME_ID_CTRL_MDTS]));
+	nvme.dsm = !!(*(uint16_t *)(ident + NVME_ID_CTRL_ONCS) & NVME_ONCS_DSM);
+
+	nvme.nsid = 1;
+	if (nvme_admin(NVME_ADMIN_IDENTIFY, nvme.nsid, ident, 0, 0, NULL))
+		return -1;
+	nvme.nsze = *(uint64_t *)(ident + NVME_ID_NS_NSZE);
+	lbads = (*(uint32_t *)(ident + NVME_ID_NS_LBAF + 4 * (ident[NVME_ID_NS_FLBAS] & 0xF)) >> 16) & 0xFF;
+	if ((1 << lbads) != NVME_SECTOR_SIZE) {
+		printk("nvme: unsupported LBA size %d\n", 1 << lbads);
+		return -1;
+	}
+
+	// (III) Ask for one I/O queue pair per CPU
+	if (nvme_admin(NVME_ADMIN_SET_FEATURES, 0, NULL, NVME_FEAT_NUM_QUEUES,
+				((ncpu - 1) << 16) | (ncpu - 1), &result))
+		return -1;
+	nq = MIN(ncpu, (int)MIN(result & 0xFFFF, result >> 16) + 1);
+
+	use_msix = NVME_USE_MSIX && nvme.msix_cap && nvme.msix_vectors > nq;
+	if (use_msix) {
+		extern void NVME_ISR();
+		register_handler(IRQ_OFFSET + IRQ_NVME, nvme_intr, NVME_ISR, 0, 0);
+		nvme_msix_route(0, bootcpu->cpu_id, 1); // admin queue is polled
+		pci_conf_write(&nvme.pcif, nvme.msix_cap,
+				(pci_conf_read(&nvme.pcif, nvme.msix_cap) | (1 << 31)) & ~(1 << 30));
+	}
+
+	// (IV) Create the I/O queues, queue i belongs to cpus[i]
+	for (i = 0; i < nq; i++) {
+		struct nvme_queue *q = &nvme.ioq[i];
+		uint16_t qid = i + 1;
+
+		if (nvme_queue_alloc(q, qid, MIN(NVME_IO_DEPTH, mqes)) < 0)
+			return -1;
+		q->irq = use_msix;
+		q->cpu = i;
+		q->shared = (ncpu > nq);
+		if (use_msix)
+			nvme_msix_route(qid, cpus[i].cpu_id, 0);
+
+		if (nvme_admin(NVME_ADMIN_CREATE_CQ, 0, (void *)q->cq,
+					((q->depth - 1) << 16) | qid,
+					(use_msix ? (qid << 16) | 0x2 : 0) | 0x1, NULL))
+			return -1;
+		if (nvme_admin(NVME_ADMIN_CREATE_SQ, 0, (void *)q->sq,
+					((q->depth - 1) << 16) | qid,
+					(qid << 16) | 0x1, NULL))
+			return -1;
+	}
+	nvme.nr_ioq = nq;
+	nvme.ready = 1;
+
+	printk(" NVMe namespace %d: %dMB, %d I/O queue(s), %s completion%s\n",
+			nvme.nsid, (uint32_t)(nvme.nsze / 2048), nq,
+			use_msix ? "MSI-X" : "polled", nvme.dsm ? ", deallocate" : "");
+	return 0;
+}
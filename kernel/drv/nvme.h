@@ -0,0 +1,103 @@
+#ifndef NVME_H
+#define NVME_H
+
+#include <inc/types.h>
+#include <kernel/drv/pci.h>
+
+/* Completion mode: 1 to take MSI-X interrupts (one vector per I/O queue,
+ * routed to the CPU owning the queue), 0 to always poll the completion queue.
+ * We fall back to polling when the controller has too few MSI-X vectors.
+ */
+#define NVME_USE_MSIX      1
+
+#define NVME_ADMIN_DEPTH   32
+#define NVME_IO_DEPTH      64
+#define NVME_SECTOR_SIZE   512
+#define NVME_MAX_SECTS     256   // 128KB per command, fits in one PRP list page
+
+// Controller registers
+#define NVME_REG_CAP       0x00  // Controller Capabilities (64 bit)
+#define NVME_REG_VS        0x08  // Version
+#define NVME_REG_INTMS     0x0C  // Interrupt Mask Set
+#define NVME_REG_INTMC     0x10  // Interrupt Mask Clear
+#define NVME_REG_CC        0x14  // Controller Configuration
+	#define NVME_CC_EN         0x00000001
+	#define NVME_CC_CSS_NVM    0x00000000
+	#define NVME_CC_MPS_4K     0x00000000
+	#define NVME_CC_IOSQES     (6 << 16)  // 64 bytes submission entry
+	#define NVME_CC_IOCQES     (4 << 20)  // 16 bytes completion entry
+#define NVME_REG_CSTS      0x1C  // Controller Status
+	#define NVME_CSTS_RDY      0x00000001
+	#define NVME_CSTS_CFS      0x00000002
+#define NVME_REG_AQA       0x24  // Admin Queue Attributes
+#define NVME_REG_ASQ       0x28  // Admin Submission Queue Base (64 bit)
+#define NVME_REG_ACQ       0x30  // Admin Completion Queue Base (64 bit)
+#define NVME_REG_DBS       0x1000 // Doorbells
+
+// Admin commands
+#define NVME_ADMIN_DELETE_SQ     0x00
+#define NVME_ADMIN_CREATE_SQ     0x01
+#define NVME_ADMIN_DELETE_CQ     0x04
+#define NVME_ADMIN_CREATE_CQ     0x05
+#define NVME_ADMIN_IDENTIFY      0x06
+#define NVME_ADMIN_SET_FEATURES  0x09
+	#define NVME_FEAT_NUM_QUEUES     0x07
+
+// NVM I/O commands
+#define NVME_CMD_FLUSH           0x00
+#define NVME_CMD_WRITE           0x01
+#define NVME_CMD_READ            0x02
+	#define NVME_RW_FUA              (1 << 30)  // cdw12, Force Unit Access
+#define NVME_CMD_DSM             0x09
+	#define NVME_DSM_AD              (1 << 2)   // cdw11, Deallocate
+
+// Identify data offsets
+#define NVME_ID_CTRL_MDTS        77
+#define NVME_ID_CTRL_ONCS        520
+	#define NVME_ONCS_DSM            (1 << 2)
+#define NVME_ID_NS_NSZE          0
+#define NVME_ID_NS_FLBAS         26
+#define NVME_ID_NS_LBAF          128
+
+struct nvme_cmd {
+	uint32_t cdw0;          // opcode [7:0], command id [31:16]
+	uint32_t nsid;
+	uint64_t rsvd;
+	uint64_t mptr;
+	uint64_t prp1;
+	uint64_t prp2;
+	uint32_t cdw10;
+	uint32_t cdw11;
+	uint32_t cdw12;
+	uint32_t cdw13;
+	uint32_t cdw14;
+	uint32_t cdw15;
+} __attribute__((packed));
+
+// Dataset Management range
+struct nvme_dsm_range {
+	uint32_t cattr;
+	uint32_t nlb;
+	uint64_t slba;
+} __attribute__((packed));
+
+struct nvme_cpl {
+	uint32_t dw0;           // command specific
+	uint32_t dw1;
+	uint16_t sq_head;
+	uint16_t sq_id;
+	uint16_t cid;
+	uint16_t status;        // phase tag [0], status field [15:1]
+} __attribute__((packed));
+
+int nvme_attach(struct pci_func *pcif);
+int nvme_init(void);
+int nvme_present(void);
+uint32_t nvme_sector_count(void);
+int nvme_read_sectors(uint32_t lba, uint32_t count, void *buf);
+int nvme_write_sectors(uint32_t lba, uint32_t count, const void *buf, int fua);
+int nvme_flush(void);
+int nvme_deallocate(uint32_t lba, uint32_t count);
+struct blkdev *nvme_blk_probe(void);
+
+#endif
@@ -0,0 +1,144 @@
+/* This is a simple PCI bus walker for NCTU OSDI course.
+ *  Reference: http://wiki.osdev.org/PCI, MIT 6.828 JOS kern/pci.c
+ */
+
+#include "pci.h"
+#include "nvme.h"
+#include "disk.h"
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+
+// Drivers matched by (class, subclass, progif)
+struct pci_driver pci_attach_class[] = {
+	{ PCI_CLASS_STORAGE, PCI_SUBCLASS_NVM, PCI_PROGIF_NVME, &nvme_attach },
+	{ PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, PCI_PROGIF_IDE_BM, &ide_pci_attach },
+	{ 0, 0, 0, 0 },
+};
+
+static uint32_t
+pci_conf_addr(struct pci_func *f, uint32_t off)
+{
+	return (1 << 31) | (f->bus << 16) | (f->dev << 11) | (f->func << 8) | (off & 0xFC);
+}
+
+uint32_t
+pci_conf_read(struct pci_func *f, uint32_t off)
+{
+	outl(PCI_CONF_ADDR, pci_conf_addr(f, off));
+	return inl(PCI_CONF_DATA);
+}
+
+void
+pci_conf_write(struct pci_func *f, uint32_t off, uint32_t v)
+{
+	outl(PCI_CONF_ADDR, pci_conf_addr(f, off));
+	outl(PCI_CONF_DATA, v);
+}
+
+/* Walk the capability list, return the config space offset of cap_id or 0 */
+int
+pci_find_cap(struct pci_func *f, uint8_t cap_id)
+{
+	uint32_t off;
+	int limit = 48;
+
+	if (!(pci_conf_read(f, PCI_STATUS_REG) & PCI_STATUS_CAPLIST))
+		return 0;
+
+	off = pci_conf_read(f, PCI_CAP_PTR_REG) & 0xFC;
+	while (off && limit--) {
+		uint32_t cap = pci_conf_read(f, off);
+		if ((cap & 0xFF) == cap_id)
+			return off;
+		off = (cap >> 8) & 0xFC;
+	}
+	return 0;
+}
+
+/* Turn on memory/IO decoding and bus mastering, then size every BAR */
+void
+pci_func_enable(struct pci_func *f)
+{
+	uint32_t bar, width;
+
+	pci_conf_write(f, PCI_COMMAND_REG,
+			PCI_COMMAND_IO_ENABLE |
+			PCI_COMMAND_MEM_ENABLE |
+			PCI_COMMAND_MASTER_ENABLE);
+
+	for (bar = PCI_BAR0_REG; bar < PCI_BAR_END_REG; bar += width) {
+		uint32_t oldv = pci_conf_read(f, bar);
+		uint32_t rv, base, size;
+		int regnum = (bar - PCI_BAR0_REG) / 4;
+
+		width = 4;
+		pci_conf_write(f, bar, 0xffffffff);
+		rv = pci_conf_read(f, bar);
+		if (rv == 0)
+			continue;
+
+		if (rv & PCI_BAR_IO) {
+			size = -(rv & 0xFFFFFFFC) & 0xFFFF;
+			base = PCI_BAR_IO_ADDR(oldv);
+		} else {
+			if (PCI_BAR_MEM_TYPE(rv) == PCI_BAR_MEM_64BIT)
+				width = 8;
+			size = -PCI_BAR_MEM_ADDR(rv);
+			base = PCI_BAR_MEM_ADDR(oldv);
+		}
+
+		pci_conf_write(f, bar, oldv);
+		f->reg_base[regnum] = base;
+		f->reg_size[regnum] = size;
+	}
+}
+
+static int
+pci_attach(struct pci_func *f)
+{
+	int i;
+	for (i = 0; pci_attach_class[i].attachfn; i++) {
+		if (pci_attach_class[i].class == PCI_CLASS(f->dev_class) &&
+		    pci_attach_class[i].subclass == PCI_SUBCLASS(f->dev_class) &&
+		    pci_attach_class[i].progif == PCI_PROGIF(f->dev_class)) {
+			int r = pci_attach_class[i].attachfn(f);
+			if (r < 0)
+				printk("pci_attach: attaching %x.%x.%x: %d\n",
+						f->bus, f->dev, f->func, r);
+			return r;
+		}
+	}
+	return 0;
+}
+
+/* Bus 0 is all QEMU's i440FX machine gives us, so we don't follow bridges */
+int
+pci_init(void)
+{
+	struct pci_func f;
+	int found = 0;
+
+	memset(&f, 0, sizeof(f));
+	for (f.dev = 0; f.dev < 32; f.dev++) {
+		uint32_t bhlc, nfunc;
+
+		f.func = 0;
+		bhlc = pci_conf_read(&f, PCI_BHLC_REG);
+		nfunc = PCI_HDRTYPE_MULTIFN(bhlc) ? 8 : 1;
+
+		for (f.func = 0; f.func < nfunc; f.func++) {
+			struct pci_func af = f;
+
+			af.dev_id = pci_conf_read(&af, PCI_ID_REG);
+			if (PCI_VENDOR(af.dev_id) == 0xFFFF)
+				continue;
+
+			af.dev_class = pci_conf_read(&af, PCI_CLASS_REG);
+			af.irq_line = pci_conf_read(&af, 0x3C) & 0xFF;
+			pci_attach(&af);
+			found++;
+		}
+	}
+	return found;
+}
@@ -0,0 +1,79 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include <inc/types.h>
+
+/* A simple PCI bus walker, modeled after the one used by MIT's JOS.
+ *  Reference: http://wiki.osdev.org/PCI
+ */
+
+#define PCI_CONF_ADDR      0xCF8
+#define PCI_CONF_DATA      0xCFC
+
+// Configuration space registers
+#define PCI_ID_REG         0x00
+#define PCI_COMMAND_REG    0x04
+	#define PCI_COMMAND_IO_ENABLE        0x0001
+	#define PCI_COMMAND_MEM_ENABLE       0x0002
+	#define PCI_COMMAND_MASTER_ENABLE    0x0004
+	#define PCI_COMMAND_INTX_DISABLE     0x0400
+#define PCI_STATUS_REG     0x04
+	#define PCI_STATUS_CAPLIST           0x00100000
+#define PCI_CLASS_REG      0x08
+#define PCI_BHLC_REG       0x0C
+#define PCI_BAR0_REG       0x10
+#define PCI_BAR_END_REG    0x28
+#define PCI_CAP_PTR_REG    0x34
+
+#define PCI_VENDOR(id)     ((id) & 0xFFFF)
+#define PCI_PRODUCT(id)    (((id) >> 16) & 0xFFFF)
+#define PCI_CLASS(cr)      (((cr) >> 24) & 0xFF)
+#define PCI_SUBCLASS(cr)   (((cr) >> 16) & 0xFF)
+#define PCI_PROGIF(cr)     (((cr) >> 8) & 0xFF)
+#define PCI_HDRTYPE_MULTIFN(bhlc)  (((bhlc) >> 16) & 0x80)
+
+// BAR decoding
+#define PCI_BAR_IO           0x1
+#define PCI_BAR_MEM_TYPE(b)  (((b) >> 1) & 0x3)
+	#define PCI_BAR_MEM_64BIT    0x2
+#define PCI_BAR_MEM_ADDR(b)  ((b) & 0xFFFFFFF0)
+#define PCI_BAR_IO_ADDR(b)   ((b) & 0xFFFFFFFC)
+
+// Capability IDs
+#define PCI_CAP_MSI        0x05
+#define PCI_CAP_MSIX       0x11
+
+// Device classes we care about
+#define PCI_CLASS_STORAGE        0x01
+#define PCI_SUBCLASS_IDE         0x01
+#define PCI_PROGIF_IDE_BM        0x80  // legacy ports, bus master capable
+#define PCI_SUBCLASS_NVM         0x08
+#define PCI_PROGIF_NVME          0x02
+
+#define PCI_MAX_BARS       6
+
+struct pci_func {
+	uint32_t bus;
+	uint32_t dev;
+	uint32_t func;
+
+	uint32_t dev_id;
+	uint32_t dev_class;
+
+	uint32_t reg_base[PCI_MAX_BARS];
+	uint32_t reg_size[PCI_MAX_BARS];
+	uint8_t  irq_line;
+};
+
+struct pci_driver {
+	uint32_t class, subclass, progif;
+	int (*attachfn) (struct pci_func *pcif);
+};
+
+int  pci_init(void);
+void pci_func_enable(struct pci_func *f);
+uint32_t pci_conf_read(struct pci_func *f, uint32_t off);
+void pci_conf_write(struct pci_func *f, uint32_t off, uint32_t v);
+int  pci_find_cap(struct pci_func *f, uint8_t cap_id);
+
+#endif
@@ -0,0 +1,134 @@
+/* A RAM backed block device, a fast scratch volume and a baseline for
+ * measuring the file system without any disk latency.
+ */
+
+#include "ramdisk.h"
+#include "blk.h"
+#include <inc/mmu.h>
+#include <inc/string.h>
+#include <kernel/mem.h>
+
+#define RAM_SECTS_PER_PAGE  (PGSIZE / BLK_SECTOR_SIZE)
+#define RAM_MAX_PAGES       (RAMDISK_MAX_MB * 256)
+#define RAM_PTRS_PER_PAGE   (PGSIZE / sizeof(uint8_t *))
+
+/* Two level page table: ram_index[] pages hold the data page pointers */
+static uint8_t **ram_index[(RAM_MAX_PAGES + RAM_PTRS_PER_PAGE - 1) / RAM_PTRS_PER_PAGE + 1];
+
+static void *
+ram_alloc_page(void)
+{
+	struct PageInfo *pp = page_alloc(ALLOC_ZERO);
+	if (!pp)
+		return NULL;
+	pp->pp_ref++;
+	return page2kva(pp);
+}
+
+/* Data page holding sector lba, allocated on demand when 'alloc' is set */
+static uint8_t *
+ram_page(uint32_t lba, int alloc)
+{
+	uint32_t pn = lba / RAM_SECTS_PER_PAGE;
+	uint8_t ***index = &ram_index[pn / RAM_PTRS_PER_PAGE];
+	uint8_t **slot;
+
+	if (!*index) {
+		if (!alloc || !(*index = ram_alloc_page()))
+			return NULL;
+	}
+	slot = &(*index)[pn % RAM_PTRS_PER_PAGE];
+	if (!*slot && alloc)
+		*slot = ram_alloc_page();
+	return *slot;
+}
+
+static int
+ram_read(struct blkdev *bd, uint32_t lba, uint32_t count, void *buf)
+{
+	uint8_t *dst = buf, *page;
+
+	if (lba + count > bd->sectors)
+		return -1;
+	for (; count > 0; count--, lba++, dst += BLK_SECTOR_SIZE) {
+		page = ram_page(lba, 0);
+		if (page)
+			memcpy(dst, page + (lba % RAM_SECTS_PER_PAGE) * BLK_SECTOR_SIZE, BLK_SECTOR_SIZE);
+		else
+			memset(dst, 0, BLK_SECTOR_SIZE);
+	}
+	return 0;
+}
+
+static int
+ram_write(struct blkdev *bd, uint32_t lba, uint32_t count, const void *buf, int fua)
+{
+	const uint8_t *src = buf;
+	uint8_t *page;
+
+	if (lba + count > bd->sectors)
+		return -1;
+	for (; count > 0; count--, lba++, src += BLK_SECTOR_SIZE) {
+		if (!(page = ram_page(lba, 1)))
+			return -1;  // out of memory
+		memcpy(page + (lba % RAM_SECTS_PER_PAGE) * BLK_SECTOR_SIZE, src, BLK_SECTOR_SIZE);
+	}
+	return 0;
+}
+
+static int
+ram_flush(struct blkdev *bd)
+{
+	return 0;
+}
+
+/* Give whole pages back to the allocator, zero the sectors of partly
+ * covered ones, so trimmed sectors read as zeros either way.
+ */
+static int
+ram_trim(struct blkdev *bd, uint32_t lba, uint32_t count)
+{
+	uint32_t pn, n, off;
+	uint8_t **slot, *page;
+
+	if (lba + count > bd->sectors)
+		return -1;
+	for (; count > 0; count -= n, lba += n) {
+		off = lba % RAM_SECTS_PER_PAGE;
+		n = MIN(count, RAM_SECTS_PER_PAGE - off);
+		pn = lba / RAM_SECTS_PER_PAGE;
+		if (!ram_index[pn / RAM_PTRS_PER_PAGE])
+			continue;
+		slot = &ram_index[pn / RAM_PTRS_PER_PAGE][pn % RAM_PTRS_PER_PAGE];
+		if (!(page = *slot))
+			continue;
+		if (n == RAM_SECTS_PER_PAGE) {
+			*slot = NULL;
+			page_decref(pa2page(PADDR(page)));
+		} else
+			memset(page + off * BLK_SECTOR_SIZE, 0, n * BLK_SECTOR_SIZE);
+	}
+	return 0;
+}
+
+struct blkdev *
+ramdisk_blk_probe(void)
+{
+	static struct blkdev bd = {
+		.name = "ram0",
+		.max_sects = 0xFFFF,
+		.read = ram_read,
+		.write = ram_write,
+		.flush = ram_flush,
+		.trim = ram_trim,
+	};
+
+	uint32_t pages = MIN(RAM_MAX_PAGES, sys_get_num_free_page() / RAMDISK_MEM_SHARE);
+
+	// Whole MBs, FatFs wants a few hundred sectors at least
+	pages -= pages % 256;
+	if (pages == 0)
+		return NULL;
+	bd.sectors = pages * RAM_SECTS_PER_PAGE;
+	return &bd;
+}
@@ -0,0 +1,15 @@
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include <inc/types.h>
+
+/* The RAM disk is sized at boot to 1/RAMDISK_MEM_SHARE of the free memory,
+ * at most RAMDISK_MAX_MB (0 disables it).  Pages are only allocated when a
+ * sector in them is first written, the rest reads back as zeros.
+ */
+#define RAMDISK_MAX_MB      64
+#define RAMDISK_MEM_SHARE   4
+
+struct blkdev *ramdisk_blk_probe(void);
+
+#endif
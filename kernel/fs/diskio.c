@@ -2,7 +2,12 @@
 #include <fs.h>
 #include <fat/diskio.h>
 #include <fat/ff.h>
-#include <kernel/drv/disk.h>
+#include <kernel/drv/blk.h>
+#include <kernel/timer.h>
+#include <kernel/spinlock.h>
+#include <kernel/mem.h>
+#include <inc/fs.h>
+#include <inc/x86.h>
 
 /*TODO: Lab7, low level file operator.
  *  You have to provide some device control interface for 
@@ -16,9 +21,8 @@
  *  doc directory (doc/00index_e.html)
  *
  *  Note:
- *  Since we only use primary slave disk as our file system,
- *  please ignore the pdrv parameter in below function and
- *  just manipulate the hdb disk.
+ *  The pdrv parameter indexes the block device registry
+ *  (kernel/drv/blk.c), pdrv 0 is the root disk.
  *
  *  Call flow example:
  *        ┌──────────────┐
@@ -50,10 +54,84 @@
  *        └──────────────┘
  */
 
-#define DISK_ID 1
+/* Every pdrv is a block device of the registry in kernel/drv/blk.c */
+#if BLK_MAX != _VOLUMES
+#error BLK_MAX and _VOLUMES must match
+#endif
+
+/* Write-through mode (MNT_SYNC) is kept per device in blkdev.write_through:
+ * a write returns only once it is durable.  NVMe writes carry FUA, IDE has
+ * no FUA command in PIO mode so the driver issues a CACHE FLUSH after every
+ * disk_write() instead.  In the default write-back mode the drive cache is
+ * only flushed on CTRL_SYNC (f_sync, fsync, sync).
+ */
+
+/* iostat counters live in each blkdev.  Requests are synchronous but may be
+ * issued from several CPUs at once, so in-flight depth and busy time are
+ * tracked under a lock.
+ */
+static struct spinlock stat_lock;
+
+static uint64_t io_start(struct blkdev *bd)
+{
+    struct blkdev *other;
+    uint64_t now;
+    int i;
+
+    spin_lock(&stat_lock);
+    now = read_tsc();
+    if (bd->stat.inflight++ == 0)
+        bd->busy_since = now;
+    for (i = 0; (other = blk_get(i)) != NULL; i++)
+        if (other != bd && other->stat.inflight) {
+            bd->stat.overlapped++;
+            break;
+        }
+    spin_unlock(&stat_lock);
+    return now;
+}
+
+static void io_done(struct blkdev *bd, int dir, uint64_t start, UINT count)
+{
+    struct disk_stat *st = &bd->stat;
+    UINT cmds = (count + bd->max_sects - 1) / bd->max_sects;
+    uint64_t now, lat;
+    uint32_t v;
+    int bucket = 0;
+
+    spin_lock(&stat_lock);
+    now = read_tsc();
+    lat = now - start;
+    if (--st->inflight == 0)
+        st->busy_cycles += now - bd->busy_since;
+    st->wait_cycles += lat;
+    st->ios[dir]++;
+    st->sectors[dir] += count;
+    st->cmds[dir] += cmds;
+    st->merges[dir] += count - cmds;
+
+    // log2 of the latency, saturating in the last bucket
+    v = (lat >> 32) ? 0xFFFFFFFF : (uint32_t)lat;
+    while (v >>= 1)
+        bucket++;
+    st->lat_hist[dir][bucket]++;
+    spin_unlock(&stat_lock);
+}
+
+int disk_get_stat (BYTE pdrv, struct disk_stat* st)
+{
+    struct blkdev *bd = blk_get(pdrv);
+
+    if (!bd)
+        return -1;
+    spin_lock(&stat_lock);
+    *st = bd->stat;
+    spin_unlock(&stat_lock);
+    return 0;
+}
 
 /**
-  * @brief  Initial IDE disk
+  * @brief  Initial a block device
   * @param  pdrv: Physical drive number
   * @retval disk error status
   *         - 0: Initial success
@@ -62,12 +140,14 @@
   */
 DSTATUS disk_initialize (BYTE pdrv)
 {
-  /* TODO */
-  /* Note: You can create a function under disk.c  
-   *       to help you get the disk status.
-   */
-  disk_init();
-  return get_status();
+  static int init = 0;
+
+  /* Devices are probed by blk_init() at boot, only check it is there */
+  if (!init) {
+    spin_initlock(&stat_lock);
+    init = 1;
+  }
+  return disk_status(pdrv);
 }
 
 /**
@@ -80,15 +160,15 @@ DSTATUS disk_initialize (BYTE pdrv)
   */
 DSTATUS disk_status (BYTE pdrv)
 {
-/* TODO */
-/* Note: You can create a function under disk.c  
- *       to help you get the disk status.
- */
-  return get_status();
+  struct blkdev *bd = blk_get(pdrv);
+
+  if (!bd)
+    return STA_NOINIT;
+  return bd->boot ? STA_PROTECT : 0;
 }
 
 /**
-  * @brief  Read serval sector form a IDE disk
+  * @brief  Read serval sector form a block device
   * @param  pdrv: Physical drive number
   * @param  buff: destination memory start address
   * @param  sector: start sector number
@@ -99,21 +179,20 @@ DSTATUS disk_status (BYTE pdrv)
   */
 DRESULT disk_read (BYTE pdrv, BYTE* buff, DWORD sector, UINT count)
 {
-    int err = 0;
-    int i = count;
-    BYTE *ptr = buff;
-    UINT cur_sector = sector;
-    /* TODO */
-    for ( ; i > 0 && !err; i--) {
-        err = ide_read_sectors(DISK_ID, 1, cur_sector, ptr);
-        cur_sector++;
-        ptr += 512;
-    }
-    return err;
+    struct blkdev *bd = blk_get(pdrv);
+    uint64_t start;
+    int err;
+
+    if (!bd)
+        return RES_PARERR;
+    start = io_start(bd);
+    err = bd->read(bd, sector, count, buff);
+    io_done(bd, DISK_STAT_READ, start, count);
+    return err ? RES_ERROR : RES_OK;
 }
 
 /**
-  * @brief  Write serval sector to a IDE disk
+  * @brief  Write serval sector to a block device
   * @param  pdrv: Physical drive number
   * @param  buff: memory start address
   * @param  sector: destination start sector number
@@ -124,17 +203,42 @@ DRESULT disk_read (BYTE pdrv, BYTE* buff, DWORD sector, UINT count)
   */
 DRESULT disk_write (BYTE pdrv, const BYTE* buff, DWORD sector, UINT count)
 {
-    int err = 0;
-    int i = count;
-    BYTE *ptr = buff;
-    UINT cur_sector = sector;
-    /* TODO */    
-    for ( ; i > 0 && !err; i--) {
-        err = ide_write_sectors(DISK_ID, 1, cur_sector, ptr);
-        cur_sector++;
-        ptr += 512;
+    struct blkdev *bd = blk_get(pdrv);
+    uint64_t start;
+    int err;
+
+    if (!bd)
+        return RES_PARERR;
+    if (bd->boot)
+        return RES_WRPRT;
+    start = io_start(bd);
+    err = bd->write(bd, sector, count, buff, bd->write_through);
+    io_done(bd, DISK_STAT_WRITE, start, count);
+    return err ? RES_ERROR : RES_OK;
+}
+
+/* FatFs passes the clusters it frees (remove_chain) and the whole data area
+ * on f_mkfs.  Trim is only a hint, devices without it silently ignore it.
+ */
+static DRESULT disk_trim (struct blkdev *bd, DWORD first, DWORD last)
+{
+    int err;
+
+    if (bd->boot)
+        return RES_WRPRT;
+    if (last < first || last >= bd->sectors)
+        return RES_PARERR;
+    if (!bd->trim)
+        return RES_OK;
+
+    err = bd->trim(bd, first, last - first + 1);
+    if (!err) {
+        spin_lock(&stat_lock);
+        bd->stat.discards++;
+        bd->stat.discard_sectors += last - first + 1;
+        spin_unlock(&stat_lock);
     }
-    return err;
+    return err ? RES_ERROR : RES_OK;
 }
 
 /**
@@ -143,6 +247,9 @@ DRESULT disk_write (BYTE pdrv, const BYTE* buff, DWORD sector, UINT count)
   * @param  cmd: disk control command (See diskio.h)
   *         - GET_SECTOR_COUNT
   *         - GET_BLOCK_SIZE (Same as sector size)
+  *         - CTRL_SYNC (Flush the drive write cache)
+  *         - CTRL_WRITE_THROUGH (Switch between write-back and write-through)
+  *         - CTRL_TRIM (Release a sector range, buff holds its first and last sector)
   * @param  buff: return memory space
   * @retval Results of Disk Functions (See diskio.h)
   *         - RES_OK: success
@@ -150,12 +257,21 @@ DRESULT disk_write (BYTE pdrv, const BYTE* buff, DWORD sector, UINT count)
   */
 DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff)
 {
+    struct blkdev *bd = blk_get(pdrv);
     uint32_t *retVal = (uint32_t *)buff;
-    /* TODO */
+
+    if (!bd)
+        return RES_PARERR;
     if (cmd == GET_SECTOR_COUNT)
-        *retVal = 65535;
+        *retVal = bd->sectors;
     else if (cmd == GET_BLOCK_SIZE)
         *retVal = 512;
+    else if (cmd == CTRL_SYNC)
+        return bd->flush(bd) ? RES_ERROR : RES_OK;
+    else if (cmd == CTRL_WRITE_THROUGH)
+        bd->write_through = *retVal;
+    else if (cmd == CTRL_TRIM)
+        return disk_trim(bd, retVal[0], retVal[1]);
     return RES_OK;
 }
 
@@ -168,3 +284,50 @@ DWORD get_fattime (void)
     /* TODO */
     return sys_get_ticks();
 }
+
+/* FatFs re-entrancy (_FS_REENTRANT), one lock per volume.  Kernel code is
+ * never preempted, so a volume is only held across a single FatFs call and
+ * waiters on other CPUs just spin, _FS_TIMEOUT is not used.
+ */
+static struct spinlock vol_lock[_VOLUMES];
+
+int ff_cre_syncobj (BYTE vol, _SYNC_t* sobj)
+{
+    spin_initlock(&vol_lock[vol]);
+    *sobj = &vol_lock[vol];
+    return 1;
+}
+
+int ff_del_syncobj (_SYNC_t sobj)
+{
+    return 1;
+}
+
+int ff_req_grant (_SYNC_t sobj)
+{
+    spin_lock(sobj);
+    return 1;
+}
+
+void ff_rel_grant (_SYNC_t sobj)
+{
+    spin_unlock(sobj);
+}
+
+/* FatFs heap for the free cluster bitmap (_USE_FREEMAP), straight from the
+ * page allocator, so a block never exceeds a page.
+ */
+void* ff_memalloc (UINT msize)
+{
+    struct PageInfo *pp;
+
+    if (msize > PGSIZE || !(pp = page_alloc(ALLOC_ZERO)))
+        return NULL;
+    pp->pp_ref++;
+    return page2kva(pp);
+}
+
+void ff_memfree (void* mblock)
+{
+    page_decref(pa2page(PADDR(mblock)));
+}
@@ -35,6 +35,10 @@ DRESULT disk_read (BYTE pdrv, BYTE* buff, DWORD sector, UINT count);
 DRESULT disk_write (BYTE pdrv, const BYTE* buff, DWORD sector, UINT count);
 DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 
+/* OSDI extension, I/O statistics of a physical drive (struct disk_stat) */
+struct disk_stat;
+int disk_get_stat (BYTE pdrv, struct disk_stat* st);
+
 
 /* Disk Status Bits (DSTATUS) */
 
@@ -73,6 +77,9 @@ DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 #define ATA_GET_MODEL		21	/* Get model name */
 #define ATA_GET_SN			22	/* Get serial number */
 
+/* OSDI specific ioctl command */
+#define CTRL_WRITE_THROUGH	30	/* Set (1) or clear (0) write-through mode, see MNT_SYNC */
+
 #ifdef __cplusplus
 }
 #endif
@@ -68,17 +68,75 @@
 #endif
 
 
+/* Directory entry cache */
+#if _USE_DCACHE && (_USE_LFN != 0 || _FS_EXFAT)
+#error _USE_DCACHE needs _USE_LFN and _FS_EXFAT to be 0
+#endif
+
+
+/* Free cluster bitmap */
+#if _USE_FREEMAP
+#if _FS_READONLY || _FS_EXFAT
+#error _USE_FREEMAP needs _FS_READONLY and _FS_EXFAT to be 0
+#endif
+#define FMAP_BLK	4096				/* Size of a bitmap block [byte] */
+#define FMAP_WORDS	(FMAP_BLK / 4)		/* Number of bitmap words in a block */
+#define FMAP_BITS	(FMAP_BLK * 8)		/* Number of clusters in a block */
+#endif
+
+
+/* Directory hash index */
+#if _DIR_INDEX
+#if _USE_LFN != 0 || _FS_EXFAT
+#error _DIR_INDEX needs _USE_LFN and _FS_EXFAT to be 0
+#endif
+#if _DIR_INDEX_ENT < 1 || _DIR_INDEX_ENT > 0x8000
+#error Wrong _DIR_INDEX_ENT setting
+#endif
+#define DIDX_HASH	512					/* Number of hash chains */
+#define DIDX_FREE	512					/* Number of free slots to remember */
+#define DIDX_BLKENT	256					/* Number of names in an index block (4 KiB) */
+#define DIDX_NBLK	((_DIR_INDEX_ENT + DIDX_BLKENT - 1) / DIDX_BLKENT)
+#define DIDX_NIL	0xFFFF				/* End of chain */
+
+typedef struct {
+	BYTE	name[11];	/* SFN */
+	BYTE	rsv;
+	WORD	slot;		/* Entry number in the directory (offset / SZDIRE) */
+	WORD	next;		/* Next name on the hash chain or the unused list */
+} DIDXE;
+
+typedef struct _didx {
+	DWORD	dir;		/* Directory start cluster (0:root) */
+	DWORD	end;		/* Entry number of the end of table */
+	BYTE	over;		/* The directory has more names than the index can hold */
+	BYTE	lost;		/* Some free slots were not remembered */
+	WORD	nent;		/* Number of names ever used in the blocks */
+	WORD	efree;		/* Head of the unused name list */
+	WORD	nfree;		/* Number of items in fslot[] */
+	WORD	hash[DIDX_HASH];	/* Hash chain heads */
+	WORD	fslot[DIDX_FREE];	/* Known free slots, a stack */
+	DIDXE*	blk[DIDX_NBLK];		/* Name blocks */
+} DIDX;
+#endif
+
+
 /* File lock controls */
 #if _FS_LOCK != 0
 #if _FS_READONLY
 #error _FS_LOCK must be 0 at read-only configuration
 #endif
-typedef struct {
-	FATFS *fs;		/* Object ID 1, volume (NULL:blank entry) */
+typedef struct _filesem {
+	FATFS *fs;		/* Object ID 1, volume */
 	DWORD clu;		/* Object ID 2, directory (0:root) */
 	DWORD ofs;		/* Object ID 3, directory offset */
 	WORD ctr;		/* Object open counter, 0:none, 0x01..0xFF:read mode open count, 0x100:write mode */
+	struct _filesem* next;	/* Next entry in the hash chain or the blank list */
 } FILESEM;
+
+#define	LOCK_BLK	4096	/* Size of a lock semaphore block from ff_memalloc() */
+#define	LOCK_ENT	((LOCK_BLK - sizeof (void*)) / sizeof (FILESEM))	/* Semaphores per block, the first word chains the blocks */
+#define	LOCK_HASH(clu, ofs)	(((clu) ^ ((ofs) / SZDIRE)) % _FS_LOCK)
 #endif
 
 
@@ -499,10 +557,6 @@ static WORD Fsid;				/* File system mount ID */
 static BYTE CurrVol;			/* Current drive */
 #endif
 
-#if _FS_LOCK != 0
-static FILESEM Files[_FS_LOCK];	/* Open object lock semaphores */
-#endif
-
 #if _USE_LFN == 0			/* Non-LFN configuration */
 #define	DEF_NAMBUF			BYTE sfn[12]
 #define INIT_NAMBUF(dobj)	(dobj).fn = sfn
@@ -741,107 +795,131 @@ void unlock_fs (
 #if _FS_LOCK != 0
 
 static
-FRESULT chk_lock (	/* Check if the file can be accessed */
-	DIR* dp,		/* Directory object pointing the file to be checked */
-	int acc			/* Desired access type (0:Read, 1:Write, 2:Delete/Rename) */
+FILESEM* find_lock (	/* Find the semaphore of an open object (NULL:not opened) */
+	DIR* dp			/* Directory object pointing the file */
 )
 {
-	UINT i, be;
+	FILESEM *sem;
 
-	/* Search file semaphore table */
-	for (i = be = 0; i < _FS_LOCK; i++) {
-		if (Files[i].fs) {	/* Existing entry */
-			if (Files[i].fs == dp->obj.fs &&	 	/* Check if the object matched with an open object */
-				Files[i].clu == dp->obj.sclust &&
-				Files[i].ofs == dp->dptr) break;
-		} else {			/* Blank entry */
-			be = 1;
-		}
-	}
-	if (i == _FS_LOCK) {	/* The object is not opened */
-		return (be || acc == 2) ? FR_OK : FR_TOO_MANY_OPEN_FILES;	/* Is there a blank entry for new object? */
-	}
 
-	/* The object has been opened. Reject any open against writing file and all write mode open */
-	return (acc || Files[i].ctr == 0x100) ? FR_LOCKED : FR_OK;
+	sem = dp->obj.fs->lock[LOCK_HASH(dp->obj.sclust, dp->dptr)];
+	while (sem && (sem->clu != dp->obj.sclust || sem->ofs != dp->dptr)) sem = sem->next;
+	return sem;
 }
 
 
 static
-int enq_lock (void)	/* Check if an entry is available for a new object */
+int enq_lock (	/* Make sure a blank entry is available for a new object (0:Not enough core) */
+	FATFS* fs	/* File system object */
+)
 {
+	void **blk;
+	FILESEM *sem;
 	UINT i;
 
-	for (i = 0; i < _FS_LOCK && Files[i].fs; i++) ;
-	return (i == _FS_LOCK) ? 0 : 1;
+
+	if (fs->lock_free) return 1;
+	blk = ff_memalloc(LOCK_BLK);	/* Grow the volume's semaphores by a block */
+	if (!blk) return 0;
+	*blk = fs->lock_blk; fs->lock_blk = blk;
+	sem = (FILESEM*)(blk + 1);
+	for (i = 0; i < LOCK_ENT; i++) {
+		sem[i].next = fs->lock_free; fs->lock_free = &sem[i];
+	}
+	return 1;
 }
 
 
 static
-UINT inc_lock (	/* Increment object open counter and returns its index (0:Internal error) */
-	DIR* dp,	/* Directory object pointing the file to register or increment */
-	int acc		/* Desired access (0:Read, 1:Write, 2:Delete/Rename) */
+FRESULT chk_lock (	/* Check if the file can be accessed */
+	DIR* dp,		/* Directory object pointing the file to be checked */
+	int acc			/* Desired access type (0:Read, 1:Write, 2:Delete/Rename) */
 )
 {
-	UINT i;
+	FILESEM *sem;
 
 
-	for (i = 0; i < _FS_LOCK; i++) {	/* Find the object */
-		if (Files[i].fs == dp->obj.fs &&
-			Files[i].clu == dp->obj.sclust &&
-			Files[i].ofs == dp->dptr) break;
+	sem = find_lock(dp);
+	if (!sem) {	/* The object is not opened */
+		return (acc == 2 || enq_lock(dp->obj.fs)) ? FR_OK : FR_TOO_MANY_OPEN_FILES;	/* Is there a blank entry for new object? */
 	}
 
-	if (i == _FS_LOCK) {				/* Not opened. Register it as new. */
-		for (i = 0; i < _FS_LOCK && Files[i].fs; i++) ;
-		if (i == _FS_LOCK) return 0;	/* No free entry to register (int err) */
-		Files[i].fs = dp->obj.fs;
-		Files[i].clu = dp->obj.sclust;
-		Files[i].ofs = dp->dptr;
-		Files[i].ctr = 0;
+	/* The object has been opened. Reject any open against writing file and all write mode open */
+	return (acc || sem->ctr == 0x100) ? FR_LOCKED : FR_OK;
+}
+
+
+static
+FILESEM* inc_lock (	/* Increment object open counter and returns its semaphore (NULL:Internal error) */
+	DIR* dp,	/* Directory object pointing the file to register or increment */
+	int acc		/* Desired access (0:Read, 1:Write, 2:Delete/Rename) */
+)
+{
+	FATFS *fs = dp->obj.fs;
+	FILESEM *sem, **chain;
+
+
+	sem = find_lock(dp);
+	if (!sem) {					/* Not opened. Register it as new. */
+		if (!enq_lock(fs)) return 0;	/* No free entry to register (int err) */
+		sem = fs->lock_free; fs->lock_free = sem->next;
+		sem->fs = fs;
+		sem->clu = dp->obj.sclust;
+		sem->ofs = dp->dptr;
+		sem->ctr = 0;
+		chain = &fs->lock[LOCK_HASH(sem->clu, sem->ofs)];
+		sem->next = *chain; *chain = sem;
 	}
 
-	if (acc && Files[i].ctr) return 0;	/* Access violation (int err) */
+	if (acc && sem->ctr) return 0;	/* Access violation (int err) */
 
-	Files[i].ctr = acc ? 0x100 : Files[i].ctr + 1;	/* Set semaphore value */
+	sem->ctr = acc ? 0x100 : sem->ctr + 1;	/* Set semaphore value */
 
-	return i + 1;
+	return sem;
 }
 
 
 static
 FRESULT dec_lock (	/* Decrement object open counter */
-	UINT i			/* Semaphore index (1..) */
+	FILESEM* sem	/* Semaphore of the object */
 )
 {
+	FATFS *fs;
+	FILESEM **chain;
 	WORD n;
-	FRESULT res;
 
 
-	if (--i < _FS_LOCK) {	/* Shift index number origin from 0 */
-		n = Files[i].ctr;
-		if (n == 0x100) n = 0;		/* If write mode open, delete the entry */
-		if (n > 0) n--;				/* Decrement read mode open count */
-		Files[i].ctr = n;
-		if (n == 0) Files[i].fs = 0;	/* Delete the entry if open count gets zero */
-		res = FR_OK;
-	} else {
-		res = FR_INT_ERR;			/* Invalid index nunber */
+	if (!sem || !sem->fs) return FR_INT_ERR;	/* Invalid semaphore */
+	n = sem->ctr;
+	if (n == 0x100) n = 0;		/* If write mode open, delete the entry */
+	if (n > 0) n--;				/* Decrement read mode open count */
+	sem->ctr = n;
+	if (n == 0) {				/* Delete the entry if open count gets zero */
+		fs = sem->fs;
+		chain = &fs->lock[LOCK_HASH(sem->clu, sem->ofs)];
+		while (*chain != sem) chain = &(*chain)->next;
+		*chain = sem->next;
+		sem->fs = 0;
+		sem->next = fs->lock_free; fs->lock_free = sem;
 	}
-	return res;
+	return FR_OK;
 }
 
 
 static
-void clear_lock (	/* Clear lock entries of the volume */
+void clear_lock (	/* Clear lock entries of the volume and release their blocks */
 	FATFS *fs
 )
 {
-	UINT i;
+	void **blk;
+
 
-	for (i = 0; i < _FS_LOCK; i++) {
-		if (Files[i].fs == fs) Files[i].fs = 0;
+	while ((blk = fs->lock_blk) != 0) {
+		fs->lock_blk = *blk;
+		ff_memfree(blk);
 	}
+	mem_set(fs->lock, 0, sizeof fs->lock);
+	fs->lock_free = 0;
 }
 #endif
 
@@ -1040,6 +1118,177 @@ DWORD get_fat (	/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFFF:Cluste
 
 
 
+/*-----------------------------------------------------------------------*/
+/* FAT access - Free cluster bitmap                                      */
+/*-----------------------------------------------------------------------*/
+
+#if _USE_FREEMAP
+static
+void fmap_mark (
+	FATFS* fs,		/* File system object */
+	DWORD clst,		/* Cluster number to be marked */
+	int used		/* 1:In use, 0:Free */
+)
+{
+	DWORD *bm = &fs->fmap[clst / FMAP_BITS][clst % FMAP_BITS / 32];
+
+
+	if (used) {
+		*bm |= (DWORD)1 << (clst % 32);
+	} else {
+		*bm &= ~((DWORD)1 << (clst % 32));
+	}
+}
+
+
+static
+void fmap_free (
+	FATFS* fs		/* File system object */
+)
+{
+	UINT i, n;
+
+
+	if (!fs->fmap) return;
+	n = (fs->n_fatent + FMAP_BITS - 1) / FMAP_BITS;
+	for (i = 0; i < n; i++) {
+		if (fs->fmap[i]) ff_memfree(fs->fmap[i]);
+	}
+	ff_memfree(fs->fmap);
+	fs->fmap = 0;
+}
+
+
+static
+void fmap_build (	/* The volume is left without bitmap on any error */
+	FATFS* fs		/* File system object (mounted) */
+)
+{
+	DWORD clst, sect, stat, nfree;
+	UINT i, n;
+	BYTE *p;
+	_FDID obj;
+
+
+	/* Allocate the blocks, every cluster (and the padding after the last one) starts 'in use' */
+	n = (fs->n_fatent + FMAP_BITS - 1) / FMAP_BITS;
+	fs->fmap = ff_memalloc(n * sizeof (DWORD*));
+	if (!fs->fmap) return;
+	mem_set(fs->fmap, 0, n * sizeof (DWORD*));
+	for (i = 0; i < n; i++) {
+		fs->fmap[i] = ff_memalloc(FMAP_BLK);
+		if (!fs->fmap[i]) {
+			fmap_free(fs); return;
+		}
+		mem_set(fs->fmap[i], 0xFF, FMAP_BLK);
+	}
+
+	/* Clear the free clusters with a single pass over the FAT */
+	nfree = 0;
+	if (fs->fs_type == FS_FAT12) {	/* FAT12: Sector unalighed FAT entries */
+		clst = 2; obj.fs = fs;
+		do {
+			stat = get_fat(&obj, clst);
+			if (stat == 1 || stat == 0xFFFFFFFF) {
+				fmap_free(fs); return;
+			}
+			if (stat == 0) {
+				fmap_mark(fs, clst, 0); nfree++;
+			}
+		} while (++clst < fs->n_fatent);
+	} else {						/* FAT16/32: Sector alighed FAT entries */
+		sect = fs->fatbase;
+		i = 0; p = 0;
+		for (clst = 0; clst < fs->n_fatent; clst++) {
+			if (i == 0) {
+				if (move_window(fs, sect++) != FR_OK) {
+					fmap_free(fs); return;
+				}
+				p = fs->win;
+				i = SS(fs);
+			}
+			if (fs->fs_type == FS_FAT16) {
+				stat = ld_word(p);
+				p += 2; i -= 2;
+			} else {
+				stat = ld_dword(p) & 0x0FFFFFFF;
+				p += 4; i -= 4;
+			}
+			if (stat == 0 && clst >= 2) {
+				fmap_mark(fs, clst, 0); nfree++;
+			}
+		}
+	}
+
+	if (fs->free_clst != nfree) {	/* The count is exact now, correct FSINFO if needed */
+		fs->free_clst = nfree;
+		fs->fsi_flag |= 1;
+	}
+}
+
+
+static
+DWORD fmap_find (	/* 0:No free cluster, >=2:Free cluster# */
+	FATFS* fs,		/* File system object */
+	DWORD scl		/* Cluster# to start the search after (next fit) */
+)
+{
+	DWORD clst, wi, nw, cnt, w;
+
+
+	clst = scl + 1;
+	if (clst < 2 || clst >= fs->n_fatent) clst = 2;
+	nw = (fs->n_fatent + 31) / 32;	/* Number of bitmap words in use */
+	wi = clst / 32;
+	w = ~fs->fmap[wi / FMAP_WORDS][wi % FMAP_WORDS] & (0xFFFFFFFF << (clst % 32));
+	for (cnt = 0; !w; ) {	/* Skip 32 clusters at a time while in use, wrap around once */
+		if (++cnt > nw) return 0;
+		if (++wi >= nw) wi = 0;
+		w = ~fs->fmap[wi / FMAP_WORDS][wi % FMAP_WORDS];
+	}
+	for (clst = wi * 32; !(w & 1); clst++) w >>= 1;
+
+	return clst;	/* Cluster 0, 1 and the padding are never cleared */
+}
+
+
+#if _USE_EXPAND
+static
+DWORD fmap_find_run (	/* 0:Not found, >=2:Top of the free cluster block */
+	FATFS* fs,		/* File system object */
+	DWORD stcl,		/* Cluster# to start the search at */
+	DWORD tcl		/* Number of contiguous clusters required */
+)
+{
+	DWORD clst, scl, ncl, n;
+
+
+	clst = scl = stcl; ncl = 0;
+	for (n = fs->n_fatent - 2; n; ) {	/* Scan all clusters once, a block can't wrap around */
+		if (clst >= fs->n_fatent) {
+			clst = scl = 2; ncl = 0;
+		}
+		if (clst % 32 == 0 && n >= 32 && fs->fmap[clst / FMAP_BITS][clst % FMAP_BITS / 32] == 0xFFFFFFFF) {
+			clst += 32; n -= 32;		/* Skip 32 clusters in use at a time */
+			scl = clst; ncl = 0;
+			continue;
+		}
+		if (fs->fmap[clst / FMAP_BITS][clst % FMAP_BITS / 32] & ((DWORD)1 << (clst % 32))) {
+			scl = clst + 1; ncl = 0;	/* Not a free cluster */
+		} else {
+			if (++ncl == tcl) return scl;	/* Break if a contiguous cluster block was found */
+		}
+		clst++; n--;
+	}
+
+	return 0;
+}
+#endif
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* FAT access - Change value of a FAT entry                              */
 /*-----------------------------------------------------------------------*/
@@ -1093,6 +1342,9 @@ FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 			fs->wflag = 1;
 			break;
 		}
+#if _USE_FREEMAP
+		if (res == FR_OK && fs->fmap) fmap_mark(fs, clst, val != 0);	/* Keep the bitmap in sync */
+#endif
 	}
 	return res;
 }
@@ -1244,7 +1496,7 @@ FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 			res = put_fat(fs, clst, 0);		/* Mark the cluster 'free' on the FAT */
 			if (res != FR_OK) return res;
 		}
-		if (fs->free_clst != 0xFFFFFFFF) {	/* Update FSINFO */
+		if (fs->free_clst < fs->n_fatent - 2) {	/* Update FSINFO, only a valid count */
 			fs->free_clst++;
 			fs->fsi_flag |= 1;
 		}
@@ -1330,6 +1582,12 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 			}
 		}
 	} else
+#endif
+#if _USE_FREEMAP
+	if (fs->fmap) {	/* At the FAT12/16/32 with the bitmap, the FAT is not read */
+		ncl = fmap_find(fs, scl);			/* Find a free cluster */
+		if (ncl == 0) return 0;				/* No free cluster */
+	} else
 #endif
 	{	/* At the FAT12/16/32 */
 		ncl = scl;	/* Start cluster */
@@ -1517,6 +1775,285 @@ FRESULT dir_next (	/* FR_OK(0):succeeded, FR_NO_FILE:End of table, FR_DENIED:Cou
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Hash index of the names in a directory           */
+/*-----------------------------------------------------------------------*/
+/* An index maps every SFN in a directory to its entry number and keeps a
+/  stack of free entries and the end of table. It is built by a single pass
+/  over the directory and then follows dir_register() and dir_remove(), so a
+/  lookup or a new entry does not scan the table. */
+#if _DIR_INDEX
+#define DIDX_ENT(ix, e)	(&(ix)->blk[(e) / DIDX_BLKENT][(e) % DIDX_BLKENT])
+
+static
+UINT didx_hash (const BYTE* name)	/* Hash chain of an SFN */
+{
+	UINT n, h = 0;
+
+
+	for (n = 0; n < 11; n++) h = h * 31 + name[n];
+	return h % DIDX_HASH;
+}
+
+
+static
+void didx_clear (	/* Release the names and leave an empty index */
+	DIDX* ix,		/* Index to clear */
+	DWORD dir		/* Directory start cluster to be indexed */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < DIDX_NBLK; i++) {
+		if (ix->blk[i]) ff_memfree(ix->blk[i]);
+	}
+	mem_set(ix, 0, sizeof (DIDX));
+	mem_set(ix->hash, 0xFF, sizeof ix->hash);
+	ix->efree = DIDX_NIL;
+	ix->dir = dir;
+}
+
+
+static
+DIDX* didx_find (	/* 0:Not indexed */
+	FATFS* fs,		/* File system object */
+	DWORD dir		/* Directory start cluster */
+)
+{
+	UINT i;
+	DIDX *ix;
+
+
+	for (i = 0; i < _DIR_INDEX && fs->didx[i]; i++) {
+		ix = fs->didx[i];
+		if (ix->dir == dir) {
+			for ( ; i; i--) fs->didx[i] = fs->didx[i - 1];	/* Move it to the front */
+			fs->didx[0] = ix;
+			return ix;
+		}
+	}
+	return 0;
+}
+
+
+static
+void didx_drop (
+	FATFS* fs,		/* File system object */
+	DWORD dir		/* Directory start cluster */
+)
+{
+	UINT i;
+	DIDX *ix = didx_find(fs, dir);
+
+
+	if (!ix) return;
+	for (i = 0; i < _DIR_INDEX - 1; i++) fs->didx[i] = fs->didx[i + 1];	/* It is at the front */
+	fs->didx[i] = 0;
+	didx_clear(ix, 0);
+	ff_memfree(ix);
+}
+
+
+static
+void didx_purge (	/* Drop every index of the volume */
+	FATFS* fs		/* File system object */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < _DIR_INDEX; i++) {
+		if (fs->didx[i]) {
+			didx_clear(fs->didx[i], 0);
+			ff_memfree(fs->didx[i]);
+			fs->didx[i] = 0;
+		}
+	}
+}
+
+
+static
+WORD didx_lookup (	/* DIDX_NIL:Not found, else name number */
+	DIDX* ix,		/* Index */
+	const BYTE* name	/* SFN to find */
+)
+{
+	WORD e;
+
+
+	for (e = ix->hash[didx_hash(name)]; e != DIDX_NIL; e = DIDX_ENT(ix, e)->next) {
+		if (!mem_cmp(DIDX_ENT(ix, e)->name, name, 11)) break;
+	}
+	return e;
+}
+
+
+static
+void didx_insert (
+	DIDX* ix,		/* Index */
+	const BYTE* name,	/* SFN */
+	DWORD slot		/* Entry number */
+)
+{
+	WORD e;
+	UINT h;
+	DIDXE *ent;
+
+
+	if (ix->over || didx_lookup(ix, name) != DIDX_NIL) return;	/* The first entry of a name wins as dir_find() does */
+	if (ix->efree != DIDX_NIL) {	/* Reuse a name released by didx_remove() */
+		e = ix->efree;
+		ix->efree = DIDX_ENT(ix, e)->next;
+	} else {
+		e = ix->nent;
+		if (e >= _DIR_INDEX_ENT || (!ix->blk[e / DIDX_BLKENT] && !(ix->blk[e / DIDX_BLKENT] = ff_memalloc(DIDX_BLKENT * sizeof (DIDXE))))) {
+			didx_clear(ix, ix->dir);	/* Too large, the directory is searched linearly */
+			ix->over = 1;
+			return;
+		}
+		ix->nent++;
+	}
+	h = didx_hash(name);
+	ent = DIDX_ENT(ix, e);
+	mem_cpy(ent->name, name, 11);
+	ent->slot = (WORD)slot;
+	ent->next = ix->hash[h];
+	ix->hash[h] = e;
+}
+
+
+static
+void didx_remove (
+	DIDX* ix,		/* Index */
+	const BYTE* name	/* SFN */
+)
+{
+	WORD *pe, e;
+
+
+	if (ix->over) return;
+	for (pe = &ix->hash[didx_hash(name)]; (e = *pe) != DIDX_NIL; pe = &DIDX_ENT(ix, e)->next) {
+		if (!mem_cmp(DIDX_ENT(ix, e)->name, name, 11)) {
+			*pe = DIDX_ENT(ix, e)->next;
+			DIDX_ENT(ix, e)->next = ix->efree;
+			ix->efree = e;
+			break;
+		}
+	}
+}
+
+
+static
+void didx_put_slot (	/* Remember a free entry */
+	DIDX* ix,		/* Index */
+	DWORD slot		/* Entry number */
+)
+{
+	if (ix->nfree < DIDX_FREE) {
+		ix->fslot[ix->nfree++] = (WORD)slot;
+	} else {
+		ix->lost = 1;
+	}
+}
+
+
+static
+DIDX* didx_build (	/* 0:Could not be built */
+	DIR* dp			/* Directory object to be indexed */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	DIDX *ix;
+	UINT i;
+	BYTE c;
+
+
+	/* Get a new index or recycle the least recently used one */
+	for (i = 0; i < _DIR_INDEX && fs->didx[i]; i++) ;
+	if (i == _DIR_INDEX) {
+		ix = fs->didx[--i];
+	} else {
+		ix = ff_memalloc(sizeof (DIDX));
+		if (!ix) return 0;
+		mem_set(ix, 0, sizeof (DIDX));
+	}
+	didx_clear(ix, dp->obj.sclust);
+	for ( ; i; i--) fs->didx[i] = fs->didx[i - 1];
+	fs->didx[0] = ix;
+
+	/* Enter every name and free entry up to the end of table */
+	res = dir_sdi(dp, 0);
+	while (res == FR_OK) {
+		res = move_window(fs, dp->sect);
+		if (res != FR_OK) break;
+		c = dp->dir[DIR_Name];
+		if (c == 0) break;						/* End of table */
+		if (c == DDEM) {
+			didx_put_slot(ix, dp->dptr / SZDIRE);
+		} else if (!(dp->dir[DIR_Attr] & AM_VOL)) {
+			didx_insert(ix, dp->dir, dp->dptr / SZDIRE);
+		}
+		res = dir_next(dp, 0);
+		if (res == FR_NO_FILE) {				/* Table is full */
+			res = FR_OK;
+			ix->end = dp->dptr / SZDIRE + 1;
+			break;
+		}
+	}
+	if (res != FR_OK) {
+		didx_drop(fs, dp->obj.sclust);
+		return 0;
+	}
+	if (c == 0) ix->end = dp->dptr / SZDIRE;
+
+	return ix;
+}
+
+
+#if !_FS_READONLY
+static
+DWORD didx_hint (	/* Offset to start searching for a free entry */
+	DIR* dp			/* Directory object */
+)
+{
+	DIDX *ix = didx_find(dp->obj.fs, dp->obj.sclust);
+
+
+	if (!ix || ix->over) return 0;
+	if (ix->nfree) return (DWORD)ix->fslot[ix->nfree - 1] * SZDIRE;	/* A known hole */
+	if (ix->lost || !ix->end) return 0;
+	return (ix->end - 1) * SZDIRE;	/* The last entry in use, the search goes on to the end of table */
+}
+
+
+static
+void didx_register (	/* An entry has been created at dp->dptr */
+	DIR* dp			/* Directory object */
+)
+{
+	DIDX *ix = didx_find(dp->obj.fs, dp->obj.sclust);
+	DWORD slot = dp->dptr / SZDIRE;
+	UINT i;
+
+
+	if (!ix) return;
+	for (i = ix->nfree; i; i--) {	/* It is no longer free */
+		if (ix->fslot[i - 1] == slot) {
+			ix->fslot[i - 1] = ix->fslot[--ix->nfree];
+			break;
+		}
+	}
+	if (slot >= ix->end) ix->end = slot + 1;
+	didx_insert(ix, dp->fn, slot);
+}
+#endif
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Directory handling - Reserve a block of directory entries             */
 /*-----------------------------------------------------------------------*/
@@ -1533,7 +2070,11 @@ FRESULT dir_alloc (	/* FR_OK(0):succeeded, !=0:error */
 	FATFS *fs = dp->obj.fs;
 
 
+#if _DIR_INDEX
+	res = dir_sdi(dp, didx_hint(dp));	/* Start at a known free entry (nent is always 1) */
+#else
 	res = dir_sdi(dp, 0);
+#endif
 	if (res == FR_OK) {
 		n = 0;
 		do {
@@ -2125,6 +2666,10 @@ FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 #if _USE_LFN != 0
 	BYTE a, ord, sum;
 #endif
+#if _DIR_INDEX
+	DIDX *ix;
+	WORD e;
+#endif
 
 	res = dir_sdi(dp, 0);			/* Rewind directory object */
 	if (res != FR_OK) return res;
@@ -2146,6 +2691,24 @@ FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 	}
 #endif
 	/* At the FAT12/16/32 */
+#if _DIR_INDEX
+	ix = didx_find(fs, dp->obj.sclust);
+	if (!ix) ix = didx_build(dp);	/* The first search in the directory */
+	if (ix && !ix->over) {
+		e = didx_lookup(ix, dp->fn);
+		if (e == DIDX_NIL) return FR_NO_FILE;
+		res = dir_sdi(dp, (DWORD)DIDX_ENT(ix, e)->slot * SZDIRE);	/* Load the entry */
+		if (res == FR_OK) res = move_window(fs, dp->sect);
+		if (res != FR_OK) return res;
+		if (!(dp->dir[DIR_Attr] & AM_VOL) && !mem_cmp(dp->dir, dp->fn, 11)) {
+			dp->obj.attr = dp->dir[DIR_Attr] & AM_MASK;
+			return FR_OK;
+		}
+		didx_drop(fs, dp->obj.sclust);	/* Stale index, search linearly */
+		res = dir_sdi(dp, 0);
+		if (res != FR_OK) return res;
+	}
+#endif
 #if _USE_LFN != 0
 	ord = sum = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
 #endif
@@ -2188,6 +2751,61 @@ FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Find an object through the entry cache           */
+/*-----------------------------------------------------------------------*/
+/* The cache remembers where a name sits in a directory with the object's
+/  start cluster and attribute, or that the name is missing. Directories on
+/  the way are entered from the cache alone, only the last segment of a path
+/  loads its entry into the window, where the callers expect it. */
+#if _USE_DCACHE
+static
+FRESULT dir_find_cached (	/* FR_OK(0):succeeded, !=0:error */
+	DIR* dp,			/* Pointer to the directory object with the file name */
+	DWORD* sclust		/* Returns the start cluster of the object found */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	FFDENT de;
+	int hit;
+
+
+	hit = ff_dcache_find(fs, dp->obj.sclust, dp->fn, &de);
+	if (hit < 0) return FR_NO_FILE;			/* Known to be missing */
+	if (hit > 0) {
+		dp->obj.attr = de.attr;
+		*sclust = de.sclust;
+		if (!(dp->fn[NSFLAG] & NS_LAST)) {	/* Passing through a sub-directory */
+			dp->dptr = de.ofs;
+			return FR_OK;
+		}
+		res = dir_sdi(dp, de.ofs);			/* Load the entry */
+		if (res == FR_OK) res = move_window(fs, dp->sect);
+		if (res == FR_OK && !(dp->dir[DIR_Attr] & AM_VOL) && !mem_cmp(dp->dir, dp->fn, 11)) {
+			dp->obj.attr = dp->dir[DIR_Attr] & AM_MASK;
+			*sclust = ld_clust(fs, dp->dir);
+			return FR_OK;
+		}
+		ff_dcache_forget(fs, dp->obj.sclust, dp->fn);	/* Stale record */
+	}
+
+	res = dir_find(dp);
+	if (res == FR_OK) {
+		de.ofs = dp->dptr;
+		de.sclust = *sclust = ld_clust(fs, dp->dir);
+		de.attr = dp->obj.attr;
+		ff_dcache_enter(fs, dp->obj.sclust, dp->fn, &de);
+	}
+	if (res == FR_NO_FILE) ff_dcache_enter(fs, dp->obj.sclust, dp->fn, 0);
+
+	return res;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Register an object to the directory                                   */
 /*-----------------------------------------------------------------------*/
@@ -2282,6 +2900,12 @@ FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too many S
 			dp->dir[DIR_NTres] = dp->fn[NSFLAG] & (NS_BODY | NS_EXT);	/* Put NT flag */
 #endif
 			fs->wflag = 1;
+#if _USE_DCACHE
+			ff_dcache_forget(fs, dp->obj.sclust, dp->fn);	/* It is no longer missing */
+#endif
+#if _DIR_INDEX
+			didx_register(dp);
+#endif
 		}
 	}
 
@@ -2324,9 +2948,26 @@ FRESULT dir_remove (	/* FR_OK:Succeeded, FR_DISK_ERR:A disk error */
 		if (res == FR_NO_FILE) res = FR_INT_ERR;
 	}
 #else			/* Non LFN configuration */
+#if _DIR_INDEX
+	DIDX *ix;
+#endif
 
 	res = move_window(fs, dp->sect);
 	if (res == FR_OK) {
+#if _USE_DCACHE
+		ff_dcache_forget(fs, dp->obj.sclust, dp->dir);
+		if (dp->dir[DIR_Attr] & AM_DIR) {	/* Its clusters may hold another directory later */
+			ff_dcache_forget(fs, ld_clust(fs, dp->dir), 0);
+		}
+#endif
+#if _DIR_INDEX
+		ix = didx_find(fs, dp->obj.sclust);
+		if (ix) {
+			didx_remove(ix, dp->dir);
+			didx_put_slot(ix, dp->dptr / SZDIRE);
+		}
+		if (dp->dir[DIR_Attr] & AM_DIR) didx_drop(fs, ld_clust(fs, dp->dir));
+#endif
 		dp->dir[DIR_Name] = DDEM;
 		fs->wflag = 1;
 	}
@@ -2730,7 +3371,12 @@ FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 	FRESULT res;
 	BYTE ns;
 	_FDID *obj = &dp->obj;
+#if _USE_DCACHE
+	DWORD dclst;
+#endif
+#if !_USE_DCACHE || _FS_RPATH != 0
 	FATFS *fs = obj->fs;
+#endif
 
 
 #if _FS_RPATH != 0
@@ -2764,7 +3410,11 @@ FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 		for (;;) {
 			res = create_name(dp, &path);	/* Get a segment name of the path */
 			if (res != FR_OK) break;
+#if _USE_DCACHE
+			res = dir_find_cached(dp, &dclst);	/* Find it, in the cache first */
+#else
 			res = dir_find(dp);				/* Find an object with the segment name */
+#endif
 			ns = dp->fn[NSFLAG];
 			if (res != FR_OK) {				/* Failed to find the object */
 				if (res == FR_NO_FILE) {	/* Object is not found */
@@ -2794,7 +3444,11 @@ FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 			} else
 #endif
 			{
+#if _USE_DCACHE
+				obj->sclust = dclst;			/* Open next directory */
+#else
 				obj->sclust = ld_clust(fs, &fs->win[dp->dptr % SS(fs)]);	/* Open next directory */
+#endif
 			}
 		}
 	}
@@ -2938,6 +3592,12 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 	/* The file system object is not valid. */
 	/* Following code attempts to mount the volume. (analyze BPB and initialize the fs object) */
 
+#if _USE_FREEMAP
+	fmap_free(fs);						/* Discard the bitmap of the old volume */
+#endif
+#if _DIR_INDEX
+	didx_purge(fs);						/* Discard the directory indexes */
+#endif
 	fs->fs_type = 0;					/* Clear the file system object */
 	fs->drv = LD2PD(vol);				/* Bind the logical drive and a physical drive */
 	stat = disk_initialize(fs->drv);	/* Initialize the physical drive */
@@ -3105,6 +3765,9 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 #endif
 #if _FS_LOCK != 0		/* Clear file lock semaphores */
 	clear_lock(fs);
+#endif
+#if _USE_FREEMAP
+	fmap_build(fs);		/* Build the free cluster bitmap */
 #endif
 	return FR_OK;
 }
@@ -3174,12 +3837,28 @@ FRESULT f_mount (
 #endif
 #if _FS_REENTRANT						/* Discard sync object of the current volume */
 		if (!ff_del_syncobj(cfs->sobj)) return FR_INT_ERR;
+#endif
+#if _USE_FREEMAP
+		fmap_free(cfs);					/* Discard the free cluster bitmap */
+#endif
+#if _DIR_INDEX
+		didx_purge(cfs);				/* Discard the directory indexes */
 #endif
 		cfs->fs_type = 0;				/* Clear old fs object */
 	}
 
 	if (fs) {
 		fs->fs_type = 0;				/* Clear new fs object */
+#if _FS_LOCK != 0
+		mem_set(fs->lock, 0, sizeof fs->lock);
+		fs->lock_free = 0; fs->lock_blk = 0;
+#endif
+#if _USE_FREEMAP
+		fs->fmap = 0;
+#endif
+#if _DIR_INDEX
+		mem_set(fs->didx, 0, sizeof fs->didx);
+#endif
 #if _FS_REENTRANT						/* Create sync object for the new volume */
 		if (!ff_cre_syncobj((BYTE)vol, &fs->sobj)) return FR_INT_ERR;
 #endif
@@ -3240,7 +3919,7 @@ FRESULT f_open (
 			if (res != FR_OK) {					/* No file, create new */
 				if (res == FR_NO_FILE)			/* There is no file to open, create a new entry */
 #if _FS_LOCK != 0
-					res = enq_lock() ? dir_register(&dj) : FR_TOO_MANY_OPEN_FILES;
+					res = enq_lock(dj.obj.fs) ? dir_register(&dj) : FR_TOO_MANY_OPEN_FILES;
 #else
 					res = dir_register(&dj);
 #endif
@@ -3384,6 +4063,9 @@ FRESULT f_read (
 	DWORD clst, sect;
 	FSIZE_t remain;
 	UINT rcnt, cc, csect;
+#if _USE_FASTSEEK
+	UINT rem;
+#endif
 	BYTE *rbuff = (BYTE*)buff;
 
 
@@ -3422,6 +4104,16 @@ FRESULT f_read (
 			if (cc) {							/* Read maximum contiguous sectors directly */
 				if (csect + cc > fs->csize) {	/* Clip at cluster boundary */
 					cc = fs->csize - csect;
+#if _USE_FASTSEEK
+					if (fp->cltbl) {	/* Go on over the clusters that follow on the disk (found on the CLMT) */
+						while ((rem = btr / SS(fs) - cc) != 0) {
+							clst = clmt_clust(fp, fp->fptr + (FSIZE_t)cc * SS(fs));
+							if (clst != fp->clust + 1) break;
+							fp->clust = clst;
+							cc += (rem < fs->csize) ? rem : fs->csize;
+						}
+					}
+#endif
 				}
 				if (disk_read(fs->drv, rbuff, sect, cc) != RES_OK) {
 					ABORT(fs, FR_DISK_ERR);
@@ -3897,14 +4589,14 @@ FRESULT f_lseek (
 		if (ofs == CREATE_LINKMAP) {	/* Create CLMT */
 			tbl = fp->cltbl;
 			tlen = *tbl++; ulen = 2;	/* Given table size and required table size */
-			cl = fp->sclust;			/* Top of the chain */
+			cl = fp->obj.sclust;			/* Top of the chain */
 			if (cl) {
 				do {
 					/* Get a fragment */
 					tcl = cl; ncl = 0; ulen += 2;	/* Top, length and used items */
 					do {
 						pcl = cl; ncl++;
-						cl = get_fat(fs, cl);
+						cl = get_fat(&fp->obj, cl);
 						if (cl <= 1) ABORT(fs, FR_INT_ERR);
 						if (cl == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
 					} while (cl == pcl + 1);
@@ -3920,8 +4612,8 @@ FRESULT f_lseek (
 				res = FR_NOT_ENOUGH_CORE;	/* Given table size is smaller than required */
 			}
 		} else {						/* Fast seek */
-			if (ofs > fp->fsize) {		/* Clip offset at the file size */
-				ofs = fp->fsize;
+			if (ofs > fp->obj.objsize) {		/* Clip offset at the file size */
+				ofs = fp->obj.objsize;
 			}
 			fp->fptr = ofs;				/* Set file pointer */
 			if (ofs) {
@@ -3934,7 +4626,7 @@ FRESULT f_lseek (
 #if !_FS_READONLY
 					if (fp->flag & _FA_DIRTY) {		/* Write-back dirty sector cache */
 						if (disk_write(fs->drv, fp->buf, fp->sect, 1) != RES_OK) {
-							ABORT(fp, FR_DISK_ERR);
+							ABORT(fs, FR_DISK_ERR);
 						}
 						fp->flag &= ~_FA_DIRTY;
 					}
@@ -5041,27 +5733,39 @@ FRESULT f_expand (
 	} else
 #endif
 	{
-		scl = clst = stcl; ncl = 0;
-		for (;;) {	/* Find a contiguous cluster block */
-			val = get_fat(&fp->obj, clst);
-			if (++clst >= fs->n_fatent) clst = 2;
-			if (val == 1) { res = FR_INT_ERR; break; }
-			if (val == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
-			if (val == 0) {	/* Is it a free cluster? */
-				if (++ncl == tcl) break;	/* Break if a contiguous cluster block was found */
-			} else {
-				scl = clst; ncl = 0;		/* Not a free cluster */
+#if _USE_FREEMAP
+		if (fs->fmap) {
+			scl = fmap_find_run(fs, stcl, tcl);	/* Find a contiguous cluster block on the bitmap */
+			if (scl == 0) res = FR_DENIED;
+		} else
+#endif
+		{
+			scl = clst = stcl; ncl = 0;
+			for (;;) {	/* Find a contiguous cluster block */
+				val = get_fat(&fp->obj, clst);
+				if (++clst >= fs->n_fatent) clst = 2;
+				if (val == 1) { res = FR_INT_ERR; break; }
+				if (val == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+				if (val == 0) {	/* Is it a free cluster? */
+					if (++ncl == tcl) break;	/* Break if a contiguous cluster block was found */
+				} else {
+					scl = clst; ncl = 0;		/* Not a free cluster */
+				}
+				if (clst == stcl) { res = FR_DENIED; break; }	/* All cluster scanned? */
 			}
-			if (clst == stcl) { res = FR_DENIED; break; }	/* All cluster scanned? */
 		}
 		if (res == FR_OK) {
 			if (opt) {
-				for (clst = scl; tcl; clst++, tcl--) {	/* Create a cluster chain on the FAT */
-					val = (tcl == 1) ? 0xFFFFFFFF : clst + 1;
+				for (clst = scl, ncl = tcl; ncl; clst++, ncl--) {	/* Create a cluster chain on the FAT */
+					val = (ncl == 1) ? 0xFFFFFFFF : clst + 1;
 					res = put_fat(fs, clst, val);
 					if (res != FR_OK) break;
 					fs->last_clst = clst;
 				}
+				if (res == FR_OK && fs->free_clst <= fs->n_fatent - 2) {	/* Update FSINFO */
+					fs->free_clst -= tcl;
+					fs->fsi_flag |= 1;
+				}
 			} else {
 				fs->last_clst = scl - 1;				/* Set suggested cluster to start next */
 			}
@@ -5175,6 +5879,12 @@ FRESULT f_mkfs (
 	if (vol < 0) return FR_INVALID_DRIVE;
 	fs = FatFs[vol];						/* Check if the volume has work area */
 	if (!fs) return FR_NOT_ENABLED;
+#if _USE_FREEMAP
+	fmap_free(fs);
+#endif
+#if _DIR_INDEX
+	didx_purge(fs);
+#endif
 	fs->fs_type = 0;
 	pdrv = LD2PD(vol);	/* Physical drive */
 	part = LD2PT(vol);	/* Partition (0:auto detect, 1-4:get from partition table)*/
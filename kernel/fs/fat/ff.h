@@ -96,6 +96,17 @@ typedef struct {
 #if !_FS_READONLY
 	DWORD	last_clst;		/* Last allocated cluster */
 	DWORD	free_clst;		/* Number of free clusters */
+#if _USE_FREEMAP
+	DWORD**	fmap;			/* Free cluster bitmap blocks (bit 1:in use, 0:free) */
+#endif
+#endif
+#if _FS_LOCK != 0
+	struct _filesem*	lock[_FS_LOCK];	/* Open object lock semaphores, hashed by directory entry */
+	struct _filesem*	lock_free;	/* Blank lock semaphores */
+	void*	lock_blk;		/* Semaphore blocks from ff_memalloc(), chained by their first word */
+#endif
+#if _DIR_INDEX
+	struct _didx*	didx[_DIR_INDEX];	/* Directory hash indexes, most recently used first */
 #endif
 #if _FS_RPATH != 0
 	DWORD	cdir;			/* Current directory start cluster (0:root) */
@@ -146,7 +157,7 @@ typedef struct {
 	DWORD	c_ofs;		/* Offset in the containing directory (valid when sclust != 0) */
 #endif
 #if _FS_LOCK != 0
-	UINT	lockid;		/* File lock ID origin from 1 (index of file semaphore table Files[]) */
+	struct _filesem*	lockid;	/* File lock semaphore (NULL:not locked) */
 #endif
 } _FDID;
 
@@ -212,6 +223,16 @@ typedef struct {
 
 
 
+/* Directory entry cache record (_USE_DCACHE) */
+
+typedef struct {
+	DWORD	ofs;			/* Offset of the entry in its directory */
+	DWORD	sclust;			/* Object start cluster */
+	BYTE	attr;			/* Object attribute */
+} FFDENT;
+
+
+
 /* File function return code (FRESULT) */
 
 typedef enum {
@@ -308,6 +329,11 @@ void ff_memfree (void* mblock);			/* Free memory block */
 #endif
 #endif
 
+#if (_USE_FREEMAP || _DIR_INDEX || _FS_LOCK) && _USE_LFN != 3	/* Memory functions for the bitmap, indexes and locks */
+void* ff_memalloc (UINT msize);			/* Allocate memory block */
+void ff_memfree (void* mblock);			/* Free memory block */
+#endif
+
 /* Sync functions */
 #if _FS_REENTRANT
 int ff_cre_syncobj (BYTE vol, _SYNC_t* sobj);	/* Create a sync object */
@@ -316,6 +342,13 @@ void ff_rel_grant (_SYNC_t sobj);				/* Unlock sync object */
 int ff_del_syncobj (_SYNC_t sobj);				/* Delete a sync object */
 #endif
 
+/* Directory entry cache functions, name is an SFN (11 bytes) */
+#if _USE_DCACHE
+int ff_dcache_find (FATFS* fs, DWORD dir, const BYTE* name, FFDENT* de);		/* 1:Found, -1:Known to be missing, 0:Not cached */
+void ff_dcache_enter (FATFS* fs, DWORD dir, const BYTE* name, const FFDENT* de);	/* Cache a lookup, de 0:Missing */
+void ff_dcache_forget (FATFS* fs, DWORD dir, const BYTE* name);				/* Drop a name, name 0:The whole directory */
+#endif
+
 
 
 
@@ -43,14 +43,42 @@
 /* This option switches f_mkfs() function. (0:Disable or 1:Enable) */
 
 
-#define	_USE_FASTSEEK	0
+#define	_USE_FASTSEEK	1
 /* This option switches fast seek function. (0:Disable or 1:Enable) */
 
 
-#define	_USE_EXPAND		0
+#define	_USE_EXPAND		1
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
 
+#define	_USE_DCACHE		1
+/* This option switches the directory entry cache. (0:Disable or 1:Enable)
+/  To enable it, user provided functions ff_dcache_find(), ff_dcache_enter()
+/  and ff_dcache_forget() must be added to the project. _USE_LFN and _FS_EXFAT
+/  need to be 0. */
+
+
+#define	_USE_FREEMAP	1
+/* This option switches the in-memory free cluster bitmap. (0:Disable or 1:Enable)
+/  The bitmap is built from the FAT at mount time and kept up to date on every FAT
+/  write, so that a new cluster is found by a bitmap scan instead of reading FAT
+/  sectors. It takes one bit per cluster in 4 KiB blocks, user provided memory
+/  functions, ff_memalloc() and ff_memfree(), must be added to the project.
+/  _FS_READONLY and _FS_EXFAT need to be 0. */
+
+
+#define	_DIR_INDEX		8
+#define	_DIR_INDEX_ENT	4096
+/* The _DIR_INDEX defines how many directories per volume keep an in-memory hash
+/  index of their entries, the most recently used ones are kept. (0:Disable)
+/  A directory is indexed the first time it is searched. After that a lookup costs
+/  a single sector read and a new entry goes straight to a known free slot, the
+/  index follows creation and removal of entries. The _DIR_INDEX_ENT defines how
+/  many names an index can hold (16 bytes each), a larger directory is searched
+/  linearly. Memory functions, ff_memalloc() and ff_memfree(), must be added to
+/  the project. _USE_LFN and _FS_EXFAT need to be 0. */
+
+
 #define _USE_CHMOD		0
 /* This option switches attribute manipulation functions, f_chmod() and f_utime().
 /  (0:Disable or 1:Enable) Also _FS_READONLY needs to be 0 to enable this option. */
@@ -148,7 +176,7 @@
 / Drive/Volume Configurations
 /---------------------------------------------------------------------------*/
 
-#define _VOLUMES	1
+#define _VOLUMES	6
 /* Number of volumes (logical drives) to be used. */
 
 
@@ -180,7 +208,7 @@
 /  disk_ioctl() function. */
 
 
-#define	_USE_TRIM	0
+#define	_USE_TRIM	1
 /* This option switches support of ATA-TRIM. (0:Disable or 1:Enable)
 /  To enable Trim function, also CTRL_TRIM command should be implemented to the
 /  disk_ioctl() function. */
@@ -230,21 +258,23 @@
 /  These options have no effect at read-only configuration (_FS_READONLY = 1). */
 
 
-#define	_FS_LOCK	0
+#define	_FS_LOCK	64
 /* The option _FS_LOCK switches file lock function to control duplicated file open
 /  and illegal operation to open objects. This option must be 0 when _FS_READONLY
 /  is 1.
 /
 /  0:  Disable file lock function. To avoid volume corruption, application program
 /      should avoid illegal open, remove and rename to the open objects.
-/  >0: Enable file lock function. The value defines how many files/sub-directories
-/      can be opened simultaneously under file lock control. Note that the file
-/      lock control is independent of re-entrancy. */
+/  >0: Enable file lock function. The value defines how many hash chains each
+/      volume keeps for its open files/sub-directories. Lock entries are taken
+/      from ff_memalloc() blocks as needed, so it does not limit how many objects
+/      can be opened simultaneously. Note that the file lock control is
+/      independent of re-entrancy. */
 
 
-#define _FS_REENTRANT	0
+#define _FS_REENTRANT	1
 #define _FS_TIMEOUT		1000
-#define	_SYNC_t			HANDLE
+#define	_SYNC_t			struct spinlock *
 /* The option _FS_REENTRANT switches the re-entrancy (thread safe) of the FatFs
 /  module itself. Note that regardless of this option, file access to different
 /  volume is always re-entrant and volume control functions, f_mount(), f_mkfs()
@@ -4,26 +4,89 @@
 #include <fat/ff.h>
 #include <inc/string.h>
 #include <inc/stdio.h>
+#include <inc/x86.h>
+#include <kernel/drv/blk.h>
+#include <kernel/mem.h>
+#include <kernel/cpu.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
 
-/* Static file objects */
-FIL file_objs[FS_FD_MAX];
+/* Open file objects.  One struct fs_fd is shared by every descriptor that
+ * refers to it (fork), ref_count counts those plus callers between fd_get()
+ * and fd_put().  Objects are carved out of pages on demand and never given
+ * back.  The driver keeps its own state of the file in fs_fd.data, from its
+ * open to its close.
+ */
+struct fd_obj
+{
+    struct fs_fd fd;
+    struct fd_obj *next;            /* Free list */
+};
+
+#define FD_OBJS_PER_PAGE    ((PGSIZE - sizeof(void *)) / sizeof(struct fd_obj))
+#define FD_TABLE_PAGES      (FS_FD_MAX / FS_FD_PER_PAGE)
+
+struct fd_page
+{
+    struct fd_page *next;
+    struct fd_obj objs[FD_OBJS_PER_PAGE];
+};
+
+static struct fd_page *fd_pages;        /* Every object page, for fs_sync() */
+static struct fd_obj *fd_free_list;
+static struct spinlock fd_lock;         /* Free list and reference counts */
+
+/* Locking: mnt_lock guards the mount table, fs_fd.lock the state of one
+ * open file (FIL, position, fast seek map) and FatFs holds a lock per
+ * volume for each call (ff_req_grant() in diskio.c).  They nest in that
+ * order, file before volume, so I/O on different files only meets in FatFs.
+ * mnt_lock is never held across a driver call: mount, unmount and sync
+ * mark or pin the slot under it, then call the driver without it.
+ * mnt_op_lock serializes mount, unmount and mkfs, path lookups don't take it.
+ */
+static struct spinlock mnt_lock;
+static struct spinlock mnt_op_lock;
+
+/* Writeback accounting, see fs_writeback() */
+static struct spinlock wb_lock;
+static int fs_dirty;                    /* Bytes in the drivers' buffers */
+static volatile uint32_t wb_due;        /* A pass is due, set by the timer */
 
-/* Static file system object */
-FATFS fat;
+/* Directory entry cache.  Entries in use are hashed on their key, every
+ * entry is on the LRU list with the free ones (sb == NULL) at the tail,
+ * where new names are taken from.
+ */
+struct dentry
+{
+    struct dentry *hnext;           /* Hash chain */
+    struct dentry *prev, *next;     /* LRU list, most recently used first */
+
+    void *sb;                       /* File system object, NULL if free */
+    uint32_t dir;
+    char name[DCACHE_NAME_MAX];
+    int len;
+    int negative;
+    struct dentry_info info;
+};
 
-/* It file object table */
-struct fs_fd fd_table[FS_FD_MAX];
+static struct dentry dcache[DCACHE_SIZE];
+static struct dentry *dcache_hash[DCACHE_HASH];
+static struct dentry dcache_lru;
+static struct spinlock dcache_lock;
 
-/* File system operator, define in fs_ops.c */
-extern struct fs_ops elmfat_ops; //We use only one file system...
+/* File system operator, define in fs_ops.c and tmpfs.c */
+extern struct fs_ops elmfat_ops;
+extern struct fs_ops tmpfs_ops;
 
-/* File system object, it record the operator and file system object(FATFS) */
-struct fs_dev fat_fs = {
-    .dev_id = 1, //In this lab we only use second IDE disk
-    .path = {0}, // Not yet mount to any path
-    .ops = &elmfat_ops,
-    .data = &fat
+/* File system types fs_mount() knows about */
+static struct fs_ops *fs_types[] = {
+    &elmfat_ops,
+    &tmpfs_ops,
+    NULL
 };
+
+/* Mount table, each entry records the mount point, operator and file system object */
+struct fs_dev fs_mounts[FS_MNT_MAX];
     
 /*TODO: Lab7, VFS level file API.
  *  This is a virtualize layer. Please use the function pointer
@@ -99,193 +162,1324 @@ int convert_retval(int r)
         case FR_INVALID_PARAMETER:
             retval = STATUS_EINVAL;
             break;
-        case FR_TIMEOUT:
-        case FR_LOCKED:
         case FR_NOT_ENOUGH_CORE:
         case FR_TOO_MANY_OPEN_FILES:
+            retval = STATUS_ENOMEM;
+            break;
+        case FR_TIMEOUT:
+        case FR_LOCKED:
             retval = STATUS_EBUSY;
             break;
     }
     return -retval;
 }
 
+/* Under mnt_lock: the slot holds a file system lookups may use */
+static int fs_live(struct fs_dev* fs)
+{
+    return fs->path[0] && !fs->busy;
+}
+
+static struct fs_ops *fs_find_type(const char* device_name)
+{
+    int i;
+    for (i = 0; fs_types[i]; i++)
+        if (!strcmp(device_name, fs_types[i]->dev_name))
+            return fs_types[i];
+    return NULL;
+}
+
+/* A disk is blank when its first sector reads back as zeros: no partition
+ * table, no boot sector, nothing to lose by formatting it.
+ */
+static int fs_disk_blank(struct blkdev *bd)
+{
+    static uint32_t sect[BLK_SECTOR_SIZE / sizeof(uint32_t)];
+    int i;
+
+    if (bd->read(bd, 0, 1, sect))
+        return 0;
+    for (i = 0; i < BLK_SECTOR_SIZE / sizeof(uint32_t); i++)
+        if (sect[i])
+            return 0;
+    return 1;
+}
+
 int fs_init()
 {
-    int res, i;
-    
-    /* Initial fd_tables */
-    for (i = 0; i < FS_FD_MAX; i++)
+    struct fs_mount_args args = { 0, FS_ROOT_MNT_FLAGS };
+    struct blkdev *bd;
+    char path[32];
+    int res, i, root = 0, retval = 0;
+
+    /* Descriptor tables are per task and built on demand */
+    spin_initlock(&fd_lock);
+    spin_initlock(&mnt_lock);
+    spin_initlock(&mnt_op_lock);
+    spin_initlock(&dcache_lock);
+    spin_initlock(&wb_lock);
+    dcache_lru.prev = dcache_lru.next = &dcache_lru;
+    for (i = 0; i < DCACHE_SIZE; i++) {
+        dcache[i].prev = dcache_lru.prev;
+        dcache[i].next = &dcache_lru;
+        dcache_lru.prev->next = &dcache[i];
+        dcache_lru.prev = &dcache[i];
+    }
+
+    /* Mount the first data disk at "/" and every other one at
+     * "/<device name>".  Only a blank disk is formatted: one that fails to
+     * mount for any other reason (I/O error, not ready, a file system
+     * FatFs doesn't know) is left as it is, and so is the boot disk.
+     */
+    for (i = 0; i < blk_count(); i++)
     {
-        fd_table[i].flags = 0;
-        fd_table[i].size = 0;
-        fd_table[i].pos = 0;
-        fd_table[i].type = 0;
-        fd_table[i].ref_count = 0;
-        fd_table[i].data = &file_objs[i];
-        fd_table[i].fs = &fat_fs;
+        bd = blk_get(i);
+        if (bd->boot)
+            continue;
+        if (!root++)
+            strcpy(path, "/");
+        else
+            snprintf(path, sizeof(path), "/%s", bd->name);
+
+        args.dev_id = i;
+        if ((res = fs_mount("elmfat", path, &args)) == -STATUS_ENODEV && fs_disk_blank(bd))
+        {
+            fs_mkfs("elmfat", i);
+            res = fs_mount("elmfat", path, &args);
+        }
+        if (res)
+        {
+            printk("fs: cannot mount %s at %s (%d)\n", bd->name, path, res);
+            retval = res;
+        }
     }
-    
-    /* Mount fat file system at "/" */
-    /* Check need mkfs or not */
-    if ((res = fs_mount("elmfat", "/", NULL)) != 0)
+
+    if (!root)
     {
-        fat_fs.ops->mkfs("elmfat");
-        res = fs_mount("elmfat", "/", NULL);
-        return res;
+        printk("fs: no data disk, no root file system\n");
+        retval = -STATUS_ENODEV;
     }
-    return -STATUS_EIO;
-       
+
+    /* Scratch files live in memory */
+    if ((res = fs_mount("tmpfs", "/tmp", NULL)) != 0)
+        printk("fs: cannot mount tmpfs at /tmp (%d)\n", res);
+    return retval;
 }
 
 /** Mount a file system by path 
-*  Note: You need compare the device_name with fat_fs.ops->dev_name and find the file system operator
-*        then call ops->mount().
+*  Note: Find the file system operator by device_name, reserve a free slot
+*        of the mount table (busy, so lookups don't see it yet), then call
+*        ops->mount() without the table lock and publish or free the slot.
 *
-*  @param data: If you have mutilple file system it can be use for pass the file system object pointer save in fat_fs->data. 
+*  @param data: File system specific, elmfat takes a struct fs_mount_args.
 */
 int fs_mount(const char* device_name, const char* path, const void* data)
 {
-    if (!strcmp(device_name, fat_fs.ops->dev_name)) {
-        strcpy(fat_fs.path, path);
-        return convert_retval(fat_fs.ops->mount(&fat_fs, data));
+    const struct fs_mount_args *args = data;
+    struct fs_ops *ops = fs_find_type(device_name);
+    struct fs_dev *fs = NULL;
+    int i, retval = 0;
+
+    if (!ops || !path || strlen(path) >= sizeof(fs->path))
+        return -STATUS_EINVAL;
+
+    /* f_mount() is not re-entrant, one mount, unmount or mkfs at a time */
+    spin_lock(&mnt_op_lock);
+    spin_lock(&mnt_lock);
+    for (i = 0; i < FS_MNT_MAX; i++) {
+        if (!fs_mounts[i].path[0]) {
+            if (!fs)
+                fs = &fs_mounts[i];
+        } else if (!strcmp(fs_mounts[i].path, path))
+            retval = -STATUS_EBUSY;
+    }
+    if (!retval && !fs)
+        retval = -STATUS_ENOSPC;
+    if (!retval) {
+        memset(fs, 0, sizeof(*fs));
+        fs->dev_id = args ? args->dev_id : 0;
+        fs->ops = ops;
+        strcpy(fs->path, path);
+        fs->busy = 1;
+    }
+    spin_unlock(&mnt_lock);
+    if (retval) {
+        spin_unlock(&mnt_op_lock);
+        return retval;
     }
-    return -STATUS_EIO;
+
+    retval = convert_retval(ops->mount(fs, data));
+    spin_lock(&mnt_lock);
+    if (retval)
+        memset(fs, 0, sizeof(*fs));
+    else
+        fs->busy = 0;
+    spin_unlock(&mnt_lock);
+    spin_unlock(&mnt_op_lock);
+    return retval;
 } 
 
-/* Note: Before call ops->open() you may copy the path and flags parameters into fd object structure */
+/** Unmount the file system mounted at path
+*  Note: A file system is busy while files are open on it, a call is in
+*        progress or another file system is mounted below it.  The slot is
+*        hidden from lookups while ops->unmount() runs, and comes back if
+*        that fails.
+*/
+int fs_umount(const char* path)
+{
+    struct fs_dev *fs = NULL;
+    int i, len = strlen(path), retval = 0;
+
+    spin_lock(&mnt_op_lock);
+    spin_lock(&mnt_lock);
+    for (i = 0; i < FS_MNT_MAX; i++) {
+        const char *mp = fs_mounts[i].path;
+        if (!mp[0])
+            continue;
+        if (!strcmp(mp, path))
+            fs = &fs_mounts[i];
+        else if (!strcmp(path, "/") || (!strncmp(mp, path, len) && mp[len] == '/'))
+            retval = -STATUS_EBUSY;
+    }
+    if (!fs)
+        retval = -STATUS_EINVAL;
+    else if (fs->ref_count)
+        retval = -STATUS_EBUSY;
+    if (!retval)
+        fs->busy = 1;
+    spin_unlock(&mnt_lock);
+
+    if (!retval && fs->ops->unmount)
+        retval = convert_retval(fs->ops->unmount(fs));
+    if (fs && fs->busy) {
+        spin_lock(&mnt_lock);
+        if (retval)
+            fs->busy = 0;
+        else
+            memset(fs, 0, sizeof(*fs));
+        spin_unlock(&mnt_lock);
+    }
+    spin_unlock(&mnt_op_lock);
+    return retval;
+}
+
+/* Drop the reference fs_lookup() took */
+void fs_put(struct fs_dev* fs)
+{
+    spin_lock(&mnt_lock);
+    fs->ref_count--;
+    spin_unlock(&mnt_lock);
+}
+
+/* Create a file system of type device_name on block device dev_id */
+int fs_mkfs(const char* device_name, int dev_id)
+{
+    struct fs_ops *ops = fs_find_type(device_name);
+    struct fs_dev fs;
+    int retval;
+
+    if (!ops || !ops->mkfs)
+        return -STATUS_EINVAL;
+    memset(&fs, 0, sizeof(fs));
+    fs.dev_id = dev_id;
+    fs.ops = ops;
+    spin_lock(&mnt_op_lock);
+    retval = convert_retval(ops->mkfs(&fs));
+    spin_unlock(&mnt_op_lock);
+    return retval;
+}
+
+/* Find the file system holding path (longest matching mount point), and
+ * the path below its mount point.  The mount can't go away until the
+ * caller drops it with fs_put().
+ */
+struct fs_dev* fs_lookup(const char* path, const char** rel)
+{
+    struct fs_dev *best = NULL;
+    int i, len, best_len = -1;
+
+    spin_lock(&mnt_lock);
+    for (i = 0; i < FS_MNT_MAX; i++) {
+        const char *mp = fs_mounts[i].path;
+        if (!fs_live(&fs_mounts[i]))
+            continue;
+        len = strlen(mp);
+        if (!strcmp(mp, "/"))
+            len = 0;
+        else if (strncmp(path, mp, len) || (path[len] != '/' && path[len] != '\0'))
+            continue;
+        if (len > best_len) {
+            best = &fs_mounts[i];
+            best_len = len;
+        }
+    }
+    if (best) {
+        best->ref_count++;
+        if (rel)
+            *rel = path[best_len] ? path + best_len : "/";
+    }
+    spin_unlock(&mnt_lock);
+    return best;
+}
+
+/* Space of a mount the caller holds a reference on */
+static int fs_statfs(struct fs_dev* fs, struct statfs *buf)
+{
+    memset(buf, 0, sizeof(*buf));
+    strlcpy(buf->f_fstypename, fs->ops->dev_name, sizeof(buf->f_fstypename));
+    strlcpy(buf->f_mntonname, fs->path, sizeof(buf->f_mntonname));
+    if (!fs->ops->statfs)
+        return 0;
+    return convert_retval(fs->ops->statfs(fs, buf));
+}
+
+/* Fill buf with up to count mounts, returns how many */
+int fs_getfsstat(struct statfs *buf, int count)
+{
+    struct fs_dev *fs;
+    int i, n = 0, retval;
+
+    for (i = 0; i < FS_MNT_MAX && n < count; i++) {
+        fs = &fs_mounts[i];
+        spin_lock(&mnt_lock);
+        if (!fs_live(fs)) {
+            spin_unlock(&mnt_lock);
+            continue;
+        }
+        fs->ref_count++;
+        spin_unlock(&mnt_lock);
+
+        retval = fs_statfs(fs, &buf[n]);
+        fs_put(fs);
+        if (retval < 0)
+            return retval;
+        n++;
+    }
+    return n;
+}
+
+/* The mount an open directory belongs to, put it with fs_put() */
+static struct fs_dev* fs_dir_dev(DIR *dir)
+{
+    struct fs_dev *fs = NULL;
+    int i;
+
+    spin_lock(&mnt_lock);
+    for (i = 0; i < FS_MNT_MAX; i++)
+        if (fs_live(&fs_mounts[i]) && fs_mounts[i].data == dir->obj.fs) {
+            fs = &fs_mounts[i];
+            fs->ref_count++;
+            break;
+        }
+    spin_unlock(&mnt_lock);
+    return fs;
+}
+
+/* Note: Before call ops->open() you may copy the path and flags parameters into fd object structure
+ *       An open file keeps its reference to the mount until file_close().
+ */
 int file_open(struct fs_fd* fd, const char *path, int flags)
 {
+    const char *rel;
+    struct fs_dev *fs = fs_lookup(path, &rel);
+    int retval;
+
+    if (!fs)
+        return -STATUS_ENOENT;
+    fd->fs = fs;
     fd->flags = flags;
-    strcpy(fd->path, path);
-    return convert_retval(fat_fs.ops->open(fd));
+    strcpy(fd->path, rel);
+    retval = convert_retval(fs->ops->open(fd));
+    if (retval)
+        fs_put(fs);
+    return retval;
 }
 
+/* Reads stop at the end of the file, checked under the file lock */
 int file_read(struct fs_fd* fd, void *buf, size_t len)
 {
-    int retval = fat_fs.ops->read(fd, buf, len);
+    if (!fd->fs)
+        return -STATUS_EBADF;
+    spin_lock(&fd->lock);
+    if (fd->pos >= fd->size)
+        len = 0;
+    else if (len > fd->size - fd->pos)
+        len = fd->size - fd->pos;
+    int retval = fd->fs->ops->read(fd, buf, len);
+    spin_unlock(&fd->lock);
     if (retval < 0)
         return convert_retval(retval);
     return retval;
 }
 
+/* Writeback.  Written data waits in memory (FAT write-behind buffers, the
+ * FIL sector buffer, FAT windows) until the file is flushed.  There are no
+ * kernel threads to do that in the background: every FS_WB_INTERVAL ticks
+ * the timer marks a pass due, and the next CPU on its way back to user mode
+ * runs it in fs_writeback().  A pass flushes the files written more than
+ * FS_WB_EXPIRE ticks ago, or every written file once more than
+ * FS_WB_BACKGROUND bytes are dirty.  A writer that gets the dirty bytes
+ * above FS_WB_LIMIT flushes its own file before it returns.  A file that
+ * fails to flush stays dirty and is tried again.  The error of a flush
+ * nobody waits for is kept in the file (wb_error) and returned by the next
+ * write, fsync or close on it.
+ */
+
+/* Drivers report the bytes they buffer (+) and write back (-) */
+void fs_dirty_add(int delta)
+{
+    spin_lock(&wb_lock);
+    fs_dirty += delta;
+    spin_unlock(&wb_lock);
+}
+
+/* Under fd->lock */
+static int fd_writeback(struct fs_fd* fd)
+{
+    int retval = fd->fs->ops->flush(fd);
+
+    if (!retval)
+        fd->dirty_since = 0;
+    return retval;
+}
+
+/* Under fd->lock, a writeback whose error is kept for the file's owner */
+static void fd_writeback_async(struct fs_fd* fd)
+{
+    int retval = fd_writeback(fd);
+
+    if (retval)
+        fd->wb_error = retval;
+}
+
+/* Under fd->lock, take the error a writeback left */
+static int fd_wb_error(struct fs_fd* fd)
+{
+    int retval = fd->wb_error;
+
+    fd->wb_error = 0;
+    return retval;
+}
+
+/* Under fd->lock, after bytes were written */
+static void fd_written(struct fs_fd* fd)
+{
+    if (!fd->dirty_since)
+        fd->dirty_since = sys_get_ticks() + 1;
+    if (fs_dirty > FS_WB_LIMIT)
+        fd_writeback_async(fd);
+}
+
 int file_write(struct fs_fd* fd, const void *buf, size_t len)
 {
-    int retval = fat_fs.ops->write(fd, buf, len);
+    if (!fd->fs)
+        return -STATUS_EBADF;
+    spin_lock(&fd->lock);
+    int retval = fd_wb_error(fd);
+    if (!retval)
+        retval = fd->fs->ops->write(fd, buf, len);
+    if (retval > 0)
+        fd_written(fd);
+    spin_unlock(&fd->lock);
+    if (retval < 0)
+        return convert_retval(retval);
+    return retval;
+}
+
+/* pread()/pwrite() run at off and put the position back, all under the
+ * file lock, so descriptors shared across tasks need no lseek() in between.
+ */
+static int file_seek_locked(struct fs_fd* fd, off_t off)
+{
+    fd->pos = off;
+    return fd->fs->ops->lseek(fd, off);
+}
+
+int file_pread(struct fs_fd* fd, void *buf, size_t len, off_t off)
+{
+    off_t save;
+    int retval = 0;
+
+    if (!fd->fs)
+        return -STATUS_EBADF;
+    spin_lock(&fd->lock);
+    /* Seeking a writable FAT file past its end would extend it */
+    if (off < fd->size) {
+        save = fd->pos;
+        retval = file_seek_locked(fd, off);
+        if (!retval)
+            retval = fd->fs->ops->read(fd, buf, len);
+        file_seek_locked(fd, save);
+    }
+    spin_unlock(&fd->lock);
     if (retval < 0)
         return convert_retval(retval);
     return retval;
 }
 
+int file_pwrite(struct fs_fd* fd, const void *buf, size_t len, off_t off)
+{
+    off_t save;
+    int retval;
+
+    if (!fd->fs)
+        return -STATUS_EBADF;
+    spin_lock(&fd->lock);
+    if ((retval = fd_wb_error(fd)) != 0) {
+        spin_unlock(&fd->lock);
+        return convert_retval(retval);
+    }
+    save = fd->pos;
+    retval = file_seek_locked(fd, off);
+    if (!retval)
+        retval = fd->fs->ops->write(fd, buf, len);
+    if (retval > 0)
+        fd_written(fd);
+    file_seek_locked(fd, save);
+    spin_unlock(&fd->lock);
+    if (retval < 0)
+        return convert_retval(retval);
+    return retval;
+}
+
+/* Runs of small readv()/writev() fragments are gathered here, so the file
+ * system is called once per buffer full rather than once per fragment.
+ * Fragments of a buffer or more go straight through.  The kernel isn't
+ * preempted and the file lock is held, one buffer per CPU does.
+ */
+#define FS_IOV_BOUNCE   PGSIZE
+
+static char iov_bounce[NCPU][FS_IOV_BOUNCE];
+
+static int file_rw_vec(struct fs_fd* fd, const struct iovec *iov, int iovcnt, int write)
+{
+    char *bounce = iov_bounce[cpunum()];
+    size_t fill, done = 0, left, len;
+    int i = 0, j, retval = 0;
+
+    while (i < iovcnt) {
+        if (iov[i].iov_len >= FS_IOV_BOUNCE) {
+            fill = iov[i].iov_len;
+            retval = write ? fd->fs->ops->write(fd, iov[i].iov_base, fill)
+                           : fd->fs->ops->read(fd, iov[i].iov_base, fill);
+            j = i + 1;
+        } else {
+            for (fill = 0, j = i; j < iovcnt && iov[j].iov_len < FS_IOV_BOUNCE &&
+                    fill + iov[j].iov_len <= FS_IOV_BOUNCE; j++) {
+                if (write)
+                    memcpy(bounce + fill, iov[j].iov_base, iov[j].iov_len);
+                fill += iov[j].iov_len;
+            }
+            retval = write ? fd->fs->ops->write(fd, bounce, fill)
+                           : fd->fs->ops->read(fd, bounce, fill);
+            /* Scatter what was read */
+            for (left = retval > 0 ? retval : 0; !write && left; i++) {
+                len = MIN(left, iov[i].iov_len);
+                memcpy(iov[i].iov_base, bounce + (retval - left), len);
+                left -= len;
+            }
+        }
+        if (retval < 0)
+            break;
+        done += retval;
+        if (retval < fill)      /* End of file or volume full */
+            break;
+        i = j;
+    }
+    /* An error after some bytes is reported by the next call */
+    if (done)
+        return done;
+    return retval < 0 ? convert_retval(retval) : 0;
+}
+
+int file_readv(struct fs_fd* fd, const struct iovec *iov, int iovcnt)
+{
+    int retval;
+
+    if (!fd->fs)
+        return -STATUS_EBADF;
+    spin_lock(&fd->lock);
+    retval = file_rw_vec(fd, iov, iovcnt, 0);
+    spin_unlock(&fd->lock);
+    return retval;
+}
+
+int file_writev(struct fs_fd* fd, const struct iovec *iov, int iovcnt)
+{
+    int retval;
+
+    if (!fd->fs)
+        return -STATUS_EBADF;
+    spin_lock(&fd->lock);
+    if ((retval = fd_wb_error(fd)) != 0)
+        retval = convert_retval(retval);
+    else
+        retval = file_rw_vec(fd, iov, iovcnt, 1);
+    if (retval > 0)
+        fd_written(fd);
+    spin_unlock(&fd->lock);
+    return retval;
+}
+
+/* copy_file_range(): the data goes from one file to the other through a
+ * per CPU kernel buffer, FS_COPY_CHUNK at a time, and both positions move.
+ * Only one file lock is held at a time, so two tasks copying in opposite
+ * directions can't deadlock.  What could not be written is given back to
+ * the input file: its position goes back to where the chunk was read from
+ * plus what was written, whatever others did with it in between.
+ */
+#define FS_COPY_CHUNK   (4 * PGSIZE)
+
+static char copy_buf[NCPU][FS_COPY_CHUNK];
+
+int file_copy_range(struct fs_fd* in, struct fs_fd* out, size_t len)
+{
+    char *buf = copy_buf[cpunum()];
+    size_t done = 0;
+    off_t start;
+    int rd, wr = 0;
+
+    if (!in->fs || !out->fs)
+        return -STATUS_EBADF;
+    if (in == out)
+        return -STATUS_EINVAL;
+
+    while (done < len) {
+        spin_lock(&in->lock);
+        start = in->pos;
+        rd = in->fs->ops->read(in, buf, MIN(len - done, FS_COPY_CHUNK));
+        spin_unlock(&in->lock);
+        if (rd <= 0) {
+            wr = rd;
+            break;
+        }
+
+        spin_lock(&out->lock);
+        if (out->wb_error)      /* Left for the next call once bytes were copied */
+            wr = done ? 0 : fd_wb_error(out);
+        else
+            wr = out->fs->ops->write(out, buf, rd);
+        if (wr > 0)
+            fd_written(out);
+        spin_unlock(&out->lock);
+        if (wr > 0)
+            done += wr;
+        if (wr < rd) {          /* Error or volume full */
+            spin_lock(&in->lock);
+            file_seek_locked(in, start + (wr > 0 ? wr : 0));
+            spin_unlock(&in->lock);
+            break;
+        }
+    }
+    /* An error after some bytes is reported by the next call */
+    if (done)
+        return done;
+    return wr < 0 ? convert_retval(wr) : 0;
+}
+
 int file_close(struct fs_fd* fd)
 {
-    return convert_retval(fat_fs.ops->close(fd));
+    int retval;
+
+    if (!fd->fs)
+        return -STATUS_EBADF;
+    retval = fd->fs->ops->close(fd);
+    if (fd->wb_error)
+        retval = fd_wb_error(fd);
+    retval = convert_retval(retval);
+    fs_put(fd->fs);
+    fd->fs = NULL;
+    return retval;
 }
 
-int file_lseek(struct fs_fd* fd, off_t offset)
+/* The new position is worked out and set under the file lock, so
+ * SEEK_CUR/SEEK_END see the position and size of the same moment.
+ *
+ * @return the new position, or a negative error.
+ */
+off_t file_lseek(struct fs_fd* fd, off_t offset, int whence)
 {
-    return convert_retval(fat_fs.ops->lseek(fd, offset));
+    off_t new_offset = 0;
+    int retval;
+
+    if (!fd->fs)
+        return -STATUS_EBADF;
+    spin_lock(&fd->lock);
+    switch (whence) {
+        case SEEK_SET:
+            new_offset = offset;
+            break;
+        case SEEK_CUR:
+            new_offset = fd->pos + offset;
+            break;
+        case SEEK_END:
+            new_offset = fd->size + offset;
+            break;
+    }
+    retval = file_seek_locked(fd, new_offset);
+    spin_unlock(&fd->lock);
+    if (retval)
+        return convert_retval(retval);
+    return new_offset;
 }
 
-int file_unlink(const char *path)
+int file_fallocate(struct fs_fd* fd, off_t len)
 {
-    int retval = fat_fs.ops->unlink(path);
-    int i;
-    if(!retval)
-        for(i = 0 ; i < FS_FD_MAX ; i++)
-            if(!strcmp(fd_table[i].path, path)) {
-                memset(fd_table[i].path, 0, sizeof(fd_table[i].path));
-                fd_table[i].ref_count = 0;
+    int retval;
+
+    if (!fd->fs)
+        return -STATUS_EBADF;
+    if (!fd->fs->ops->fallocate)
+        return -STATUS_ENOSYS;
+    spin_lock(&fd->lock);
+    retval = fd->fs->ops->fallocate(fd, len);
+    spin_unlock(&fd->lock);
+    return convert_retval(retval);
+}
+
+int file_fsync(struct fs_fd* fd)
+{
+    int retval;
+
+    if (!fd->fs)
+        return -STATUS_EBADF;
+    spin_lock(&fd->lock);
+    retval = fd_writeback(fd);
+    if (fd->wb_error)
+        retval = fd_wb_error(fd);
+    spin_unlock(&fd->lock);
+    return convert_retval(retval);
+}
+
+int file_ioctl(struct fs_fd* fd, int cmd, void *args)
+{
+    if (!fd->fs)
+        return -STATUS_EBADF;
+    if (!fd->fs->ops->ioctl)
+        return -STATUS_ENOSYS;
+    spin_lock(&fd->lock);
+    int retval = fd->fs->ops->ioctl(fd, cmd, args);
+    spin_unlock(&fd->lock);
+    if (retval < 0)
+        return convert_retval(retval);
+    return retval;
+}
+
+/* Flush every open file, then every mounted file system.  Files of other
+ * tasks are pinned with a reference while they are flushed.  A file's
+ * error goes to its owner as for the background writeback, sync() only
+ * reports the file systems'.
+ */
+int fs_sync(void)
+{
+    struct fd_page *pg;
+    struct fs_dev *fs;
+    struct fs_fd *fd;
+    int i, retval = 0, r;
+
+    for (pg = fd_pages; pg; pg = pg->next)
+        for (i = 0; i < FD_OBJS_PER_PAGE; i++) {
+            fd = &pg->objs[i].fd;
+            spin_lock(&fd_lock);
+            if (fd->ref_count <= 0) {
+                spin_unlock(&fd_lock);
+                continue;
             }
+            fd->ref_count++;
+            spin_unlock(&fd_lock);
+
+            spin_lock(&fd->lock);
+            if (fd->fs)
+                fd_writeback_async(fd);
+            spin_unlock(&fd->lock);
+            fd_put(fd);
+        }
+    for (i = 0; i < FS_MNT_MAX; i++) {
+        fs = &fs_mounts[i];
+        spin_lock(&mnt_lock);
+        if (!fs_live(fs)) {
+            spin_unlock(&mnt_lock);
+            continue;
+        }
+        fs->ref_count++;
+        spin_unlock(&mnt_lock);
+
+        if ((r = fs->ops->syncfs(fs)) != 0)
+            retval = r;
+        fs_put(fs);
+    }
     return convert_retval(retval);
 }
 
+/* Timer side of the writeback, in the interrupt on the boot CPU.  It only
+ * marks a pass due, the disk is never touched from here.
+ */
+void fs_writeback_tick(void)
+{
+    static unsigned long last;
+    unsigned long now = sys_get_ticks();
+
+    if (now - last < FS_WB_INTERVAL)
+        return;
+    last = now;
+    wb_due = 1;
+}
+
+/* Run a due writeback pass.  Called with interrupts off on the way back to
+ * user mode (trap return, sched_yield()), where this CPU holds no lock.
+ * The pass runs with interrupts on, so drivers can wait for their
+ * completion interrupts, and they are off again on return.  Written data
+ * reaches the disk within about FS_WB_EXPIRE + FS_WB_INTERVAL ticks.
+ */
+void fs_writeback(void)
+{
+    unsigned long now;
+    struct fd_page *pg;
+    struct fs_fd *fd;
+    int i, all;
+
+    if (!wb_due || !xchg(&wb_due, 0))
+        return;
+    __asm __volatile("sti");
+    now = sys_get_ticks();
+    all = fs_dirty > FS_WB_BACKGROUND;
+
+    for (pg = fd_pages; pg; pg = pg->next)
+        for (i = 0; i < FD_OBJS_PER_PAGE; i++) {
+            fd = &pg->objs[i].fd;
+            spin_lock(&fd_lock);
+            if (fd->ref_count <= 0 || !fd->dirty_since) {
+                spin_unlock(&fd_lock);
+                continue;
+            }
+            fd->ref_count++;
+            spin_unlock(&fd_lock);
+
+            spin_lock(&fd->lock);
+            if (fd->fs && fd->dirty_since &&
+                (all || now + 1 - fd->dirty_since >= FS_WB_EXPIRE))
+                fd_writeback_async(fd);
+            spin_unlock(&fd->lock);
+            fd_put(fd);
+        }
+    __asm __volatile("cli");
+}
+
+/* FatFs file lock (_FS_LOCK) refuses to remove an open file, -STATUS_EBUSY */
+int file_unlink(const char *path)
+{
+    const char *rel;
+    struct fs_dev *fs = fs_lookup(path, &rel);
+
+    int retval;
+
+    if (!fs)
+        return -STATUS_ENOENT;
+    retval = convert_retval(fs->ops->unlink(fs, rel));
+    fs_put(fs);
+    return retval;
+}
+
+int file_mkdir(const char *path)
+{
+    const char *rel;
+    struct fs_dev *fs = fs_lookup(path, &rel);
+
+    int retval = -STATUS_ENOSYS;
+
+    if (!fs)
+        return -STATUS_ENOENT;
+    if (fs->ops->mkdir)
+        retval = convert_retval(fs->ops->mkdir(fs, rel));
+    fs_put(fs);
+    return retval;
+}
+
 int file_opendir(DIR *dir, const char *pathname)
 {
-    return convert_retval(fat_fs.ops->opendir(dir, pathname));
+    const char *rel;
+    struct fs_dev *fs = fs_lookup(pathname, &rel);
+
+    int retval;
+
+    if (!fs)
+        return -STATUS_ENOENT;
+    retval = convert_retval(fs->ops->opendir(fs, dir, rel));
+    fs_put(fs);
+    return retval;
 }
 
 int file_readdir(DIR *dir, FILINFO *fno)
 {
-    return convert_retval(fat_fs.ops->readdir(dir, fno));
+    struct fs_dev *fs = fs_dir_dev(dir);
+
+    int retval;
+
+    if (!fs)
+        return -STATUS_EBADF;
+    retval = convert_retval(fs->ops->readdir(dir, fno));
+    fs_put(fs);
+    return retval;
+}
+
+/* Pack as many entries as fit into buf, struct dirent or with plus set
+ * struct dirent_plus records.  An entry is only read while the longest
+ * record still fits, so nothing is dropped between two calls.  Returns the
+ * bytes filled, 0 at the end of the directory.
+ */
+int file_getdents(DIR *dir, void *buf, size_t count, int plus)
+{
+    struct fs_dev *fs;
+    struct dirent *d;
+    struct dirent_plus *dp;
+    FILINFO fno;
+    size_t hdr, len = 0, namlen, reclen;
+    int retval = 0;
+
+    hdr = plus ? offsetof(struct dirent_plus, d_name) : offsetof(struct dirent, d_name);
+    if (count < ROUNDUP(hdr + sizeof(fno.fname), 4))
+        return -STATUS_EINVAL;
+    if (!(fs = fs_dir_dev(dir)))
+        return -STATUS_EBADF;
+
+    while (count - len >= ROUNDUP(hdr + sizeof(fno.fname), 4)) {
+        retval = convert_retval(fs->ops->readdir(dir, &fno));
+        if (retval < 0 || !fno.fname[0])
+            break;
+        namlen = strlen(fno.fname);
+        reclen = ROUNDUP(hdr + namlen + 1, 4);
+        if (plus) {
+            dp = (struct dirent_plus *)((char *)buf + len);
+            dp->d_type = (fno.fattrib & AM_DIR) ? DT_DIR : DT_REG;
+            dp->d_namlen = namlen;
+            dp->d_reclen = reclen;
+            dp->d_size = fno.fsize;
+            dp->d_date = fno.fdate;
+            dp->d_time = fno.ftime;
+            dp->d_attr = fno.fattrib;
+            memcpy(dp->d_name, fno.fname, namlen + 1);
+        } else {
+            d = (struct dirent *)((char *)buf + len);
+            d->d_type = (fno.fattrib & AM_DIR) ? DT_DIR : DT_REG;
+            d->d_namlen = namlen;
+            d->d_reclen = reclen;
+            memcpy(d->d_name, fno.fname, namlen + 1);
+        }
+        len += reclen;
+    }
+    fs_put(fs);
+    /* An error after some entries is reported by the next call */
+    return len ? len : retval;
 }
 
 int file_closedir(DIR *dir)
 {
-    return convert_retval(fat_fs.ops->closedir(dir));
+    struct fs_dev *fs = fs_dir_dev(dir);
+
+    int retval;
+
+    if (!fs)
+        return -STATUS_EBADF;
+    retval = convert_retval(fs->ops->closedir(dir));
+    fs_put(fs);
+    return retval;
 }
 
 int file_stat(const char *pathname, FILINFO *fno) {
-    return convert_retval(fat_fs.ops->stat(pathname, fno));
+    const char *rel;
+    struct fs_dev *fs = fs_lookup(pathname, &rel);
+
+    int retval;
+
+    if (!fs)
+        return -STATUS_ENOENT;
+    retval = convert_retval(fs->ops->stat(fs, rel, fno));
+    fs_put(fs);
+    return retval;
+}
+
+/* Space of the file system holding pathname */
+int file_statfs(const char *pathname, struct statfs *buf)
+{
+    struct fs_dev *fs = fs_lookup(pathname, NULL);
+
+    int retval;
+
+    if (!fs)
+        return -STATUS_ENOENT;
+    retval = fs_statfs(fs, buf);
+    fs_put(fs);
+    return retval;
+}
+
+static uint32_t dcache_hashfn(void *sb, uint32_t dir, const char *name, int len)
+{
+    uint32_t h = (uint32_t)sb ^ (dir * 2654435761U);
+    while (len--)
+        h = h * 31 + (uint8_t)*name++;
+    return h % DCACHE_HASH;
+}
+
+static void dcache_lru_move(struct dentry *de, int head)
+{
+    de->prev->next = de->next;
+    de->next->prev = de->prev;
+    if (head) {
+        de->prev = &dcache_lru;
+        de->next = dcache_lru.next;
+    } else {
+        de->prev = dcache_lru.prev;
+        de->next = &dcache_lru;
+    }
+    de->prev->next = de;
+    de->next->prev = de;
+}
+
+static struct dentry* dcache_find(void *sb, uint32_t dir, const char *name, int len)
+{
+    struct dentry *de;
+
+    for (de = dcache_hash[dcache_hashfn(sb, dir, name, len)]; de; de = de->hnext)
+        if (de->sb == sb && de->dir == dir && de->len == len && !memcmp(de->name, name, len))
+            return de;
+    return NULL;
+}
+
+/* Unhash an entry and move it to the LRU tail */
+static void dcache_free(struct dentry *de)
+{
+    struct dentry **pp = &dcache_hash[dcache_hashfn(de->sb, de->dir, de->name, de->len)];
+
+    while (*pp != de)
+        pp = &(*pp)->hnext;
+    *pp = de->hnext;
+    de->sb = NULL;
+    dcache_lru_move(de, 0);
 }
 
 /**
- * @ingroup Fd
- * This function will allocate a file descriptor.
+ * Look a name up in the dentry cache.
  *
- * @return -1 on failed or the allocated file descriptor.
+ * @return 1 and the entry in info, -1 if the name is known to be missing
+ * or 0 if the cache doesn't know.
  */
-int fd_new(void)
+int dcache_lookup(void *sb, uint32_t dir, const char *name, int len, struct dentry_info *info)
+{
+    struct dentry *de;
+    int retval = 0;
+
+    if (len > DCACHE_NAME_MAX)
+        return 0;
+    spin_lock(&dcache_lock);
+    if ((de = dcache_find(sb, dir, name, len))) {
+        dcache_lru_move(de, 1);
+        if (de->negative)
+            retval = -1;
+        else {
+            *info = de->info;
+            retval = 1;
+        }
+    }
+    spin_unlock(&dcache_lock);
+    return retval;
+}
+
+/* Remember a lookup, info NULL for a missing name */
+void dcache_enter(void *sb, uint32_t dir, const char *name, int len, const struct dentry_info *info)
+{
+    struct dentry *de;
+    uint32_t h;
+
+    if (len > DCACHE_NAME_MAX)
+        return;
+    spin_lock(&dcache_lock);
+    if (!(de = dcache_find(sb, dir, name, len))) {
+        /* recycle the least recently used entry */
+        de = dcache_lru.prev;
+        if (de->sb)
+            dcache_free(de);
+        h = dcache_hashfn(sb, dir, name, len);
+        de->sb = sb;
+        de->dir = dir;
+        memcpy(de->name, name, len);
+        de->len = len;
+        de->hnext = dcache_hash[h];
+        dcache_hash[h] = de;
+    }
+    de->negative = !info;
+    if (info)
+        de->info = *info;
+    dcache_lru_move(de, 1);
+    spin_unlock(&dcache_lock);
+}
+
+/* Drop a name, or with name NULL every name of the directory */
+void dcache_forget(void *sb, uint32_t dir, const char *name, int len)
+{
+    struct dentry *de;
+    int i;
+
+    spin_lock(&dcache_lock);
+    if (name) {
+        if (len <= DCACHE_NAME_MAX && (de = dcache_find(sb, dir, name, len)))
+            dcache_free(de);
+    } else {
+        for (i = 0; i < DCACHE_SIZE; i++)
+            if (dcache[i].sb == sb && dcache[i].dir == dir)
+                dcache_free(&dcache[i]);
+    }
+    spin_unlock(&dcache_lock);
+}
+
+/* Drop everything cached for a file system, on mount and mkfs */
+void dcache_purge(void *sb)
+{
+    int i;
+
+    spin_lock(&dcache_lock);
+    for (i = 0; i < DCACHE_SIZE; i++)
+        if (dcache[i].sb == sb)
+            dcache_free(&dcache[i]);
+    spin_unlock(&dcache_lock);
+}
+
+static void *fd_alloc_page(void)
+{
+    struct PageInfo *pp = page_alloc(ALLOC_ZERO);
+    if (!pp)
+        return NULL;
+    pp->pp_ref++;
+    return page2kva(pp);
+}
+
+static void fd_free_page(void *va)
+{
+    page_decref(pa2page(PADDR(va)));
+}
+
+/* A fresh open file object with one reference, NULL when out of memory */
+static struct fs_fd* fd_obj_alloc(void)
+{
+    struct fd_page *pg;
+    struct fd_obj *obj;
+    int i;
+
+    spin_lock(&fd_lock);
+    if (!fd_free_list) {
+        if (!(pg = fd_alloc_page())) {
+            spin_unlock(&fd_lock);
+            return NULL;
+        }
+        for (i = 0; i < FD_OBJS_PER_PAGE; i++) {
+            pg->objs[i].next = fd_free_list;
+            fd_free_list = &pg->objs[i];
+        }
+        pg->next = fd_pages;
+        fd_pages = pg;
+    }
+    obj = fd_free_list;
+    fd_free_list = obj->next;
+    memset(&obj->fd, 0, sizeof(obj->fd));
+    obj->fd.ref_count = 1;
+    spin_initlock(&obj->fd.lock);
+    spin_unlock(&fd_lock);
+    return &obj->fd;
+}
+
+/* Descriptor table of the running task, created on demand */
+static struct fd_table* fd_table_cur(int create)
 {
-	struct fs_fd* d;
-	int idx;
+    Task *cur = thiscpu->cpu_task;
 
-	/* find an empty fd entry */
-	for (idx = 0; idx < FS_FD_MAX && fd_table[idx].ref_count > 0; idx++);
+    if (!cur)
+        return NULL;
+    if (!cur->files && create)
+        cur->files = fd_alloc_page();
+    return cur->files;
+}
+
+static struct fs_fd** fd_slot(struct fd_table *t, int fd, int create)
+{
+    struct fs_fd ***page = &t->slots[fd / FS_FD_PER_PAGE];
 
+    if (!*page && (!create || !(*page = fd_alloc_page())))
+        return NULL;
+    return &(*page)[fd % FS_FD_PER_PAGE];
+}
+
+static int fd_in_use(const struct fd_table *t, int fd)
+{
+    return t && fd >= 0 && fd < FS_FD_MAX && (t->bitmap[fd / 32] & (1U << (fd % 32)));
+}
+
+/**
+ * @ingroup Fd
+ * This function will allocate a file object and install it at the lowest
+ * free file descriptor of the running task.
+ *
+ * @return the allocated file descriptor, -STATUS_EMFILE when the task's
+ * table is full or -STATUS_ENOMEM.
+ */
+int fd_new(void)
+{
+    struct fd_table *t = fd_table_cur(1);
+    struct fs_fd **slot, *d;
+    int i, idx;
 
-	/* can't find an empty fd entry */
-	if (idx == FS_FD_MAX)
-	{
-		idx = -1;
-		goto __result;
-	}
+    if (!t)
+        return -STATUS_ENOMEM;
 
-	d = &(fd_table[idx]);
-	d->ref_count = 1;
+    /* find the lowest clear bit */
+    for (i = 0; i < FS_FD_MAX / 32 && t->bitmap[i] == 0xFFFFFFFF; i++);
+    if (i == FS_FD_MAX / 32)
+        return -STATUS_EMFILE;
+    idx = i * 32 + __builtin_ctz(~t->bitmap[i]);
 
-__result:
-	return idx;
+    if (!(slot = fd_slot(t, idx, 1)) || !(d = fd_obj_alloc()))
+        return -STATUS_ENOMEM;
+    *slot = d;
+    t->bitmap[idx / 32] |= 1U << (idx % 32);
+    t->count++;
+    return idx;
 }
 
 /**
  * @ingroup Fd
  *
- * This function will return a file descriptor structure according to file
- * descriptor.
+ * This function will return the file object behind a file descriptor of
+ * the running task, with a reference the caller drops with fd_put().
  *
  * @return NULL on on this file descriptor or the file descriptor structure
  * pointer.
  */
 struct fs_fd* fd_get(int fd)
 {
-	struct fs_fd* d;
+    struct fd_table *t = fd_table_cur(0);
+    struct fs_fd* d;
 
-	if ( fd < 0 || fd > FS_FD_MAX ) return NULL;
+    if (!fd_in_use(t, fd))
+        return NULL;
+    d = *fd_slot(t, fd, 0);
 
-	d = &fd_table[fd];
+    /* increase the reference count */
+    spin_lock(&fd_lock);
+    d->ref_count++;
+    spin_unlock(&fd_lock);
 
-	/* increase the reference count */
-	d->ref_count ++;
+    return d;
+}
+
+/**
+ * @ingroup Fd
+ *
+ * This function will put the file object, the last reference closes the
+ * file and frees the object.
+ *
+ * @return the result of the close, 0 if references remain.
+ */
+int fd_put(struct fs_fd* fd)
+{
+    struct fd_obj *obj = (struct fd_obj *)fd;
+    int ref, retval = 0;
 
-	return d;
+    spin_lock(&fd_lock);
+    ref = --fd->ref_count;
+    spin_unlock(&fd_lock);
+    if (ref > 0)
+        return 0;
+
+    /* clear this file object */
+    if (fd->fs)
+        retval = file_close(fd);
+    spin_lock(&fd_lock);
+    obj->next = fd_free_list;
+    fd_free_list = obj;
+    spin_unlock(&fd_lock);
+    return retval;
 }
 
 /**
  * @ingroup Fd
  *
- * This function will put the file descriptor.
+ * This function will take a file descriptor out of the running task's
+ * table.  The caller inherits the table's reference to the file object.
+ *
+ * @return NULL if fd is not open.
  */
-void fd_put(struct fs_fd* fd)
+struct fs_fd* fd_remove(int fd)
 {
+    struct fd_table *t = fd_table_cur(0);
+    struct fs_fd **slot, *d;
 
-	fd->ref_count --;
+    if (!fd_in_use(t, fd))
+        return NULL;
+    slot = fd_slot(t, fd, 0);
+    d = *slot;
+    *slot = NULL;
+    t->bitmap[fd / 32] &= ~(1U << (fd % 32));
+    t->count--;
+    return d;
+}
 
-	/* clear this fd entry */
-	if ( fd->ref_count == 0 )
-	{
-		//memset(fd, 0, sizeof(struct fs_fd));
-		memset(fd->data, 0, sizeof(FIL));
-	}
-};
+/**
+ * @ingroup Fd
+ *
+ * This function will give a forked task its own table, referring to the
+ * same file objects (positions are shared, like POSIX open file
+ * descriptions).
+ */
+int fd_table_copy(struct fd_table **dst, const struct fd_table *src)
+{
+    struct fd_table *t;
+    int i, j;
 
+    *dst = NULL;
+    if (!src)
+        return 0;
+    if (!(t = fd_alloc_page()))
+        return -STATUS_ENOMEM;
 
+    for (i = 0; i < FD_TABLE_PAGES; i++) {
+        if (!src->slots[i])
+            continue;
+        if (!(t->slots[i] = fd_alloc_page())) {
+            fd_table_release(&t);
+            return -STATUS_ENOMEM;
+        }
+        memcpy(t->slots[i], src->slots[i], PGSIZE);
+        spin_lock(&fd_lock);
+        for (j = 0; j < FS_FD_PER_PAGE; j++)
+            if (t->slots[i][j])
+                t->slots[i][j]->ref_count++;
+        spin_unlock(&fd_lock);
+    }
+    memcpy(t->bitmap, src->bitmap, sizeof(t->bitmap));
+    t->count = src->count;
+    *dst = t;
+    return 0;
+}
+
+/**
+ * @ingroup Fd
+ *
+ * This function will close every descriptor of a table and free it, when
+ * a task is killed.
+ */
+void fd_table_release(struct fd_table **table)
+{
+    struct fd_table *t = *table;
+    int i, j;
+
+    if (!t)
+        return;
+    *table = NULL;
+    for (i = 0; i < FD_TABLE_PAGES; i++) {
+        if (!t->slots[i])
+            continue;
+        for (j = 0; j < FS_FD_PER_PAGE; j++)
+            if (t->slots[i][j])
+                fd_put(t->slots[i][j]);
+        fd_free_page(t->slots[i]);
+    }
+    fd_free_page(t);
+}
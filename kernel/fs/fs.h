@@ -1,18 +1,43 @@
 #ifndef K_FS_H
 #define K_FS_H
 #include <inc/types.h>
+#include <inc/mmu.h>
+#include <inc/fs.h>
+#include <kernel/spinlock.h>
 #include <kernel/fs/fat/ff.h>
 
-#define FS_FD_MAX 10
+#define FS_FD_PER_PAGE  (PGSIZE / sizeof(struct fs_fd *))
+#define FS_FD_MAX       (4 * FS_FD_PER_PAGE)    /* Descriptors per task */
+#define FS_MNT_MAX 8    /* Mount table size, one FAT volume per block device and tmpfs */
+
+/* Writeback, see fs_writeback().  Ticks are TIME_HZ (100) per second. */
+#define FS_WB_INTERVAL      50              /* Ticks between writeback passes */
+#define FS_WB_EXPIRE        300             /* Age in ticks at which written data goes to disk */
+#define FS_WB_BACKGROUND    (128 * 1024)    /* Dirty bytes that start writeback of every file */
+#define FS_WB_LIMIT         (512 * 1024)    /* Dirty bytes at which writers write back themselves */
+
+/* Mount flags of the file systems mounted at boot */
+#define FS_ROOT_MNT_FLAGS   0
+
+/* fs_mount() data: which block device (FatFs pdrv) and how */
+struct fs_mount_args
+{
+    int dev_id;
+    uint32_t flags;
+};
 
 /* Mounted file system */
 struct fs_dev
 {
 	uint32_t dev_id;		/* Attached device */
 
-	char  path[32];				/* File system mount point */
+	char  path[32];				/* File system mount point, empty if the slot is free */
 	const struct fs_ops* ops;	/* Operations for file system type */
 
+	uint32_t flags;			/* Mount flags (MNT_*) */
+	int ref_count;			/* Open files and calls in progress */
+	int busy;				/* Being mounted or unmounted, lookups skip it */
+
 	void *data;				/* Specific file system data */
 };
 
@@ -30,6 +55,36 @@ struct fs_fd
     off_t  	pos;			/* Current file position */
 
     void *data;					/* Specific file system data */
+
+    unsigned long dirty_since;  /* Ticks + 1 at the first write not written back, 0: clean */
+    int wb_error;               /* Writeback failure the owner hasn't been told of, -FR_* */
+    struct spinlock lock;       /* Serializes I/O on this open file */
+};
+
+/* Per task descriptor table, allocated on the first open.  Descriptors are
+ * handed out lowest first from the bitmap, the slot pages behind them are
+ * allocated as the task reaches them.
+ */
+struct fd_table
+{
+    int count;                                          /* Descriptors in use */
+    uint32_t bitmap[FS_FD_MAX / 32];
+    struct fs_fd **slots[FS_FD_MAX / FS_FD_PER_PAGE];   /* FS_FD_PER_PAGE each */
+};
+
+/* Directory entry cache, keyed by (file system, parent directory, name).
+ * A negative entry records that the name is missing.  The file system
+ * driver looks names up here and keeps the entries up to date.
+ */
+#define DCACHE_SIZE     256
+#define DCACHE_HASH     64
+#define DCACHE_NAME_MAX 12
+
+struct dentry_info
+{
+    uint32_t pos;       /* Where the entry is in its directory */
+    uint32_t ino;       /* The object, FAT: start cluster */
+    uint32_t attr;
 };
 
 /* It's low level disk operators */
@@ -38,11 +93,11 @@ struct fs_ops
     char *dev_name;
     /* mount and unmount file system */
     int (*mount)	(struct fs_dev* fs, const void* data);
-    //int (*unmount)	(struct fs_dev* fs);
+    int (*unmount)	(struct fs_dev* fs);
 
     /* Volume Management */
-    int (*mkfs)     (const char* device_name);
-    //int (*statfs)   (struct fs_dev* fs, struct statfs *buf);
+    int (*mkfs)     (struct fs_dev* fs);
+    int (*statfs)   (struct fs_dev* fs, struct statfs *buf);    /* Optional */
 
     /* File operators */
     int (*open)		(struct fs_fd* fd);
@@ -50,36 +105,67 @@ struct fs_ops
     int (*ioctl)	(struct fs_fd* fd, int cmd, void *args);
     int (*read)		(struct fs_fd* fd, void* buf, size_t count);
     int (*write)	(struct fs_fd* fd, const void* buf, size_t count);
-    //int (*flush)    (struct fs_fd* fd);
+    int (*flush)    (struct fs_fd* fd);
+    int (*syncfs)   (struct fs_dev* fs);
     int (*lseek)	(struct fs_fd* fd, off_t offset);
+    int (*fallocate)(struct fs_fd* fd, off_t len);     /* Optional */
     
-    //int (*getdents)	(struct fs_fd* fd, struct dirent* dirp, uint32_t count);
-    int (*unlink)	(const char* pathname);
-    int (*opendir)  (DIR* dir, const char* pathname);
+    /* Path names are relative to the mount point */
+    int (*unlink)	(struct fs_dev* fs, const char* pathname);
+    int (*mkdir)	(struct fs_dev* fs, const char* pathname);
+    int (*opendir)  (struct fs_dev* fs, DIR* dir, const char* pathname);
     int (*readdir)  (DIR* dir, FILINFO* fno);
     int (*closedir) (DIR* dir);
-    int (*stat)     (const char *pathname, FILINFO *fno);
+    int (*stat)     (struct fs_dev* fs, const char *pathname, FILINFO *fno);
 };
 
 
 int fs_init();
 int fs_mount(const char* device_name, const char* path, const void* data);
+int fs_umount(const char* path);
+int fs_mkfs(const char* device_name, int dev_id);
+struct fs_dev* fs_lookup(const char* path, const char** rel);
+void fs_put(struct fs_dev* fs);
+int fs_getfsstat(struct statfs *buf, int count);
 
 int file_open(struct fs_fd* fd, const char *path, int flags);
 int file_close(struct fs_fd* fd);
 int file_read(struct fs_fd* fd, void *buf, size_t len);
 int file_write(struct fs_fd* fd, const void *buf, size_t len);
-
-int file_lseek(struct fs_fd* fd, off_t offset);
+int file_pread(struct fs_fd* fd, void *buf, size_t len, off_t off);
+int file_pwrite(struct fs_fd* fd, const void *buf, size_t len, off_t off);
+int file_readv(struct fs_fd* fd, const struct iovec *iov, int iovcnt);
+int file_writev(struct fs_fd* fd, const struct iovec *iov, int iovcnt);
+int file_copy_range(struct fs_fd* in, struct fs_fd* out, size_t len);
+
+off_t file_lseek(struct fs_fd* fd, off_t offset, int whence);
+int file_fallocate(struct fs_fd* fd, off_t len);
+int file_fsync(struct fs_fd* fd);
+int file_ioctl(struct fs_fd* fd, int cmd, void *args);
+int fs_sync(void);
+void fs_writeback_tick(void);
+void fs_writeback(void);
+void fs_dirty_add(int delta);
 int file_unlink(const char *path);
+int file_mkdir(const char *path);
 
 int file_opendir(DIR *dir, const char* pathname);
 int file_readdir(DIR *dir, FILINFO *fno);
+int file_getdents(DIR *dir, void *buf, size_t count, int plus);
 int file_closedir(DIR *dir);
 int file_stat(const char* pathname, FILINFO *fno);
+int file_statfs(const char* pathname, struct statfs *buf);
+
+int dcache_lookup(void *sb, uint32_t dir, const char *name, int len, struct dentry_info *info);
+void dcache_enter(void *sb, uint32_t dir, const char *name, int len, const struct dentry_info *info);
+void dcache_forget(void *sb, uint32_t dir, const char *name, int len);
+void dcache_purge(void *sb);
 
 struct fs_fd* fd_get(int fd);
-void fd_put(struct fs_fd* fd);
+int fd_put(struct fs_fd* fd);
 int fd_new(void);
+struct fs_fd* fd_remove(int fd);
+int fd_table_copy(struct fd_table **dst, const struct fd_table *src);
+void fd_table_release(struct fd_table **table);
 
 #endif
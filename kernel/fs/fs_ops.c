@@ -2,11 +2,52 @@
 /* It's contants fat file system operators */
 
 #include <inc/stdio.h>
+#include <inc/string.h>
 #include <fs.h>
 #include <fat/ff.h>
 #include <diskio.h>
+#include <kernel/mem.h>
+#include <kernel/spinlock.h>
 
-extern struct fs_dev fat_fs;
+/* FATFS objects, one per volume (FatFs pdrv) */
+static FATFS fat_vols[_VOLUMES];
+
+/* State of an open file, fs_fd.data points to it from fat_open to fat_close */
+#define FAT_CLMT_ITEMS  64      /* Fast seek map: size, (length, start) per fragment, 0 */
+#define FAT_WB_PAGES    16      /* Write-behind buffer for small writes, 64 KB */
+
+struct fat_file
+{
+    FIL fil;
+    int clmt_failed;            /* Too fragmented for clmt[], don't retry */
+    DWORD clmt[FAT_CLMT_ITEMS];
+    FSIZE_t wb_off;             /* File offset of the buffered data */
+    UINT wb_len;                /* Bytes buffered */
+    int wb_err;                 /* Failed flush not reported yet, -FR_* */
+    uint8_t *wb[FAT_WB_PAGES];  /* Buffer pages, allocated as they fill */
+    struct fat_file *next;      /* Free list */
+};
+
+#define FAT_FILES_PER_PAGE  ((PGSIZE - sizeof(void *)) / sizeof(struct fat_file))
+
+struct fat_file_page
+{
+    struct fat_file_page *next;
+    struct fat_file files[FAT_FILES_PER_PAGE];
+};
+
+static struct fat_file_page *fat_file_pages;
+static struct fat_file *fat_free_files;
+static struct spinlock fat_file_lock;
+static int fat_file_lock_init;
+
+#define FAT_PATH_MAX 72
+
+/* Prefix a path relative to the mount point with the volume number, "N:/..." */
+static const char *fat_path(struct fs_dev *fs, const char *path, char *buf) {
+    snprintf(buf, FAT_PATH_MAX, "%d:%s", fs->dev_id, path);
+    return buf;
+}
 
 /*TODO: Lab7, fat level file operator.
  *       Implement below functions to support basic file system operators by using the elmfat's API(f_xxx).
@@ -42,16 +83,282 @@ extern struct fs_dev fat_fs;
  *        └──────────────┘
  */
 
+/* Fast seek: a cluster link map (CLMT) lets f_lseek and f_read find the
+ * cluster of an offset without following the FAT chain from the start.
+ * It is built on the first seek into a file of FAT_CLMT_MIN_CLUST clusters
+ * or more, or on ioctl(FIO_FASTSEEK).  FatFs can't grow a file in fast
+ * seek mode, so writing or seeking past the end drops the map first.
+ */
+#define FAT_CLMT_MIN_CLUST 4
+
+/* File objects are carved out of pages on demand and never given back */
+static struct fat_file *fat_file_alloc(void) {
+    struct PageInfo *pp;
+    struct fat_file_page *pg;
+    struct fat_file *ff;
+    int i;
+
+    spin_lock(&fat_file_lock);
+    if (!fat_free_files) {
+        if (!(pp = page_alloc(ALLOC_ZERO))) {
+            spin_unlock(&fat_file_lock);
+            return NULL;
+        }
+        pp->pp_ref++;
+        pg = page2kva(pp);
+        for (i = 0; i < FAT_FILES_PER_PAGE; i++) {
+            pg->files[i].next = fat_free_files;
+            fat_free_files = &pg->files[i];
+        }
+        pg->next = fat_file_pages;
+        fat_file_pages = pg;
+    }
+    ff = fat_free_files;
+    fat_free_files = ff->next;
+    spin_unlock(&fat_file_lock);
+
+    memset(ff, 0, sizeof(*ff));
+    return ff;
+}
+
+static void fat_file_free(struct fat_file *ff) {
+    spin_lock(&fat_file_lock);
+    ff->next = fat_free_files;
+    fat_free_files = ff;
+    spin_unlock(&fat_file_lock);
+}
+
+static int fat_clmt_build(struct fat_file *ff) {
+    FIL *fil = &ff->fil;
+    int retval;
+
+    if (fil->cltbl)
+        return 0;
+    ff->clmt[0] = FAT_CLMT_ITEMS;
+    fil->cltbl = ff->clmt;
+    retval = f_lseek(fil, CREATE_LINKMAP);
+    if (retval) {
+        fil->cltbl = 0;
+        ff->clmt_failed = 1;
+    }
+    return -retval;
+}
+
+static void fat_clmt_drop(struct fat_file *ff) {
+    ff->fil.cltbl = 0;
+    ff->clmt_failed = 0;
+}
+
+/* Write-behind: writes smaller than a page are gathered in up to
+ * FAT_WB_PAGES pages and go to f_write a page at a time, so a stream of
+ * small records reaches the disk as multi-sector writes rather than one
+ * trip through FatFs' sector buffer per record.  While data is held the
+ * FIL stays at wb_off, so it is written back before anything else uses
+ * the FIL: read, lseek, fsync, fallocate and close.  The pages are given
+ * back once the file is flushed (fsync, the VFS writeback) or closed, and
+ * when free pages run low.  The bytes held count as dirty memory for the
+ * VFS writeback (fs_dirty_add()).  If the FIL can't take all of them, the
+ * rest stays buffered for the next flush.  The call that ran into the
+ * error returns it, and it stays in wb_err until a write, flush or close
+ * has reported it, so one met by a read or seek is not lost.  Only close
+ * gives up on data that still can't be written.
+ */
+#define FAT_WB_MIN_FREE 64      /* Free pages below which nothing is buffered */
+
+/* Drop the first 'done' bytes of the buffer, the rest moves to its start */
+static void fat_wb_shift(struct fat_file *ff, UINT done) {
+    UINT off, n;
+
+    for (off = 0; off < ff->wb_len - done; off += n) {
+        n = MIN(PGSIZE - off % PGSIZE, PGSIZE - (off + done) % PGSIZE);
+        n = MIN(n, ff->wb_len - done - off);
+        memmove(ff->wb[off / PGSIZE] + off % PGSIZE,
+                ff->wb[(off + done) / PGSIZE] + (off + done) % PGSIZE, n);
+    }
+    ff->wb_off += done;
+    ff->wb_len -= done;
+}
+
+static int fat_wb_flush(struct fs_fd *file) {
+    struct fat_file *ff = file->data;
+    FIL *fil = &ff->fil;
+    UINT n, done, len;
+    int retval = 0;
+
+    if (!ff->wb_len)
+        return 0;
+    if (fil->cltbl && fil->fptr + ff->wb_len > fil->obj.objsize)
+        fat_clmt_drop(ff);
+    for (done = 0; done < ff->wb_len; done += len) {
+        n = MIN(ff->wb_len - done, PGSIZE);
+        retval = f_write(fil, ff->wb[done / PGSIZE], n, &len);
+        if (!retval && len < n)
+            retval = FR_NOT_ENABLED;    /* Volume full */
+        if (retval) {
+            done += len;
+            break;
+        }
+    }
+    fs_dirty_add(-(int)done);
+    if (retval) {
+        fat_wb_shift(ff, done);
+        ff->wb_err = -retval;
+        return -retval;
+    }
+    ff->wb_len = 0;
+    return 0;
+}
+
+/* Take the error a flush left for the next write, flush or close */
+static int fat_wb_error(struct fat_file *ff) {
+    int retval = ff->wb_err;
+
+    ff->wb_err = 0;
+    return retval;
+}
+
+static void fat_wb_release(struct fat_file *ff) {
+    int i;
+
+    for (i = 0; i < FAT_WB_PAGES && ff->wb[i]; i++) {
+        page_decref(pa2page(PADDR(ff->wb[i])));
+        ff->wb[i] = NULL;
+    }
+}
+
+/* Returns 1 when buf was buffered, 0 when it has to be written directly */
+static int fat_wb_write(struct fs_fd *file, const void *buf, size_t count) {
+    struct fat_file *ff = file->data;
+    const uint8_t *src = buf;
+    struct PageInfo *pp;
+    UINT i, off, n;
+    int retval;
+
+    if (ff->wb_len + count > FAT_WB_PAGES * PGSIZE && (retval = fat_wb_flush(file)) != 0)
+        return retval;
+    for (i = ff->wb_len / PGSIZE; i <= (ff->wb_len + count - 1) / PGSIZE; i++) {
+        if (ff->wb[i])
+            continue;
+        if (sys_get_num_free_page() < FAT_WB_MIN_FREE || !(pp = page_alloc(0))) {
+            if ((retval = fat_wb_flush(file)) == 0)
+                fat_wb_release(ff);
+            return retval;
+        }
+        pp->pp_ref++;
+        ff->wb[i] = page2kva(pp);
+    }
+
+    if (!ff->wb_len)
+        ff->wb_off = ff->fil.fptr;
+    for (off = ff->wb_len; count; off += n, src += n, count -= n) {
+        n = MIN(count, PGSIZE - off % PGSIZE);
+        memcpy(ff->wb[off / PGSIZE] + off % PGSIZE, src, n);
+        file->pos += n;
+    }
+    fs_dirty_add(off - ff->wb_len);
+    ff->wb_len = off;
+    if (ff->wb_off + ff->wb_len > file->size)
+        file->size = ff->wb_off + ff->wb_len;
+    return 1;
+}
+
+/* FatFs looks every path segment up in the VFS dentry cache first
+ * (_USE_DCACHE), keyed by the volume, the directory's start cluster and
+ * the 11 byte SFN.
+ */
+int ff_dcache_find(FATFS *fs, DWORD dir, const BYTE *name, FFDENT *de) {
+    struct dentry_info info;
+    int retval = dcache_lookup(fs, dir, (const char *)name, 11, &info);
+
+    if (retval > 0) {
+        de->ofs = info.pos;
+        de->sclust = info.ino;
+        de->attr = info.attr;
+    }
+    return retval;
+}
+
+void ff_dcache_enter(FATFS *fs, DWORD dir, const BYTE *name, const FFDENT *de) {
+    struct dentry_info info;
+
+    if (!de) {
+        dcache_enter(fs, dir, (const char *)name, 11, NULL);
+        return;
+    }
+    info.pos = de->ofs;
+    info.ino = de->sclust;
+    info.attr = de->attr;
+    dcache_enter(fs, dir, (const char *)name, 11, &info);
+}
+
+void ff_dcache_forget(FATFS *fs, DWORD dir, const BYTE *name) {
+    dcache_forget(fs, dir, (const char *)name, 11);
+}
+
 /* Note: 1. Get FATFS object from fs->data
-*        2. Check fs->path parameter then call f_mount.
+*        2. Mount the volume of fs->dev_id, data is a struct fs_mount_args.
 */
 int fat_mount(struct fs_dev *fs, const void* data) {
-    return -f_mount(fs->data, fs->path, 1);
+    const struct fs_mount_args *args = data;
+    uint32_t write_through;
+    char vol[FAT_PATH_MAX];
+
+    if (fs->dev_id >= _VOLUMES)
+        return -FR_INVALID_DRIVE;
+    if (fat_vols[fs->dev_id].fs_type)
+        return -FR_LOCKED;          /* Mounted somewhere else */
+    if (!fat_file_lock_init) {
+        spin_initlock(&fat_file_lock);
+        fat_file_lock_init = 1;
+    }
+    fs->flags = args ? args->flags : 0;
+    fs->data = &fat_vols[fs->dev_id];
+    write_through = (fs->flags & MNT_SYNC) ? 1 : 0;
+    disk_ioctl(fs->dev_id, CTRL_WRITE_THROUGH, &write_through);
+    dcache_purge(fs->data);
+    return -f_mount(fs->data, fat_path(fs, "", vol), 1);
+}
+
+/* The VFS only unmounts with no file open, what's left is the drive cache */
+int fat_unmount(struct fs_dev *fs) {
+    char vol[FAT_PATH_MAX];
+
+    if (disk_ioctl(fs->dev_id, CTRL_SYNC, 0) != RES_OK)
+        return -FR_DISK_ERR;
+    dcache_purge(fs->data);
+    return -f_mount(NULL, fat_path(fs, "", vol), 0);
 }
 
-/* Note: Just call f_mkfs at root path '/' */
-int fat_mkfs(const char* device_name) {
-    return -f_mkfs("/", 0, 0);
+/* Note: Create a FAT volume on the whole device */
+int fat_mkfs(struct fs_dev *fs) {
+    char vol[FAT_PATH_MAX];
+
+    if (fs->dev_id < _VOLUMES)
+        dcache_purge(&fat_vols[fs->dev_id]);
+    return -f_mkfs(fat_path(fs, "", vol), 0, 0);
+}
+
+/* FatFs keeps the free cluster count in memory: counted exactly at mount
+ * when the free cluster bitmap is built, else taken from FSINFO, and moved
+ * on every cluster allocated or freed.  f_getfree() only scans the FAT
+ * while the count is unknown, once per mount at most.
+ */
+int fat_statfs(struct fs_dev *fs, struct statfs *buf) {
+    char path[FAT_PATH_MAX];
+    FATFS *fatfs;
+    DWORD nclst;
+    int retval;
+
+    if ((retval = f_getfree(fat_path(fs, "/", path), &nclst, &fatfs)) != 0)
+        return -retval;
+#if _MAX_SS != _MIN_SS
+    buf->f_bsize = (uint32_t)fatfs->csize * fatfs->ssize;
+#else
+    buf->f_bsize = (uint32_t)fatfs->csize * _MAX_SS;
+#endif
+    buf->f_blocks = fatfs->n_fatent - 2;
+    buf->f_bfree = nclst;
+    return 0;
 }
 
 /* Note: Convert the POSIX's open flag to elmfat's flag.
@@ -59,6 +366,8 @@ int fat_mkfs(const char* device_name) {
 *                 if file->flags & O_APPEND then f_seek the file to end after f_open
 */
 int fat_open(struct fs_fd* file) {
+    char path[FAT_PATH_MAX];
+    struct fat_file *ff;
     int flag = 0;
     if(file->flags == O_RDONLY)
         flag |= FA_READ;
@@ -71,19 +380,47 @@ int fat_open(struct fs_fd* file) {
     if(file->flags & O_TRUNC)
         flag |= FA_CREATE_ALWAYS;
 
-    int retval = f_open(file->data, file->path, flag);
-    if(file->flags & O_APPEND)
-        fat_lseek(file, ((FIL*)file->data)->obj.objsize);
-    return -retval;
+    if (!(ff = fat_file_alloc()))
+        return -FR_NOT_ENOUGH_CORE;
+    int retval = f_open(&ff->fil, fat_path(file->fs, file->path, path), flag);
+    if (retval) {
+        fat_file_free(ff);
+        return -retval;
+    }
+    file->data = ff;
+    file->size = ff->fil.obj.objsize;
+    if(file->flags & O_APPEND) {
+        f_lseek(&ff->fil, file->size);
+        file->pos = file->size;
+    }
+    return 0;
 }
 
 int fat_close(struct fs_fd* file) {
-    return -f_close(file->data);
+    struct fat_file *ff = file->data;
+    int retval;
+
+    fat_wb_flush(file);
+    fs_dirty_add(-(int)ff->wb_len);     /* Lost if it still can't be written */
+    ff->wb_len = 0;
+    fat_wb_release(ff);
+    if ((retval = fat_wb_error(ff)) != 0)
+        f_close(&ff->fil);
+    else
+        retval = -f_close(&ff->fil);
+    file->data = NULL;
+    fat_file_free(ff);
+    return retval;
 }
 
 int fat_read(struct fs_fd* file, void* buf, size_t count) {
+    struct fat_file *ff = file->data;
     unsigned int len;
-    int retval = f_read(file->data, buf, count, &len);
+    int retval;
+
+    if ((retval = fat_wb_flush(file)) != 0)
+        return retval;
+    retval = f_read(&ff->fil, buf, count, &len);
     if (retval)
         return -retval;
 
@@ -92,27 +429,145 @@ int fat_read(struct fs_fd* file, void* buf, size_t count) {
 }
 
 int fat_write(struct fs_fd* file, const void* buf, size_t count) {
+    struct fat_file *ff = file->data;
+    FIL *fil = &ff->fil;
     unsigned int len;
-    int retval = f_write(file->data, buf, count, &len);
+    int retval;
+
+    if (ff->wb_err)
+        return fat_wb_error(ff);
+    /* Small writes are buffered, unless the mount is synchronous */
+    if (count && count < PGSIZE && (fil->flag & FA_WRITE) && !(file->fs->flags & MNT_SYNC)) {
+        if ((retval = fat_wb_write(file, buf, count)) < 0)
+            return fat_wb_error(ff);
+        if (retval)
+            return count;
+    }
+    if (fat_wb_flush(file) != 0)
+        return fat_wb_error(ff);
+
+    /* FatFs can't allocate clusters in fast seek mode */
+    if (fil->cltbl && fil->fptr + count > fil->obj.objsize)
+        fat_clmt_drop(ff);
+    retval = f_write(fil, buf, count, &len);
+    file->size = fil->obj.objsize;
     if (retval)
         return -retval;
 
+    /* Synchronous mount: also commit the FAT and directory entry */
+    if ((file->fs->flags & MNT_SYNC) && (retval = f_sync(fil)))
+        return -retval;
+
     file->pos += len;
-    if (file->pos > file->size)
-        file->size = file->pos;
     return len;
 }
 
+/* Write back the cached data and metadata of the file, then the drive cache */
+int fat_flush(struct fs_fd* file) {
+    struct fat_file *ff = file->data;
+    int retval = fat_wb_flush(file), err;
+
+    if (!retval) {
+        fat_wb_release(ff);
+        retval = -f_sync(&ff->fil);
+    }
+    err = fat_wb_error(ff);
+    return err ? err : retval;
+}
+
+/* FatFs keeps nothing dirty between calls except open files, so once they
+ * are flushed only the drive cache is left.
+ */
+int fat_syncfs(struct fs_dev* fs) {
+    return disk_ioctl(fs->dev_id, CTRL_SYNC, 0) == RES_OK ? 0 : -FR_DISK_ERR;
+}
+
 int fat_lseek(struct fs_fd* file, off_t offset) {
-    return -f_lseek(file->data, offset);
+    struct fat_file *ff = file->data;
+    FIL *fil = &ff->fil;
+    int retval;
+
+    if ((retval = fat_wb_flush(file)) != 0)
+        return retval;
+    /* Seeking past the end extends a writable file, only normal mode can */
+    if (offset > fil->obj.objsize)
+        fat_clmt_drop(ff);
+    else if (!fil->cltbl && !ff->clmt_failed &&
+             fil->obj.objsize >= (FSIZE_t)fil->obj.fs->csize * _MAX_SS * FAT_CLMT_MIN_CLUST)
+        fat_clmt_build(ff);
+    return -f_lseek(fil, offset);
+}
+
+/* Preallocate clusters for the file up to len bytes, leaving its size as
+ * it is: the clusters hold whatever was on the disk before, so they only
+ * become part of the file as writes reach them, and the writes follow the
+ * chain (create_chain) instead of allocating.  A file without clusters gets
+ * a single run from f_expand, so it is laid out contiguously.  A file with
+ * clusters, or a volume without such a run, has its chain extended as a
+ * seek past the end does, then the size and position are put back.
+ */
+int fat_fallocate(struct fs_fd* file, off_t len) {
+    struct fat_file *ff = file->data;
+    FIL *fil = &ff->fil;
+    FSIZE_t pos, size;
+    int retval;
+
+    if (!(fil->flag & FA_WRITE))
+        return -FR_DENIED;
+    if ((retval = fat_wb_flush(file)) != 0)
+        return retval;
+    if ((FSIZE_t)len <= fil->obj.objsize)
+        return 0;
+
+    fat_clmt_drop(ff);
+    pos = fil->fptr;
+    size = fil->obj.objsize;
+    retval = fil->obj.sclust ? FR_DENIED : f_expand(fil, len, 1);
+    if (retval == FR_DENIED && !(retval = f_lseek(fil, len)) && fil->fptr < (FSIZE_t)len)
+        retval = FR_NOT_ENABLED;    /* Volume full, f_lseek stops short */
+    fil->obj.objsize = size;
+    if (!retval)
+        retval = f_lseek(fil, pos);
+    if (retval)
+        return -retval;
+
+    if ((file->fs->flags & MNT_SYNC) && (retval = f_sync(fil)))
+        return -retval;
+    return 0;
+}
+
+int fat_ioctl(struct fs_fd* file, int cmd, void *args) {
+    struct fat_file *ff = file->data;
+    int retval;
+
+    switch (cmd) {
+    case FIO_FASTSEEK:
+        if (!args)
+            return -FR_INVALID_PARAMETER;
+        if (!*(int *)args) {
+            fat_clmt_drop(ff);
+            return 0;
+        }
+        if ((retval = fat_clmt_build(ff)) != 0)
+            return retval;
+        return (ff->clmt[0] - 2) / 2;
+    }
+    return -FR_INVALID_PARAMETER;
+}
+
+int fat_unlink(struct fs_dev *fs, const char *pathname) {
+    char path[FAT_PATH_MAX];
+    return -f_unlink(fat_path(fs, pathname, path));
 }
 
-int fat_unlink(const char *pathname) {
-    return -f_unlink(pathname);
+int fat_mkdir(struct fs_dev *fs, const char *pathname) {
+    char path[FAT_PATH_MAX];
+    return -f_mkdir(fat_path(fs, pathname, path));
 }
 
-int fat_opendir(DIR *dir, const char *pathname) {
-    return -f_opendir(dir, pathname);
+int fat_opendir(struct fs_dev *fs, DIR *dir, const char *pathname) {
+    char path[FAT_PATH_MAX];
+    return -f_opendir(dir, fat_path(fs, pathname, path));
 }
 
 int fat_readdir(DIR *dir,  FILINFO *fno) {
@@ -123,20 +578,27 @@ int fat_closedir(DIR *dir) {
     return -f_closedir(dir);
 }
 
-int fat_stat(const char *pathname, FILINFO *fno) {
-    return -f_stat(pathname, fno);
+int fat_stat(struct fs_dev *fs, const char *pathname, FILINFO *fno) {
+    char path[FAT_PATH_MAX];
+    return -f_stat(fat_path(fs, pathname, path), fno);
 }
 
 struct fs_ops elmfat_ops = {
     .dev_name = "elmfat",
     .mount = fat_mount,
+    .unmount = fat_unmount,
     .mkfs = fat_mkfs,
     .open = fat_open,
     .close = fat_close,
     .read = fat_read,
     .write = fat_write,
+    .flush = fat_flush,
+    .syncfs = fat_syncfs,
     .lseek = fat_lseek,
+    .fallocate = fat_fallocate,
+    .ioctl = fat_ioctl,
     .unlink = fat_unlink,
+    .mkdir = fat_mkdir,
     .opendir = fat_opendir,
     .readdir = fat_readdir,
     .closedir = fat_closedir,
@@ -0,0 +1,98 @@
+/* Submission/completion ring, batched file I/O for one trap.
+ *
+ * io_setup() maps a page holding struct io_ring into the calling task at
+ * USR_IORING, the kernel reaches the same page through its kernel address.
+ * The task queues any number of requests in the ring, then one io_submit()
+ * takes them and runs each through the same sys_* entry points as the
+ * single system calls, posting a completion per request.
+ *
+ * This is batching, not asynchronous I/O: the kernel is not preempted and
+ * the drivers finish a request before returning, so io_submit() runs the
+ * requests itself and every one it took has completed when it returns.
+ * What the ring buys is one int 0x30 for a whole batch instead of one per
+ * request.
+ */
+
+#include <inc/stdio.h>
+#include <inc/syscall.h>
+#include <fs.h>
+#include <kernel/task.h>
+#include <kernel/cpu.h>
+#include <kernel/mem.h>
+
+int sys_io_setup(struct io_ring **ring)
+{
+    Task *cur = thiscpu->cpu_task;
+    struct PageInfo *pp;
+
+    if (!ring || !cur)
+        return -STATUS_EINVAL;
+    if (!cur->ring) {
+        if (!(pp = page_alloc(ALLOC_ZERO)))
+            return -STATUS_ENOMEM;
+        if (page_insert(cur->pgdir, pp, (void *)USR_IORING, PTE_W | PTE_U) < 0) {
+            page_free(pp);
+            return -STATUS_ENOMEM;
+        }
+        cur->ring = page2kva(pp);
+    }
+    *ring = (struct io_ring *)USR_IORING;
+    return 0;
+}
+
+/* Runs with the task's page directory loaded, addresses are the task's */
+static int io_ring_exec(const struct io_sqe *sqe)
+{
+    switch (sqe->opcode) {
+    case IORING_OP_NOP:
+        return 0;
+    case IORING_OP_OPEN:
+        return sys_open(sqe->addr, sqe->len, 0);
+    case IORING_OP_CLOSE:
+        return sys_close(sqe->fd);
+    case IORING_OP_READ:
+        if (sqe->off == -1)
+            return sys_read(sqe->fd, sqe->addr, sqe->len);
+        return sys_pread(sqe->fd, sqe->addr, sqe->len, sqe->off);
+    case IORING_OP_WRITE:
+        if (sqe->off == -1)
+            return sys_write(sqe->fd, sqe->addr, sqe->len);
+        return sys_pwrite(sqe->fd, sqe->addr, sqe->len, sqe->off);
+    case IORING_OP_FSYNC:
+        return sys_fsync(sqe->fd);
+    }
+    return -STATUS_EINVAL;
+}
+
+/* Take and run up to to_submit requests, as long as their completions fit.
+ * The entry is copied first, the task may refill the slot once sq_head
+ * moves.  Returns how many were taken, all of them completed.
+ */
+int sys_io_submit(unsigned int to_submit)
+{
+    struct io_ring *r = thiscpu->cpu_task ? thiscpu->cpu_task->ring : NULL;
+    struct io_sqe sqe;
+    struct io_cqe *cqe;
+    unsigned int n;
+
+    if (!r)
+        return -STATUS_EINVAL;
+    if (r->sq_tail - r->sq_head > IORING_SQ_ENTRIES)
+        return -STATUS_EINVAL;      /* The task broke the ring */
+
+    for (n = 0; n < to_submit && r->sq_head != r->sq_tail; n++) {
+        if (r->cq_tail - r->cq_head >= IORING_CQ_ENTRIES)
+            break;                  /* Completions have to be reaped first */
+        sqe = r->sqes[r->sq_head % IORING_SQ_ENTRIES];
+        r->sq_head++;
+
+        cqe = &r->cqes[r->cq_tail % IORING_CQ_ENTRIES];
+        cqe->user_data = sqe.user_data;
+        cqe->res = io_ring_exec(&sqe);
+        __asm __volatile("" ::: "memory");  /* Fill the entry before it is posted */
+        r->cq_tail++;
+    }
+    if (!n && to_submit && r->sq_head != r->sq_tail)
+        return -STATUS_EBUSY;
+    return n;
+}
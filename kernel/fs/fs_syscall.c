@@ -3,18 +3,23 @@
 
 // It's handel the file system APIs 
 #include <inc/stdio.h>
+#include <inc/string.h>
 #include <inc/syscall.h>
 #include <fs.h>
 #include <kernel/fs/fat/ff.h>
+#include <kernel/fs/fat/diskio.h>
+#include <kernel/drv/blk.h>
 
 /*TODO: Lab7, file I/O system call interface.*/
 /*Note: Here you need handle the file system call from user.
  *       1. When user open a new file, you can use the fd_new() to alloc a file object(struct fs_fd)
+ *          and a descriptor in the calling task's table.
  *       2. When user R/W or seek the file, use the fd_get() to get file object.
  *       3. After get file object call file_* functions into VFS level
  *       4. Update the file objet's position or size when user R/W or seek the file.(You can find the useful marco in ff.h)
- *       5. Remember to use fd_put() to put file object back after user R/W, seek or close the file.
- *       6. Handle the error code, for example, if user call open() but no fd slot can be use, sys_open should return -STATUS_ENOSPC.
+ *       5. Remember to use fd_put() to put file object back after user R/W or seek the file,
+ *          close takes the descriptor out with fd_remove() and puts the table's reference.
+ *       6. Handle the error code, for example, if user call open() but no fd slot can be use, sys_open should return -STATUS_EMFILE.
  *
  *  Call flow example:
  *        ┌──────────────┐
@@ -46,95 +51,204 @@
  *        └──────────────┘
  */
 
-extern struct fs_fd fd_table[FS_FD_MAX];
 // Below is POSIX like I/O system call 
 int sys_open(const char *file, int flags, int mode) {
     //We dont care the mode.
-    /* TODO */
+    struct fs_fd *f;
+    int fd, retval;
+
     if (!file)
         return -STATUS_EINVAL;
 
-    int fd = fd_new();
-    if (fd == -1)
+    fd = fd_new();
+    if (fd < 0)
         return fd;
-        //return -STATUS_ENOSPC;
 
-    int retval = file_open(&fd_table[fd], file, flags);
+    f = fd_get(fd);
+    retval = file_open(f, file, flags);
     if (retval < 0) {
-        sys_close(fd);
+        f->fs = NULL;   /* nothing to close */
+        fd_put(f);
+        fd_put(fd_remove(fd));
         return retval;
     }
 
-    fd_table[fd].size = ((FIL*)fd_table[fd].data)->obj.objsize;
+    fd_put(f);
     return fd;
 }
 
 int sys_close(int fd) {
-    /* TODO */
-    if (fd < 0 || fd >= FS_FD_MAX)
-        return -STATUS_EINVAL;
+    struct fs_fd *f = fd_remove(fd);
 
-    int retval;
-    if (fd_table[fd].ref_count == 1) {
-        fd_table[fd].size = 0;
-        fd_table[fd].pos = 0;
-        memset(fd_table[fd].path, 0, sizeof(fd_table[fd].path));
-        retval = file_close(&fd_table[fd]);
-    }
-    fd_put(&fd_table[fd]);
-    return retval;
+    if (!f)
+        return -STATUS_EINVAL;
+    /* The last reference closes the file */
+    return fd_put(f);
 }
 
 int sys_read(int fd, void *buf, size_t len) {
-    /* TODO */
+    struct fs_fd *f;
+    int retval;
+
     if (len < 0 || !buf)
         return -STATUS_EINVAL;
-    if (fd < 0 || fd >= FS_FD_MAX)
+    if (!(f = fd_get(fd)))
         return -STATUS_EBADF;
 
-    int actual_len = fd_table[fd].size - fd_table[fd].pos;
-    if (len > actual_len)
-        return file_read(&fd_table[fd], buf, actual_len);
-    return file_read(&fd_table[fd], buf, len);
+    retval = file_read(f, buf, len);
+    fd_put(f);
+    return retval;
 }
 
 int sys_write(int fd, const void *buf, size_t len) {
-    /* TODO */
+    struct fs_fd *f;
+    int retval;
+
     if (len < 0 || !buf)
         return -STATUS_EINVAL;
-    if (fd < 0 || fd >= FS_FD_MAX)
+    if (!(f = fd_get(fd)))
         return -STATUS_EBADF;
-    int retval = file_write(&fd_table[fd], buf, len);
-    fd_table[fd].size = ((FIL*)fd_table[fd].data)->obj.objsize;
+    retval = file_write(f, buf, len);
+    fd_put(f);
     return retval;
 }
 
-/* Note: Check the whence parameter and calcuate the new offset value before do file_seek() */
-off_t sys_lseek(int fd, off_t offset, int whence) {
-    /* TODO */
-    if (offset < 0 || whence < 0 || fd < 0 || fd >= FS_FD_MAX)
-        return -STATUS_EINVAL;
-
-    int new_offset = 0;
-    switch(whence) {
-        case SEEK_SET:
-            new_offset = offset;
-            break;
-        case SEEK_CUR:
-            new_offset = fd_table[fd].pos + offset;
-            break;
-        case SEEK_END:
-            new_offset = fd_table[fd].size + offset;
-            break;
+/* Explicit offset, the file position stays where it is */
+int sys_pread(int fd, void *buf, size_t len, off_t offset) {
+    struct fs_fd *f;
+    int retval;
+
+    if (!buf || offset < 0)
+        return -STATUS_EINVAL;
+    if (!(f = fd_get(fd)))
+        return -STATUS_EBADF;
+    retval = file_pread(f, buf, len, offset);
+    fd_put(f);
+    return retval;
+}
+
+int sys_pwrite(int fd, const void *buf, size_t len, off_t offset) {
+    struct fs_fd *f;
+    int retval;
+
+    if (!buf || offset < 0)
+        return -STATUS_EINVAL;
+    if (!(f = fd_get(fd)))
+        return -STATUS_EBADF;
+    retval = file_pwrite(f, buf, len, offset);
+    fd_put(f);
+    return retval;
+}
+
+int sys_readv(int fd, const struct iovec *iov, int iovcnt) {
+    struct fs_fd *f;
+    int retval;
+
+    if (!iov || iovcnt < 0 || iovcnt > IOV_MAX)
+        return -STATUS_EINVAL;
+    if (!(f = fd_get(fd)))
+        return -STATUS_EBADF;
+    retval = file_readv(f, iov, iovcnt);
+    fd_put(f);
+    return retval;
+}
+
+int sys_writev(int fd, const struct iovec *iov, int iovcnt) {
+    struct fs_fd *f;
+    int retval;
+
+    if (!iov || iovcnt < 0 || iovcnt > IOV_MAX)
+        return -STATUS_EINVAL;
+    if (!(f = fd_get(fd)))
+        return -STATUS_EBADF;
+    retval = file_writev(f, iov, iovcnt);
+    fd_put(f);
+    return retval;
+}
+
+/* Copy len bytes from fd_in's position to fd_out's in the kernel, returns
+ * the bytes copied, 0 at the end of fd_in.
+ */
+int sys_copy_file_range(int fd_in, int fd_out, size_t len) {
+    struct fs_fd *in, *out;
+    int retval;
+
+    if (!(in = fd_get(fd_in)))
+        return -STATUS_EBADF;
+    if (!(out = fd_get(fd_out))) {
+        fd_put(in);
+        return -STATUS_EBADF;
     }
+    retval = file_copy_range(in, out, len);
+    fd_put(out);
+    fd_put(in);
+    return retval;
+}
+
+/* Note: Check the whence parameter, file_lseek() calculates the new offset
+ *       under the file lock.
+ */
+off_t sys_lseek(int fd, off_t offset, int whence) {
+    struct fs_fd *f;
+    off_t retval;
 
-    fd_table[fd].pos = new_offset;
-    int retval = file_lseek(&fd_table[fd], new_offset);
-    if (!retval)
-        return new_offset;
+    if (offset < 0 || whence < 0)
+        return -STATUS_EINVAL;
+    if (!(f = fd_get(fd)))
+        return -STATUS_EINVAL;
+    retval = file_lseek(f, offset, whence);
+    fd_put(f);
     return retval;
 }
 
+/* Preallocate the file up to len bytes, see fat_fallocate() */
+int sys_fallocate(int fd, off_t len) {
+    struct fs_fd *f;
+    int retval;
+
+    if (len <= 0)
+        return -STATUS_EINVAL;
+    if (!(f = fd_get(fd)))
+        return -STATUS_EBADF;
+    retval = file_fallocate(f, len);
+    fd_put(f);
+    return retval;
+}
+
+int sys_fsync(int fd) {
+    struct fs_fd *f;
+    int retval;
+
+    if (!(f = fd_get(fd)))
+        return -STATUS_EBADF;
+    retval = file_fsync(f);
+    fd_put(f);
+    return retval;
+}
+
+int sys_ioctl(int fd, int cmd, void *arg) {
+    struct fs_fd *f;
+    int retval;
+
+    if (!(f = fd_get(fd)))
+        return -STATUS_EBADF;
+    retval = file_ioctl(f, cmd, arg);
+    fd_put(f);
+    return retval;
+}
+
+int sys_sync(void) {
+    return fs_sync();
+}
+
+int sys_iostat(int dev, struct disk_stat *st) {
+    if (!st)
+        return -STATUS_EINVAL;
+    if (disk_get_stat(dev, st) < 0)
+        return -STATUS_ENODEV;
+    return 0;
+}
+
 int sys_unlink(const char *pathname) {
     /* TODO */ 
     if (!pathname)
@@ -142,6 +256,46 @@ int sys_unlink(const char *pathname) {
     return file_unlink(pathname);
 }
 
+/* source names the block device, file systems in memory don't need one */
+int sys_mount(const char *source, const char *target, const char *fstype, int flags) {
+    struct fs_mount_args args = { BLK_MAX, flags };
+    int i;
+
+    if (!target || !fstype)
+        return -STATUS_EINVAL;
+    if (source && source[0]) {
+        for (i = 0; i < blk_count() && strcmp(blk_get(i)->name, source); i++);
+        if (i == blk_count())
+            return -STATUS_ENODEV;
+        args.dev_id = i;
+    }
+    return fs_mount(fstype, target, &args);
+}
+
+int sys_umount(const char *target) {
+    if (!target)
+        return -STATUS_EINVAL;
+    return fs_umount(target);
+}
+
+int sys_statfs(const char *path, struct statfs *buf) {
+    if (!path || !buf)
+        return -STATUS_EINVAL;
+    return file_statfs(path, buf);
+}
+
+int sys_getfsstat(struct statfs *buf, int count) {
+    if (!buf || count < 0)
+        return -STATUS_EINVAL;
+    return fs_getfsstat(buf, count);
+}
+
+int sys_mkdir(const char *pathname) {
+    if (!pathname)
+        return -STATUS_EINVAL;
+    return file_mkdir(pathname);
+}
+
 int sys_opendir(DIR *dir, const char *pathname) {
     return file_opendir(dir, pathname);
 }
@@ -150,6 +304,18 @@ int sys_readdir(DIR *dir, FILINFO *fno) {
     return file_readdir(dir, fno);
 }
 
+int sys_getdents(DIR *dir, struct dirent *dirp, unsigned int count) {
+    if (!dirp)
+        return -STATUS_EINVAL;
+    return file_getdents(dir, dirp, count, 0);
+}
+
+int sys_readdirplus(DIR *dir, struct dirent_plus *dirp, unsigned int count) {
+    if (!dirp)
+        return -STATUS_EINVAL;
+    return file_getdents(dir, dirp, count, 1);
+}
+
 int sys_closedir(DIR *dir) {
     return file_closedir(dir);
 }
@@ -0,0 +1,615 @@
+/* tmpfs, a file system that lives in memory only.
+ *
+ * Files keep their data in a two level page list (an index page of index
+ * pages of data pages, allocated as they are written), directories keep
+ * their entries in a hash table page.  Nothing is written anywhere, so
+ * flush and syncfs have nothing to do and everything is gone at reboot.
+ *
+ * Like the other fs_ops, these functions return negative FRESULT codes,
+ * the VFS converts them to -STATUS_*.
+ */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <fs.h>
+#include <kernel/mem.h>
+#include <kernel/spinlock.h>
+
+#define TMPFS_SIZE_MB       32      /* Data and index pages per mount */
+#define TMP_NAME_MAX        12      /* FILINFO.fname is 8.3 sized */
+#define TMP_PTRS_PER_PAGE   (PGSIZE / sizeof(void *))
+#define TMP_DIR_HASH        TMP_PTRS_PER_PAGE
+#define TMP_MAX_MNT         4
+
+struct tmp_sb;
+
+struct tmp_node
+{
+    char name[TMP_NAME_MAX + 1];
+    uint8_t attr;                   /* AM_DIR or AM_ARC, 0 if free */
+    uint16_t gen;                   /* Tells a reused node from the old one */
+    uint32_t mtime;                 /* get_fattime() of the last change */
+    size_t size;                    /* File: bytes, directory: entries */
+    int opens;                      /* Open files on it */
+    int writing;                    /* One of them is open for writing */
+    struct spinlock lock;           /* File data: index, pages, size, mtime */
+
+    struct tmp_sb *sb;
+    struct tmp_node *parent;
+    struct tmp_node *hnext;         /* Hash chain in parent, free list */
+    uint8_t ***index;               /* File data pages */
+    struct tmp_node **hash;         /* Directory entries */
+};
+
+#define TMP_NODES_PER_PAGE  ((PGSIZE - sizeof(void *)) / sizeof(struct tmp_node))
+
+struct tmp_node_page
+{
+    struct tmp_node_page *next;
+    struct tmp_node nodes[TMP_NODES_PER_PAGE];
+};
+
+/* Mounted instance, fs_dev.data points to it */
+struct tmp_sb
+{
+    int used;
+    struct tmp_node *root;
+    uint32_t pages;                 /* Data and index pages in use */
+};
+
+static struct tmp_sb tmp_sbs[TMP_MAX_MNT];
+static struct tmp_node_page *tmp_node_pages;
+static struct tmp_node *tmp_free_nodes;
+static uint16_t tmp_gen;
+
+/* The names, the nodes and the page counts are under tmp_lock, a file's
+ * data under the lock of its node.  A node lock is taken before tmp_lock,
+ * never under it: truncation runs under tmp_lock only, on files nobody has
+ * open, and stat and readdir read a file's size and mtime unlocked.
+ */
+static struct spinlock tmp_lock;
+static int tmp_lock_init;
+
+static void *tmp_alloc_page(void)
+{
+    struct PageInfo *pp = page_alloc(ALLOC_ZERO);
+    if (!pp)
+        return NULL;
+    pp->pp_ref++;
+    return page2kva(pp);
+}
+
+static void tmp_free_page(void *va)
+{
+    page_decref(pa2page(PADDR(va)));
+}
+
+static struct tmp_node* tmp_node_alloc(struct tmp_sb *sb, uint8_t attr, const char *name, int len)
+{
+    struct tmp_node_page *pg;
+    struct tmp_node *n;
+    int i;
+
+    if (!tmp_free_nodes) {
+        if (!(pg = tmp_alloc_page()))
+            return NULL;
+        for (i = 0; i < TMP_NODES_PER_PAGE; i++) {
+            pg->nodes[i].hnext = tmp_free_nodes;
+            tmp_free_nodes = &pg->nodes[i];
+        }
+        pg->next = tmp_node_pages;
+        tmp_node_pages = pg;
+    }
+    n = tmp_free_nodes;
+    tmp_free_nodes = n->hnext;
+
+    memset(n, 0, sizeof(*n));
+    memcpy(n->name, name, len);
+    n->attr = attr;
+    n->gen = ++tmp_gen;
+    n->mtime = get_fattime();
+    n->sb = sb;
+    spin_initlock(&n->lock);
+    return n;
+}
+
+static void tmp_node_free(struct tmp_node *n)
+{
+    n->attr = 0;
+    n->hnext = tmp_free_nodes;
+    tmp_free_nodes = n;
+}
+
+/* DIR objects come from user space, only trust a node pointer in one if it
+ * is a live directory node of ours.
+ */
+static struct tmp_node* tmp_dir_node(DIR *dir)
+{
+    struct tmp_node_page *pg;
+    struct tmp_node *n = (struct tmp_node *)dir->obj.sclust;
+
+    for (pg = tmp_node_pages; pg; pg = pg->next) {
+        if ((uintptr_t)n < (uintptr_t)pg->nodes ||
+            (uintptr_t)n >= (uintptr_t)(pg->nodes + TMP_NODES_PER_PAGE))
+            continue;
+        if (((uintptr_t)n - (uintptr_t)pg->nodes) % sizeof(*n))
+            return NULL;
+        if (n->attr != AM_DIR || n->gen != dir->obj.id || n->sb != (void *)dir->obj.fs)
+            return NULL;
+        return n;
+    }
+    return NULL;
+}
+
+/* Directory entries */
+
+static uint32_t tmp_hash(const char *name, int len)
+{
+    uint32_t h = 0;
+    while (len--)
+        h = h * 31 + (uint8_t)*name++;
+    return h % TMP_DIR_HASH;
+}
+
+static struct tmp_node* tmp_dir_find(struct tmp_node *dir, const char *name, int len)
+{
+    struct tmp_node *n;
+
+    if (!dir->hash)
+        return NULL;
+    for (n = dir->hash[tmp_hash(name, len)]; n; n = n->hnext)
+        if (!strncmp(n->name, name, len) && !n->name[len])
+            return n;
+    return NULL;
+}
+
+static int tmp_dir_add(struct tmp_node *dir, struct tmp_node *n)
+{
+    struct tmp_node **head;
+
+    if (!dir->hash && !(dir->hash = tmp_alloc_page()))
+        return -FR_NOT_ENOUGH_CORE;
+    head = &dir->hash[tmp_hash(n->name, strlen(n->name))];
+    n->hnext = *head;
+    *head = n;
+    n->parent = dir;
+    dir->size++;
+    dir->mtime = get_fattime();
+    return 0;
+}
+
+static void tmp_dir_remove(struct tmp_node *n)
+{
+    struct tmp_node *dir = n->parent;
+    struct tmp_node **pp = &dir->hash[tmp_hash(n->name, strlen(n->name))];
+
+    while (*pp != n)
+        pp = &(*pp)->hnext;
+    *pp = n->hnext;
+    dir->size--;
+    dir->mtime = get_fattime();
+}
+
+/* Resolve path (relative to the mount point).  With 'parent' set, stop at
+ * the last segment: return its directory and leave the name in *name.
+ */
+static int tmp_lookup(struct tmp_sb *sb, const char *path, struct tmp_node **node,
+                      int parent, const char **name, int *namelen)
+{
+    struct tmp_node *dir = sb->root, *n;
+    const char *seg;
+    int len;
+
+    for (;;) {
+        while (*path == '/')
+            path++;
+        if (!*path) {
+            if (parent)
+                return -FR_INVALID_NAME;    /* The root itself */
+            *node = dir;
+            return 0;
+        }
+        for (seg = path, len = 0; seg[len] && seg[len] != '/'; len++);
+        if (len > TMP_NAME_MAX)
+            return -FR_INVALID_NAME;
+        path = seg + len;
+        while (*path == '/')
+            path++;
+
+        if (parent && !*path) {
+            *node = dir;
+            *name = seg;
+            *namelen = len;
+            return 0;
+        }
+        n = tmp_dir_find(dir, seg, len);
+        if (!n)
+            return *path ? -FR_NO_PATH : -FR_NO_FILE;
+        if (*path && n->attr != AM_DIR)
+            return -FR_NO_PATH;
+        dir = n;
+    }
+}
+
+/* File data */
+
+/* Data or index page counted against the mount, NULL once it is full */
+static void* tmp_data_page(struct tmp_sb *sb)
+{
+    void *va = NULL;
+
+    spin_lock(&tmp_lock);
+    if (sb->pages < TMPFS_SIZE_MB * 256 && (va = tmp_alloc_page()))
+        sb->pages++;
+    spin_unlock(&tmp_lock);
+    return va;
+}
+
+/* Data page holding byte offset 'off', allocated when 'alloc' is set.
+ * Called with the node lock held.
+ */
+static uint8_t* tmp_page(struct tmp_node *n, size_t off, int alloc)
+{
+    uint32_t pn = off / PGSIZE;
+    uint8_t ***index, **slot;
+
+    if (pn >= TMP_PTRS_PER_PAGE * TMP_PTRS_PER_PAGE)
+        return NULL;
+    if (!n->index && (!alloc || !(n->index = tmp_data_page(n->sb))))
+        return NULL;
+    index = &n->index[pn / TMP_PTRS_PER_PAGE];
+    if (!*index && (!alloc || !(*index = tmp_data_page(n->sb))))
+        return NULL;
+    slot = &(*index)[pn % TMP_PTRS_PER_PAGE];
+    if (!*slot && alloc)
+        *slot = tmp_data_page(n->sb);
+    return *slot;
+}
+
+/* Under tmp_lock, with the file not open */
+static void tmp_truncate(struct tmp_node *n)
+{
+    int i, j;
+
+    if (n->index) {
+        for (i = 0; i < TMP_PTRS_PER_PAGE; i++) {
+            if (!n->index[i])
+                continue;
+            for (j = 0; j < TMP_PTRS_PER_PAGE; j++)
+                if (n->index[i][j]) {
+                    tmp_free_page(n->index[i][j]);
+                    n->sb->pages--;
+                }
+            tmp_free_page(n->index[i]);
+            n->sb->pages--;
+        }
+        tmp_free_page(n->index);
+        n->sb->pages--;
+        n->index = NULL;
+    }
+    n->size = 0;
+    n->mtime = get_fattime();
+}
+
+static void tmp_fill_info(struct tmp_node *n, FILINFO *fno)
+{
+    fno->fsize = n->attr == AM_DIR ? 0 : n->size;
+    fno->fdate = n->mtime >> 16;
+    fno->ftime = n->mtime & 0xFFFF;
+    fno->fattrib = n->attr;
+    strcpy(fno->fname, n->name);
+}
+
+/* Operators */
+
+int tmp_mount(struct fs_dev *fs, const void *data) {
+    struct tmp_sb *sb = NULL;
+    int i, retval = 0;
+
+    if (!tmp_lock_init) {
+        spin_initlock(&tmp_lock);
+        tmp_lock_init = 1;
+    }
+    spin_lock(&tmp_lock);
+    for (i = 0; i < TMP_MAX_MNT && !sb; i++)
+        if (!tmp_sbs[i].used)
+            sb = &tmp_sbs[i];
+    if (!sb)
+        retval = -FR_TOO_MANY_OPEN_FILES;
+    else if (!(sb->root = tmp_node_alloc(sb, AM_DIR, "", 0)))
+        retval = -FR_NOT_ENOUGH_CORE;
+    else {
+        sb->used = 1;
+        sb->pages = 0;
+        fs->data = sb;
+    }
+    spin_unlock(&tmp_lock);
+    return retval;
+}
+
+/* The VFS only unmounts with no file open, free every node of the mount */
+int tmp_unmount(struct fs_dev *fs) {
+    struct tmp_sb *sb = fs->data;
+    struct tmp_node_page *pg;
+    struct tmp_node *n;
+    int i;
+
+    spin_lock(&tmp_lock);
+    for (pg = tmp_node_pages; pg; pg = pg->next)
+        for (i = 0; i < TMP_NODES_PER_PAGE; i++) {
+            n = &pg->nodes[i];
+            if (!n->attr || n->sb != sb)
+                continue;
+            if (n->attr == AM_DIR) {
+                if (n->hash)
+                    tmp_free_page(n->hash);
+            } else
+                tmp_truncate(n);
+            tmp_node_free(n);
+        }
+    sb->used = 0;
+    spin_unlock(&tmp_lock);
+    return 0;
+}
+
+/* Blocks are pages, the mount may use TMPFS_SIZE_MB of them as long as the
+ * page allocator has them.
+ */
+int tmp_statfs(struct fs_dev *fs, struct statfs *buf) {
+    struct tmp_sb *sb = fs->data;
+    uint32_t avail = sys_get_num_free_page();
+
+    buf->f_bsize = PGSIZE;
+    buf->f_blocks = TMPFS_SIZE_MB * 256;
+    buf->f_bfree = buf->f_blocks - sb->pages;
+    if (buf->f_bfree > avail)
+        buf->f_bfree = avail;
+    return 0;
+}
+
+/* Open files with these flags may change the size */
+#define TMP_WRITE_FLAGS     (O_WRONLY | O_RDWR | O_TRUNC)
+
+/* Flags map as in fat_open(): O_CREAT alone creates a new file only.  As
+ * with FatFs' file lock, a file open for writing can't be opened again and
+ * an open file can't be opened for writing, so every open file has the
+ * size the VFS clamps reads and seeks with.
+ */
+int tmp_open(struct fs_fd *file) {
+    struct tmp_sb *sb = file->fs->data;
+    struct tmp_node *dir, *n;
+    const char *name;
+    int len, retval;
+
+    spin_lock(&tmp_lock);
+    retval = tmp_lookup(sb, file->path, &dir, 1, &name, &len);
+    if (retval)
+        goto out;
+    n = tmp_dir_find(dir, name, len);
+    if (n && n->attr == AM_DIR)
+        retval = -FR_NO_FILE;
+    else if (n && (file->flags & O_CREAT) && !(file->flags & O_TRUNC))
+        retval = -FR_EXIST;
+    else if (n && (n->writing || (n->opens && (file->flags & TMP_WRITE_FLAGS))))
+        retval = -FR_LOCKED;
+    else if (!n && !(file->flags & O_CREAT))
+        retval = -FR_NO_FILE;
+    else if (!n) {
+        if (!(n = tmp_node_alloc(sb, AM_ARC, name, len)))
+            retval = -FR_NOT_ENOUGH_CORE;
+        else if ((retval = tmp_dir_add(dir, n)) != 0)
+            tmp_node_free(n);
+    } else if (file->flags & O_TRUNC)
+        tmp_truncate(n);
+    if (retval)
+        goto out;
+
+    n->opens++;
+    if (file->flags & TMP_WRITE_FLAGS)
+        n->writing = 1;
+    file->data = n;
+    file->size = n->size;
+    if (file->flags & O_APPEND)
+        file->pos = n->size;
+out:
+    spin_unlock(&tmp_lock);
+    return retval;
+}
+
+int tmp_close(struct fs_fd *file) {
+    struct tmp_node *n = file->data;
+
+    spin_lock(&tmp_lock);
+    n->opens--;
+    if (file->flags & TMP_WRITE_FLAGS)
+        n->writing = 0;
+    spin_unlock(&tmp_lock);
+    return 0;
+}
+
+int tmp_read(struct fs_fd *file, void *buf, size_t count) {
+    struct tmp_node *n = file->data;
+    uint8_t *dst = buf, *page;
+    size_t off = file->pos, len, done = 0;
+
+    spin_lock(&n->lock);
+    if (off >= n->size)
+        count = 0;
+    else if (count > n->size - off)
+        count = n->size - off;
+    for (; done < count; done += len, off += len) {
+        len = MIN(count - done, PGSIZE - off % PGSIZE);
+        if ((page = tmp_page(n, off, 0)))
+            memcpy(dst + done, page + off % PGSIZE, len);
+        else
+            memset(dst + done, 0, len);     /* A hole */
+    }
+    spin_unlock(&n->lock);
+
+    file->pos += done;
+    return done;
+}
+
+/* Out of pages the write comes up short, like a full FAT volume */
+int tmp_write(struct fs_fd *file, const void *buf, size_t count) {
+    struct tmp_node *n = file->data;
+    const uint8_t *src = buf;
+    uint8_t *page;
+    size_t off = file->pos, len, done = 0;
+
+    spin_lock(&n->lock);
+    for (; done < count; done += len, off += len) {
+        len = MIN(count - done, PGSIZE - off % PGSIZE);
+        if (!(page = tmp_page(n, off, 1)))
+            break;
+        memcpy(page + off % PGSIZE, src + done, len);
+    }
+    if (off > n->size)
+        n->size = off;
+    if (done)
+        n->mtime = get_fattime();
+    file->size = n->size;
+    spin_unlock(&n->lock);
+
+    file->pos += done;
+    return done;
+}
+
+int tmp_flush(struct fs_fd *file) {
+    return 0;
+}
+
+int tmp_syncfs(struct fs_dev *fs) {
+    return 0;
+}
+
+/* The VFS has set file->pos already, the gap past the end stays a hole */
+int tmp_lseek(struct fs_fd *file, off_t offset) {
+    return 0;
+}
+
+/* An open file can't be removed and a directory only when empty, as FatFs */
+int tmp_unlink(struct fs_dev *fs, const char *pathname) {
+    struct tmp_node *n;
+    int retval;
+
+    spin_lock(&tmp_lock);
+    retval = tmp_lookup(fs->data, pathname, &n, 0, NULL, NULL);
+    if (!retval && n == ((struct tmp_sb *)fs->data)->root)
+        retval = -FR_INVALID_NAME;
+    else if (!retval && n->opens)
+        retval = -FR_LOCKED;
+    else if (!retval && n->attr == AM_DIR && n->size)
+        retval = -FR_DENIED;
+    if (!retval) {
+        tmp_dir_remove(n);
+        if (n->attr == AM_DIR) {
+            if (n->hash)
+                tmp_free_page(n->hash);
+        } else
+            tmp_truncate(n);
+        tmp_node_free(n);
+    }
+    spin_unlock(&tmp_lock);
+    return retval;
+}
+
+int tmp_mkdir(struct fs_dev *fs, const char *pathname) {
+    struct tmp_node *dir, *n;
+    const char *name;
+    int len, retval;
+
+    spin_lock(&tmp_lock);
+    retval = tmp_lookup(fs->data, pathname, &dir, 1, &name, &len);
+    if (!retval && tmp_dir_find(dir, name, len))
+        retval = -FR_EXIST;
+    else if (!retval && !(n = tmp_node_alloc(fs->data, AM_DIR, name, len)))
+        retval = -FR_NOT_ENOUGH_CORE;
+    else if (!retval && (retval = tmp_dir_add(dir, n)) != 0)
+        tmp_node_free(n);
+    spin_unlock(&tmp_lock);
+    return retval;
+}
+
+/* The DIR keeps the node, its generation and the position in the hash
+ * table: bucket in clust, entry of the chain in dptr.  obj.fs is the
+ * mount's data, which is how the VFS finds the mount back.
+ */
+int tmp_opendir(struct fs_dev *fs, DIR *dir, const char *pathname) {
+    struct tmp_node *n;
+    int retval;
+
+    spin_lock(&tmp_lock);
+    retval = tmp_lookup(fs->data, pathname, &n, 0, NULL, NULL);
+    if (!retval && n->attr != AM_DIR)
+        retval = -FR_NO_PATH;
+    if (!retval) {
+        memset(dir, 0, sizeof(*dir));
+        dir->obj.fs = fs->data;
+        dir->obj.id = n->gen;
+        dir->obj.sclust = (DWORD)n;
+    }
+    spin_unlock(&tmp_lock);
+    return retval;
+}
+
+/* The end of the directory reads as an empty name, as f_readdir() */
+int tmp_readdir(DIR *dir, FILINFO *fno) {
+    struct tmp_node *d, *n = NULL;
+    uint32_t i;
+
+    spin_lock(&tmp_lock);
+    if (!(d = tmp_dir_node(dir))) {
+        spin_unlock(&tmp_lock);
+        return -FR_INVALID_OBJECT;
+    }
+    for (; d->hash && dir->clust < TMP_DIR_HASH; dir->clust++, dir->dptr = 0) {
+        for (n = d->hash[dir->clust], i = 0; n && i < dir->dptr; n = n->hnext, i++);
+        if (n)
+            break;
+    }
+    if (n) {
+        tmp_fill_info(n, fno);
+        dir->dptr++;
+    } else
+        fno->fname[0] = '\0';
+    spin_unlock(&tmp_lock);
+    return 0;
+}
+
+int tmp_closedir(DIR *dir) {
+    dir->obj.fs = NULL;
+    return 0;
+}
+
+int tmp_stat(struct fs_dev *fs, const char *pathname, FILINFO *fno) {
+    struct tmp_node *n;
+    int retval;
+
+    spin_lock(&tmp_lock);
+    retval = tmp_lookup(fs->data, pathname, &n, 0, NULL, NULL);
+    if (!retval)
+        tmp_fill_info(n, fno);
+    spin_unlock(&tmp_lock);
+    return retval;
+}
+
+struct fs_ops tmpfs_ops = {
+    .dev_name = "tmpfs",
+    .mount = tmp_mount,
+    .unmount = tmp_unmount,
+    .statfs = tmp_statfs,
+    .open = tmp_open,
+    .close = tmp_close,
+    .read = tmp_read,
+    .write = tmp_write,
+    .flush = tmp_flush,
+    .syncfs = tmp_syncfs,
+    .lseek = tmp_lseek,
+    .unlink = tmp_unlink,
+    .mkdir = tmp_mkdir,
+    .opendir = tmp_opendir,
+    .readdir = tmp_readdir,
+    .closedir = tmp_closedir,
+    .stat = tmp_stat
+};
@@ -2,6 +2,7 @@
 #include <inc/kbd.h>
 #include <inc/shell.h>
 #include <inc/x86.h>
+#include <inc/multiboot.h>
 #include <kernel/mem.h>
 #include <kernel/trap.h>
 #include <kernel/picirq.h>
@@ -15,6 +16,8 @@
 extern void fs_test();
 extern void init_video(void);
 extern int disk_init();
+extern void blk_init();
+extern int pci_init();
 extern void disk_test();
 static void boot_aps(void);
 
@@ -23,11 +26,18 @@ void kernel_main(void)
     extern char stext[];
     extern char etext[], end[], data_start[],rdata_end[];
     extern void task_job();
+    uint64_t boot_tsc = *(uint64_t *)(KERNBASE + BOOT_TSC_PADDR); // before mem_init, no KADDR
+    uint64_t main_tsc = read_tsc();
 
     init_video();
+    // Meaningless when something else than our boot loader started us
+    if (!multiboot_magic && boot_tsc && boot_tsc < main_tsc)
+        printk("Boot loader to kernel_main: %u Kcycles\n",
+                (uint32_t)((main_tsc - boot_tsc) / 1000));
     mem_init();
     mp_init();
     lapic_init();
+    pci_init();
     task_init();
     trap_init();
     pic_init();
@@ -36,6 +46,7 @@ void kernel_main(void)
     syscall_init();
 	disk_init();
 	disk_test();
+	blk_init();
 	/*TODO: Lab7, uncommend it when you finish Lab7 3.1 part */
 	fs_test();
 	fs_init();
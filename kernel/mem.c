@@ -5,6 +5,7 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/multiboot.h>
 
 #include <kernel/mem.h>
 #include <kernel/kclock.h>
@@ -15,6 +16,7 @@
 size_t                   npages;            // Amount of physical memory (in pages)
 static size_t            npages_basemem;    // Amount of base memory (in pages)
 static char              *nextfree;         // virtual address of next byte of free memory
+static uintptr_t         mmio_next = MMIOBASE; // next free va in the MMIO region
 
 // These variables are set in mem_init()
 pde_t                    *kern_pgdir;       // Kernel's initial page directory
@@ -33,15 +35,70 @@ nvram_read(int r)
   return mc146818_read(r) | (mc146818_read(r + 1) << 8);
 }
 
+/* Only [0, 4MB) is mapped by entry_pgdir, and KADDR can't be used yet */
+#define BOOT_KADDR(pa)  ((void *)(KERNBASE + (physaddr_t)(pa)))
+#define BOOT_MAPPED(pa, len) ((uint64_t)(pa) + (len) <= 4 * 1024 * 1024)
+
+/* Everything above 256MB would not fit in the KERNBASE mapping */
+#define MAX_PHYS_PAGES  ((0xFFFFFFFF - KERNBASE + 1) / PGSIZE)
+
+/*
+ * Size memory from the Multiboot info.  We take the available region
+ * that starts at EXTPHYSMEM, which is what NVRAM calls extended memory,
+ * but without NVRAM's 64MB limit.  Return 0 if the info is unusable.
+ */
+static int
+multiboot_detect_memory(size_t *basemem, size_t *extmem)
+{
+  struct multiboot_info *mbi;
+  uint32_t off;
+
+  if (multiboot_magic != MULTIBOOT_BOOTLOADER_MAGIC ||
+      !BOOT_MAPPED(multiboot_info_pa, sizeof(*mbi)))
+    return 0;
+  mbi = BOOT_KADDR(multiboot_info_pa);
+
+  if ((mbi->flags & MULTIBOOT_INFO_MEM_MAP) &&
+      BOOT_MAPPED(mbi->mmap_addr, mbi->mmap_length)) {
+    *basemem = *extmem = 0;
+    for (off = 0; off < mbi->mmap_length; ) {
+      struct multiboot_mmap_entry *e = BOOT_KADDR(mbi->mmap_addr + off);
+
+      if (e->type == MULTIBOOT_MEMORY_AVAILABLE) {
+        if (e->addr == 0)
+          *basemem = e->len / 1024;
+        else if (e->addr == EXTPHYSMEM)
+          *extmem = e->len / 1024;
+      }
+      off += e->size + sizeof(e->size);
+    }
+    if (*basemem && *extmem)
+      return 1;
+  }
+
+  if (mbi->flags & MULTIBOOT_INFO_MEMORY) {
+    *basemem = mbi->mem_lower;
+    *extmem = mbi->mem_upper;
+    return 1;
+  }
+  return 0;
+}
+
 static void
 i386_detect_memory(void)
 {
+  size_t basemem, extmem;
   size_t npages_extmem;
 
-  // Use CMOS calls to measure available base & extended memory.
-  // (CMOS calls return results in kilobytes.)
-  npages_basemem = (nvram_read(NVRAM_BASELO) * 1024) / PGSIZE;
-  npages_extmem = (nvram_read(NVRAM_EXTLO) * 1024) / PGSIZE;
+  // Prefer the Multiboot memory map, otherwise use CMOS calls to
+  // measure available base & extended memory.
+  // (Both report in kilobytes.)
+  if (!multiboot_detect_memory(&basemem, &extmem)) {
+    basemem = nvram_read(NVRAM_BASELO);
+    extmem = nvram_read(NVRAM_EXTLO);
+  }
+  npages_basemem = (basemem * 1024) / PGSIZE;
+  npages_extmem = (extmem * 1024) / PGSIZE;
 
   // Calculate the number of physical pages available in both base
   // and extended memory.
@@ -49,11 +106,14 @@ i386_detect_memory(void)
     npages = (EXTPHYSMEM / PGSIZE) + npages_extmem;
   else
     npages = npages_basemem;
+  if (npages > MAX_PHYS_PAGES)
+    npages = MAX_PHYS_PAGES;
 
-  printk("Physical memory: %uK available, base = %uK, extended = %uK\n",
+  printk("Physical memory: %uK available, base = %uK, extended = %uK%s\n",
       npages * PGSIZE / 1024,
       npages_basemem * PGSIZE / 1024,
-      npages_extmem * PGSIZE / 1024);
+      npages_extmem * PGSIZE / 1024,
+      multiboot_magic ? " (multiboot)" : "");
 }
 
 
@@ -627,7 +687,7 @@ mmio_map_region(physaddr_t pa, size_t size)
     // beginning of the MMIO region.  Because this is static, its
     // value will be preserved between calls to mmio_map_region
     // (just like nextfree in boot_alloc).
-    static uintptr_t base = MMIOBASE;
+    uintptr_t base = mmio_next;
 
     // Reserve size bytes of virtual memory starting at base and
     // map physical pages [pa,pa+size) to virtual addresses
@@ -653,7 +713,7 @@ mmio_map_region(physaddr_t pa, size_t size)
     boot_map_region(kern_pgdir, base, ROUNDUP(size, PGSIZE), pa, PTE_W | PTE_PCD | PTE_PWT);
 
     void *ret = (void *)base;
-    base += ROUNDUP(size, PGSIZE);
+    mmio_next = base + ROUNDUP(size, PGSIZE);
     return ret;
 }
 
@@ -680,8 +740,6 @@ setupvm(pde_t *pgdir, uint32_t start, uint32_t size)
 pde_t *
 setupkvm()
 {
-    extern uint32_t *lapic;
-    extern physaddr_t lapicaddr;
     pde_t *pgdir = NULL;
     struct PageInfo *pi = page_alloc(1);
 
@@ -690,7 +748,13 @@ setupkvm()
         boot_map_region(pgdir, UPAGES, ROUNDUP((sizeof(struct PageInfo) * npages), PGSIZE), PADDR(pages), (PTE_U | PTE_P));
         boot_map_region(pgdir, KERNBASE, ROUNDUP(0xFFFFFFFF - KERNBASE + 1, PGSIZE), 0, PTE_P | PTE_W);
         boot_map_region(pgdir, IOPHYSMEM, ROUNDUP((EXTPHYSMEM - IOPHYSMEM), PGSIZE), IOPHYSMEM, (PTE_W) | (PTE_P));
-        boot_map_region(pgdir, lapic, PGSIZE, lapicaddr, PTE_W | PTE_PWT | PTE_PCD);
+        /* Share every MMIO mapping made so far (lapic, PCI device BARs) */
+        uintptr_t va;
+        for (va = MMIOBASE; va < mmio_next; va += PGSIZE) {
+            pte_t *pte = pgdir_walk(kern_pgdir, (void *)va, 0);
+            if (pte && (*pte & PTE_P))
+                boot_map_region(pgdir, va, PGSIZE, PTE_ADDR(*pte), PTE_W | PTE_PWT | PTE_PCD);
+        }
         int i;
         for (i = 0; i < NCPU; i++)
             boot_map_region(pgdir, KSTACKTOP - (i + 1) * KSTKSIZE - i * KSTKGAP, KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_P | PTE_W);
@@ -39,6 +39,7 @@ struct PageInfo   *page_alloc             (int alloc_flags);
 struct PageInfo   *page_lookup            (pde_t *pgdir, void *va, pte_t **pte_store);
 pde_t             *setupkvm               (void);
 void              setupvm                 (pde_t *pgdir, uint32_t start, uint32_t size);
+void              *mmio_map_region        (physaddr_t pa, size_t size);
 pte_t             *pgdir_walk             (pde_t *pgdir, const void *va, int create);
 void	            tlb_invalidate          (pde_t *pgdir, void *va);
 void              mem_init                (void);
@@ -44,6 +44,7 @@ void sched_yield(void)
 {
     int queue_id;
 	extern Task tasks[];
+	extern void fs_writeback(void);
 
     if (thiscpu->cpu_task)
         queue_id = thiscpu->cpu_rq.index;
@@ -61,5 +62,8 @@ void sched_yield(void)
     thiscpu->cpu_task->remind_ticks = TIME_QUANT;
     thiscpu->cpu_rq.index = queue_id;
     lcr3(PADDR(thiscpu->cpu_task->pgdir));
+
+    /* On the way to user mode with no lock held, see fs_writeback() */
+    fs_writeback();
     ctx_switch(thiscpu->cpu_task);
 }
@@ -136,6 +136,63 @@ int32_t do_syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, ui
         case SYS_stat:
             retVal = sys_stat(a1, a2);
             break;
+        case SYS_fsync:
+            retVal = sys_fsync(a1);
+            break;
+        case SYS_sync:
+            retVal = sys_sync();
+            break;
+        case SYS_iostat:
+            retVal = sys_iostat(a1, (struct disk_stat *)a2);
+            break;
+        case SYS_ioctl:
+            retVal = sys_ioctl(a1, a2, (void *)a3);
+            break;
+        case SYS_mkdir:
+            retVal = sys_mkdir((const char *)a1);
+            break;
+        case SYS_mount:
+            retVal = sys_mount((const char *)a1, (const char *)a2, (const char *)a3, a4);
+            break;
+        case SYS_umount:
+            retVal = sys_umount((const char *)a1);
+            break;
+        case SYS_getdents:
+            retVal = sys_getdents((DIR *)a1, (struct dirent *)a2, a3);
+            break;
+        case SYS_readdirplus:
+            retVal = sys_readdirplus((DIR *)a1, (struct dirent_plus *)a2, a3);
+            break;
+        case SYS_pread:
+            retVal = sys_pread(a1, (void *)a2, a3, a4);
+            break;
+        case SYS_pwrite:
+            retVal = sys_pwrite(a1, (const void *)a2, a3, a4);
+            break;
+        case SYS_readv:
+            retVal = sys_readv(a1, (const struct iovec *)a2, a3);
+            break;
+        case SYS_writev:
+            retVal = sys_writev(a1, (const struct iovec *)a2, a3);
+            break;
+        case SYS_io_setup:
+            retVal = sys_io_setup((struct io_ring **)a1);
+            break;
+        case SYS_io_submit:
+            retVal = sys_io_submit(a1);
+            break;
+        case SYS_fallocate:
+            retVal = sys_fallocate(a1, a2);
+            break;
+        case SYS_statfs:
+            retVal = sys_statfs((const char *)a1, (struct statfs *)a2);
+            break;
+        case SYS_getfsstat:
+            retVal = sys_getfsstat((struct statfs *)a1, a2);
+            break;
+        case SYS_copy_file_range:
+            retVal = sys_copy_file_range(a1, a2, a3);
+            break;
         default:
             retVal = -1;
             break;
@@ -7,6 +7,7 @@
 #include <kernel/mem.h>
 #include <kernel/cpu.h>
 #include <kernel/spinlock.h>
+#include <fs.h>
 
 // Global descriptor table.
 //
@@ -148,6 +149,8 @@ int task_create()
     else
         ts->parent_id = 0;
     ts->remind_ticks = TIME_QUANT;
+    ts->files = NULL;
+    ts->ring = NULL;
     ts->state = TASK_RUNNABLE;
 
     spin_unlock(&task_lock);
@@ -180,6 +183,10 @@ static void task_free(int pid)
     int va;
     for (va = USTACKTOP - USR_STACK_SIZE; va < USTACKTOP; va += PGSIZE)
         page_remove(tasks[pid].pgdir, va);
+    if (tasks[pid].ring) {
+        page_remove(tasks[pid].pgdir, (void *)USR_IORING);
+        tasks[pid].ring = NULL;
+    }
     ptable_remove(tasks[pid].pgdir);
     pgdir_remove(tasks[pid].pgdir);
 }
@@ -207,6 +214,7 @@ void sys_kill(int pid)
    * and invoke the scheduler for yield
    */
         tasks[pid].state = TASK_FREE;
+        fd_table_release(&tasks[pid].files);
         task_free(pid);
         if (thiscpu->cpu_task->task_id == pid) {
             thiscpu->cpu_task = NULL;
@@ -248,11 +256,19 @@ void sys_kill(int pid)
 //
 int sys_fork()
 {
+    /* The child shares the parent's open files */
+    struct fd_table *files = NULL;
+    if (thiscpu->cpu_task && fd_table_copy(&files, thiscpu->cpu_task->files) < 0)
+        return -1;
+
     /* pid for newly created process */
     /* Step 1: Create a new task.*/
     int pid = task_create();
-    if (pid == -1)
+    if (pid == -1) {
+        fd_table_release(&files);
         return -1;
+    }
+    tasks[pid].files = files;
 
     if ((uint32_t)thiscpu->cpu_task) {
         /* Step 2: Copy the trap frame from parent.
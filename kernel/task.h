@@ -17,6 +17,11 @@ typedef enum
 
 // Each task's user space
 #define USR_STACK_SIZE  (40960)
+#define USR_IORING      (USTACKTOP - USR_STACK_SIZE - 2 * PGSIZE)  // io_setup() page, a guard page above
+
+struct io_ring;
+
+struct fd_table;
 
 typedef struct
 {
@@ -26,6 +31,8 @@ typedef struct
     int32_t remind_ticks;
     TaskState state;    //Task state
     pde_t *pgdir;  //Per process Page Directory
+    struct fd_table *files; //Open files, NULL until the first open
+    struct io_ring *ring;   //I/O ring (kernel address), NULL until io_setup()
     
 } Task;
 
@@ -27,6 +27,7 @@ void set_timer(int hz)
 void timer_handler(struct Trapframe *tf)
 {
     extern void sched_yield();
+    extern void fs_writeback_tick(void);
     int id;
 
     jiffies++;
@@ -34,6 +35,12 @@ void timer_handler(struct Trapframe *tf)
     extern Task tasks[];
 
     lapic_eoi();
+
+    /* File system writeback is only marked due here, it runs on the way
+     * back to user mode.
+     */
+    if (thiscpu == bootcpu)
+        fs_writeback_tick();
     if (thiscpu->cpu_task)
     {
         /* Lab 5
@@ -57,7 +64,10 @@ void timer_handler(struct Trapframe *tf)
         }
 
         thiscpu->cpu_task->remind_ticks--;
-        if (thiscpu->cpu_task->remind_ticks <= 0) {
+        /* Drivers may halt in the kernel waiting for an interrupt,
+         * only switch tasks when we interrupted user mode.
+         */
+        if (thiscpu->cpu_task->remind_ticks <= 0 && (tf->tf_cs & 3) == 3) {
             thiscpu->cpu_task->state = TASK_RUNNABLE;
             sched_yield();
         }
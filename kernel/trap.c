@@ -142,6 +142,8 @@ env_pop_tf(struct Trapframe *tf)
 static void
 trap_dispatch(struct Trapframe *tf)
 {
+	extern void fs_writeback(void);
+
     /*       Handle specific interrupts.
      *       You need to check the interrupt number in order to tell
      *       which interrupt is currently happening since every interrupt
@@ -201,6 +203,10 @@ trap_dispatch(struct Trapframe *tf)
 		}
 		// Do ISR
 		trap_hnd[tf->tf_trapno](tf);
+
+		// Back to user mode: no lock is held, run a due file system writeback
+		if ((tf->tf_cs & 3) == 3)
+			fs_writeback();
 		
 		// Pop the kernel stack 
 		env_pop_tf(tf);
@@ -52,12 +52,31 @@ SYSCALL_1ARG(close, int, int)
 SYSCALL_3ARG(open, int, const char *, int, int)
 SYSCALL_3ARG(read, int, int, void *, size_t)
 SYSCALL_3ARG(write, int, int, const void *, size_t)
+SYSCALL_4ARG(pread, int, int, void *, size_t, off_t)
+SYSCALL_4ARG(pwrite, int, int, const void *, size_t, off_t)
+SYSCALL_3ARG(readv, int, int, const struct iovec *, int)
+SYSCALL_3ARG(writev, int, int, const struct iovec *, int)
+SYSCALL_3ARG(copy_file_range, int, int, int, size_t)
+SYSCALL_1ARG(io_setup, int, struct io_ring **)
+SYSCALL_1ARG(io_submit, int, unsigned int)
 SYSCALL_3ARG(lseek, off_t, int, off_t, int)
+SYSCALL_2ARG(fallocate, int, int, off_t)
 SYSCALL_1ARG(unlink, int, const char *)
 SYSCALL_2ARG(opendir, int, DIR *, const char *)
 SYSCALL_2ARG(readdir, int, DIR *, FILINFO *)
 SYSCALL_1ARG(closedir, int, DIR *)
 SYSCALL_2ARG(stat, int, const char *, FILINFO *)
+SYSCALL_1ARG(fsync, int, int)
+SYSCALL_NOARG(sync, int)
+SYSCALL_2ARG(iostat, int, int, struct disk_stat *)
+SYSCALL_3ARG(ioctl, int, int, int, void *)
+SYSCALL_1ARG(mkdir, int, const char *)
+SYSCALL_4ARG(mount, int, const char *, const char *, const char *, int)
+SYSCALL_1ARG(umount, int, const char *)
+SYSCALL_2ARG(statfs, int, const char *, struct statfs *)
+SYSCALL_2ARG(getfsstat, int, struct statfs *, int)
+SYSCALL_3ARG(getdents, int, DIR *, struct dirent *, unsigned int)
+SYSCALL_3ARG(readdirplus, int, DIR *, struct dirent_plus *, unsigned int)
 /////////////////////////////
 SYSCALL_NOARG(getc, int)
 SYSCALL_NOARG(getcid, int32_t)
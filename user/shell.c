@@ -31,6 +31,13 @@ int spinlocktest(int argc, char **argv);
 int ls(int argc, char **argv);
 int rm(int argc, char **argv);
 int touch(int argc, char **argv);
+int cp(int argc, char **argv);
+int mkdir_cmd(int argc, char **argv);
+int mount_cmd(int argc, char **argv);
+int umount_cmd(int argc, char **argv);
+int sync_cmd(int argc, char **argv);
+int iostat_cmd(int argc, char **argv);
+int df_cmd(int argc, char **argv);
 
 
 struct Command commands[] = {
@@ -41,15 +48,22 @@ struct Command commands[] = {
   { "forktest", "Test functionality of fork()", forktest },
   { "filetest", "Test create file", filetest },
   { "fs_seek_test", "Test seek file", fs_seek_test },
-  { "fs_speed_test", "Test R/W speed", fs_speed_test},
+  { "fs_speed_test", "Test R/W speed, optionally in a directory", fs_speed_test},
   { "filetest2", "Open test", filetest2},
   { "filetest3", "Laqrge block test", filetest3},
   { "filetest4", "Error test", filetest4},
   { "filetest5", "unlink test", filetest5},
   { "spinlocktest", "Test spinlock", spinlocktest },
-  { "ls", "Lab7 TODO: ls", ls},
+  { "ls", "List a directory: ls [-l] [path]", ls},
   { "rm", "Lab7 TODO: rm", rm},
-  { "touch", "Lab7 TODO: touch", touch}
+  { "touch", "Lab7 TODO: touch", touch},
+  { "cp", "Copy a file: cp <src> <dst>", cp},
+  { "mkdir", "Create directories", mkdir_cmd},
+  { "mount", "Mount a file system: mount <type> <device|-> <path> [sync]", mount_cmd},
+  { "umount", "Unmount the file system at a path", umount_cmd},
+  { "sync", "Flush file system buffers to disk", sync_cmd},
+  { "iostat", "Show disk I/O statistics, -h for latency histograms", iostat_cmd},
+  { "df", "Show free space: df [path]", df_cmd}
 };
 const int NCOMMANDS = (sizeof(commands)/sizeof(commands[0]));
 
@@ -192,6 +206,22 @@ int spinlocktest(int argc, char **argv)
   return 0;
 }
 #define BUFSIZE 128
+#define TEST_PATH_MAX 64
+/* The file tests work in the root directory unless a directory is given,
+ * e.g. "fs_speed_test /ram0" runs against the RAM disk.
+ */
+static const char *test_path(int argc, char **argv, const char *name)
+{
+    static char path[TEST_PATH_MAX];
+
+    if (argc < 2)
+        return name;
+    if (name[0] == '/')
+        name++;
+    snprintf(path, sizeof(path), "%s/%s", argv[1], name);
+    return path;
+}
+
 int filetest(int argc, char **argv)
 {
     int fd = -1;
@@ -199,7 +229,7 @@ int filetest(int argc, char **argv)
     char *test_str = "This is the last LAB!! Yah!";
     char buf[BUFSIZE] = {0};
 
-    if ((fd = open("hello.txt", O_WRONLY | O_CREAT | O_TRUNC, 0)) >= 0)
+    if ((fd = open(test_path(argc, argv, "hello.txt"), O_WRONLY | O_CREAT | O_TRUNC, 0)) >= 0)
     {
         cprintf("Open successed!\n");
 
@@ -214,7 +244,7 @@ int filetest(int argc, char **argv)
     else
         cprintf("Open failed! %d\n", fd);
 
-    if ((fd = open("hello.txt", O_RDONLY, 0)) >= 0)
+    if ((fd = open(test_path(argc, argv, "hello.txt"), O_RDONLY, 0)) >= 0)
     {
         cprintf("Open successed!\n");
 
@@ -235,7 +265,7 @@ int filetest2(int argc, char **argv)
     int fd[20], i;
     for (i = 0; i < 20; i++)
     {
-        fd[i] =  open("hello.txt", O_WRONLY | O_CREAT | O_TRUNC, 0);
+        fd[i] =  open(test_path(argc, argv, "hello.txt"), O_WRONLY | O_CREAT | O_TRUNC, 0);
         if (fd[i] < 0)
             cprintf("Open error, %d\n", fd[i]);
         else
@@ -256,7 +286,7 @@ int filetest3(int argc, char **argv)
 {
     int fd, i, ret;
     char larg_buf[LARGE_SIZE] = {0};
-    fd =  open("large.txt", O_RDWR | O_CREAT | O_TRUNC, 0);
+    fd =  open(test_path(argc, argv, "large.txt"), O_RDWR | O_CREAT | O_TRUNC, 0);
     if (fd >= 0)
     {
         for (i = 0; i < LARGE_SIZE; i++)
@@ -303,10 +333,10 @@ int filetest4(int argc, char **argv)
         buf[i] = i & 0xFF;
     }
 
-    fd = open("test4", O_WRONLY, 0);
+    fd = open(test_path(argc, argv, "test4"), O_WRONLY, 0);
     uassert(fd == -STATUS_ENOENT);
 
-    fd = open("test4", O_WRONLY | O_CREAT | O_TRUNC, 0);
+    fd = open(test_path(argc, argv, "test4"), O_WRONLY | O_CREAT | O_TRUNC, 0);
     uassert(fd >= STATUS_OK);
 
     ret = close(100);
@@ -315,10 +345,10 @@ int filetest4(int argc, char **argv)
     ret = close(fd);
     uassert(ret == STATUS_OK);
 
-    fd = open("test4", O_WRONLY | O_CREAT, 0);
+    fd = open(test_path(argc, argv, "test4"), O_WRONLY | O_CREAT, 0);
     uassert(fd == -STATUS_EEXIST);
 
-    fd = open("test4", O_RDWR | O_CREAT | O_TRUNC, 0);
+    fd = open(test_path(argc, argv, "test4"), O_RDWR | O_CREAT | O_TRUNC, 0);
     uassert(fd >= STATUS_OK);
 
     ret = write(fd, 0, -1);
@@ -356,22 +386,22 @@ int filetest5(int argc, char **argv)
         buf[i] = ('0'+ i )& 0xFF;
     }
 
-    ret = unlink("test5");
+    ret = unlink(test_path(argc, argv, "test5"));
     uassert(ret == -STATUS_ENOENT);
 
-    fd = open("test5", O_WRONLY | O_CREAT, 0);
+    fd = open(test_path(argc, argv, "test5"), O_WRONLY | O_CREAT, 0);
     uassert(fd >= STATUS_OK);
 
     ret = close(fd);
     uassert(ret == STATUS_OK);
 
-    ret = unlink("test5");
+    ret = unlink(test_path(argc, argv, "test5"));
     uassert(ret == STATUS_OK);
 
-    fd = open("test5", O_RDWR, 0);
+    fd = open(test_path(argc, argv, "test5"), O_RDWR, 0);
     uassert(fd == -STATUS_ENOENT); //file should be removed.
 
-    fd = open("hello.txt", O_RDWR | O_APPEND, 0);
+    fd = open(test_path(argc, argv, "hello.txt"), O_RDWR | O_APPEND, 0);
     uassert(fd >= STATUS_OK);
 
     ret = write(fd, buf, 10);
@@ -409,7 +439,7 @@ int fs_seek_test(int argc, char **argv)
     {
         buf[i] = i;
     }
-    if ((fd = open("test2.txt", O_WRONLY | O_CREAT | O_TRUNC, 0)) >= 0)
+    if ((fd = open(test_path(argc, argv, "test2.txt"), O_WRONLY | O_CREAT | O_TRUNC, 0)) >= 0)
     {
         ret = write(fd, buf, 10); // write test pattern
         if (ret == 10)
@@ -417,7 +447,7 @@ int fs_seek_test(int argc, char **argv)
         close(fd);
     }
 
-    if ((fd = open("test2.txt", O_RDWR, 0)) >= 0)
+    if ((fd = open(test_path(argc, argv, "test2.txt"), O_RDWR, 0)) >= 0)
     {
         offset = lseek(fd, 10, SEEK_END); //seek to file end + 10 bytes
         cprintf("File offset = %d\n", offset);
@@ -465,7 +495,7 @@ int fs_speed_test(int argc, char **argv)
     {
 
         /* creat file */
-        fd = open(fsrw_fn, O_WRONLY | O_CREAT | O_TRUNC, 0);
+        fd = open(test_path(argc, argv, fsrw_fn), O_WRONLY | O_CREAT | O_TRUNC, 0);
         if (fd < 0)
         {
             cprintf("fsrw open file for write failed\n");
@@ -497,7 +527,7 @@ int fs_speed_test(int argc, char **argv)
         close(fd);
 
         /* open file read only */
-        fd = open(fsrw_fn, O_RDONLY, 0);
+        fd = open(test_path(argc, argv, fsrw_fn), O_RDONLY, 0);
         if (fd < 0)
         {
             cprintf("fsrw open file for read failed\n");
@@ -538,13 +568,22 @@ int fs_speed_test(int argc, char **argv)
     }
 }
 
-/* Only support single file or path. */
+/* Only support single file or path, "-l" adds attributes and size.
+ * Entries come a buffer full per system call.
+ */
 int ls(int argc, char **argv) {
+    static char dbuf[1024];
     DIR dir;
     FILINFO fno;
-    int retval;
+    struct dirent *d;
+    struct dirent_plus *dp;
+    int retval, off, lflag = 0;
     char path[32] = {"/"};
 
+    if (argc > 1 && !strcmp(argv[1], "-l")) {
+        lflag = 1;
+        argc--, argv++;
+    }
     if (argc > 1)
         strcpy(path, argv[1]);
     retval = opendir(&dir, path);
@@ -556,15 +595,28 @@ int ls(int argc, char **argv) {
         return 0;
     }
 
-    readdir(&dir, &fno);
-    while(strlen(fno.fname)){
-        if (fno.fattrib == 32)
-            cprintf("type = FILE, name = %s, size = %d\n", fno.fname, fno.fsize);
-        else
-            cprintf("type = DIR, name = %s, size = %d\n", fno.fname, fno.fsize);
-        readdir(&dir, &fno);
+    while ((retval = lflag ? readdirplus(&dir, (struct dirent_plus *)dbuf, sizeof(dbuf))
+                           : getdents(&dir, (struct dirent *)dbuf, sizeof(dbuf))) > 0) {
+        for (off = 0; off < retval; off += d->d_reclen) {
+            d = (struct dirent *)(dbuf + off);
+            if (!lflag) {
+                cprintf("%s%s\n", d->d_name, d->d_type == DT_DIR ? "/" : "");
+                continue;
+            }
+            dp = (struct dirent_plus *)d;
+            cprintf("%c%c%c%c%c %10u %s\n",
+                    (dp->d_attr & AM_DIR) ? 'd' : '-',
+                    (dp->d_attr & AM_RDO) ? 'r' : '-',
+                    (dp->d_attr & AM_HID) ? 'h' : '-',
+                    (dp->d_attr & AM_SYS) ? 's' : '-',
+                    (dp->d_attr & AM_ARC) ? 'a' : '-',
+                    dp->d_size, dp->d_name);
+        }
     }
+    if (retval < 0)
+        cprintf("Cannot read %s\n", path);
     closedir(&dir);
+    return 0;
 }
 
 /* Support multiple files. */
@@ -590,6 +642,155 @@ int touch(int argc, char **argv) {
     return 0;
 }
 
+/* The data is copied by the kernel, the destination is preallocated so it
+ * can be laid out contiguously.
+ */
+int cp(int argc, char **argv) {
+    int in, out, retval;
+    off_t size;
+
+    if (argc != 3) {
+        cprintf("Usage: cp <src> <dst>\n");
+        return 0;
+    }
+    if ((in = open(argv[1], O_RDONLY, 0)) < 0) {
+        cprintf("Cannot open %s\n", argv[1]);
+        return 0;
+    }
+    if ((out = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0)) < 0) {
+        cprintf("Cannot create %s\n", argv[2]);
+        close(in);
+        return 0;
+    }
+    size = lseek(in, 0, SEEK_END);
+    lseek(in, 0, SEEK_SET);
+    if (size > 0)
+        fallocate(out, size);
+
+    while ((retval = copy_file_range(in, out, 1024 * 1024)) > 0)
+        ;
+    if (retval < 0)
+        cprintf("Cannot copy %s to %s (%d)\n", argv[1], argv[2], retval);
+    close(out);
+    close(in);
+    return 0;
+}
+
+/* Support multiple directories. */
+int mkdir_cmd(int argc, char **argv) {
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (mkdir(argv[i]) < 0)
+            cprintf("Cannot mkdir %s\n", argv[i]);
+    }
+    return 0;
+}
+
+/* e.g. "mount elmfat hdb /data sync", "mount tmpfs - /scratch" */
+int mount_cmd(int argc, char **argv) {
+    int flags = 0, retval;
+
+    if (argc < 4) {
+        cprintf("Usage: mount <type> <device|-> <path> [sync]\n");
+        return 0;
+    }
+    if (argc > 4 && !strcmp(argv[4], "sync"))
+        flags |= MNT_SYNC;
+    retval = mount(strcmp(argv[2], "-") ? argv[2] : NULL, argv[3], argv[1], flags);
+    if (retval < 0)
+        cprintf("Cannot mount %s at %s (%d)\n", argv[2], argv[3], retval);
+    return 0;
+}
+
+int umount_cmd(int argc, char **argv) {
+    int i, retval;
+    for (i = 1; i < argc; i++) {
+        retval = umount(argv[i]);
+        if (retval < 0)
+            cprintf("Cannot umount %s (%d)\n", argv[i], retval);
+    }
+    return 0;
+}
+
+int sync_cmd(int argc, char **argv) {
+    if (sync() < 0)
+        cprintf("sync failed\n");
+    return 0;
+}
+
+/* Counters are cumulative since boot, times are in TSC cycles. ovl counts
+ * requests that started while another disk was busy (e.g. hdb and hdc on
+ * different channels from different CPUs).
+ * busy close to the elapsed time of a test means it is bound on the device,
+ * well below it means the time goes to the CPU (FatFs, copying).
+ */
+int iostat_cmd(int argc, char **argv) {
+    struct disk_stat st;
+    int dev, dir, i;
+    int hist = (argc > 1 && !strcmp(argv[1], "-h"));
+
+    cprintf("%-6s %8s %8s %8s %8s %8s %8s %3s %6s %12s %6s\n", "dev",
+            "r_ios", "r_sect", "r_merge", "w_ios", "w_sect", "w_merge",
+            "inf", "ovl", "busy_kcyc", "avgqu");
+    for (dev = 0; iostat(dev, &st) == 0; dev++) {
+        uint32_t avgqu = st.busy_cycles ? (uint32_t)(st.wait_cycles * 100 / st.busy_cycles) : 0;
+
+        cprintf("%-6s %8u %8u %8u %8u %8u %8u %3u %6u %12u %3u.%02u\n", st.name,
+                st.ios[DISK_STAT_READ], st.sectors[DISK_STAT_READ], st.merges[DISK_STAT_READ],
+                st.ios[DISK_STAT_WRITE], st.sectors[DISK_STAT_WRITE], st.merges[DISK_STAT_WRITE],
+                st.inflight, st.overlapped, (uint32_t)(st.busy_cycles / 1000), avgqu / 100, avgqu % 100);
+
+        if (!hist)
+            continue;
+        if (st.discards)
+            cprintf("  discard: %u requests, %u sectors\n", st.discards, st.discard_sectors);
+        for (dir = DISK_STAT_READ; dir <= DISK_STAT_WRITE; dir++) {
+            cprintf("  %s latency (cycles):\n", dir == DISK_STAT_READ ? "read" : "write");
+            for (i = 0; i < DISK_LAT_BUCKETS; i++)
+                if (st.lat_hist[dir][i])
+                    cprintf("    >= 2^%-2d %8u\n", i, st.lat_hist[dir][i]);
+        }
+    }
+    return 0;
+}
+
+#define DF_MNT_MAX  8
+
+static void df_print(const struct statfs *st)
+{
+    uint32_t size = (uint32_t)((uint64_t)st->f_blocks * st->f_bsize / 1024);
+    uint32_t avail = (uint32_t)((uint64_t)st->f_bfree * st->f_bsize / 1024);
+    uint32_t use = st->f_blocks ? (st->f_blocks - st->f_bfree) * 100ULL / st->f_blocks : 0;
+
+    cprintf("%-8s %10u %10u %10u %3u%% %s\n", st->f_fstypename,
+            size, size - avail, avail, use, st->f_mntonname);
+}
+
+/* Sizes are in KiB.  Free space comes from the counters the file systems
+ * keep in memory, so it is cheap to poll.
+ */
+int df_cmd(int argc, char **argv) {
+    struct statfs st[DF_MNT_MAX];
+    int i, n, retval;
+
+    cprintf("%-8s %10s %10s %10s %4s %s\n", "type", "size_kb", "used_kb", "avail_kb", "use", "mounted on");
+    if (argc < 2) {
+        n = getfsstat(st, DF_MNT_MAX);
+        if (n < 0)
+            cprintf("Cannot get file systems (%d)\n", n);
+        for (i = 0; i < n; i++)
+            df_print(&st[i]);
+        return 0;
+    }
+    for (i = 1; i < argc; i++) {
+        if ((retval = statfs(argv[i], &st[0])) < 0)
+            cprintf("Cannot statfs %s (%d)\n", argv[i], retval);
+        else
+            df_print(&st[0]);
+    }
+    return 0;
+}
+
 void shell()
 {
   char *buf;